@@ -0,0 +1,520 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*	Headless benchmark of the voxel core:
+		voxelgem_bench [--iterations N] [--output results.json] [model.qb ...]
+	Runs on synthetic models plus every given .qb file and writes the results as JSON,
+	to stdout unless an output file is given. */
+
+#include "glviewport.h"
+#include "sceneproxy.h"
+#include "transform.h"
+#include "voxelaggregate.h"
+#include "voxelkernels.h"
+#include "voxelscene.h"
+#include "tools/floodfill.h"
+#include "util/threadpool.h"
+
+#include <QApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <QTemporaryDir>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <vector>
+
+void qubicle_import(const QString &filename, SceneProxy *sceneP);
+void qubicle_export(const QString &filename, SceneProxy *sceneP, bool trove_maps);
+
+// allocation counting; operator new[] and delete[] forward to these
+static std::atomic<uint64_t> g_allocCount(0);
+static std::atomic<uint64_t> g_allocBytes(0);
+
+void* operator new(size_t size)
+{
+	++g_allocCount;
+	g_allocBytes += size;
+	if (void *mem = std::malloc(size ? size : 1))
+		return mem;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *mem) noexcept
+{
+	std::free(mem);
+}
+
+//! exposes the neighbour mask pass that tesselation starts with
+class MaskProbe: public VoxelGrid
+{
+	public:
+		MaskProbe(const VoxelGrid &grid): VoxelGrid(grid) {}
+		void masks(const VoxelGrid* neighbourGrids[27], int *masks) const { getNeighbourMasks(neighbourGrids, masks); }
+};
+
+//! flood fills without mouse input
+class ProbeFloodFill: public FloodFillTool
+{
+	public:
+		using FloodFillTool::fillVolume;
+};
+
+struct BenchModel
+{
+	std::string name;
+	std::unique_ptr<VoxelAggregate> aggregate;
+	uint64_t voxels = 0;
+};
+
+struct BenchResult
+{
+	std::string name;
+	std::string model;
+	std::string unit;
+	uint64_t items;
+	int iterations;
+	double totalMs;
+	double nsPerItem;
+	double allocsPerIteration;
+	double allocBytesPerIteration;
+};
+
+class VoxelBench
+{
+	public:
+		VoxelBench(int iterations): iterations(iterations) {}
+		void run(BenchModel &model, SceneProxy *proxy, GlViewportWidget *viewport, VoxelScene *scene);
+		void writeJson(std::ostream &out) const;
+		static uint64_t countVoxels(const VoxelAggregate &aggregate);
+		static BenchModel makeSphere(int radius);
+		static BenchModel makeNoise(int size, float density);
+		static bool loadModel(const QString &fileName, VoxelScene *scene, SceneProxy *proxy, BenchModel &model);
+	protected:
+		/*! runs func once to warm up, then times it over all iterations. reset runs after
+			each call outside of the measurement, to undo what func did */
+		void measure(const std::string &name, const BenchModel &model, uint64_t items, const char *unit,
+					 std::function<void()> func, std::function<void()> reset = nullptr);
+		int iterations;
+		std::vector<BenchResult> results;
+};
+
+void VoxelBench::measure(const std::string &name, const BenchModel &model, uint64_t items, const char *unit,
+						 std::function<void()> func, std::function<void()> reset)
+{
+	func();
+	if (reset)
+		reset();
+	std::chrono::steady_clock::duration elapsed(0);
+	uint64_t allocs = 0, allocBytes = 0;
+	for (int i = 0; i < iterations; ++i)
+	{
+		uint64_t allocStart = g_allocCount, bytesStart = g_allocBytes;
+		auto start = std::chrono::steady_clock::now();
+		func();
+		elapsed += std::chrono::steady_clock::now() - start;
+		allocs += g_allocCount - allocStart;
+		allocBytes += g_allocBytes - bytesStart;
+		if (reset)
+			reset();
+	}
+	BenchResult result;
+	result.name = name;
+	result.model = model.name;
+	result.unit = unit;
+	result.items = items;
+	result.iterations = iterations;
+	result.totalMs = std::chrono::duration<double, std::milli>(elapsed).count();
+	result.nsPerItem = items ? result.totalMs * 1e6 / (double(items) * iterations) : 0.0;
+	result.allocsPerIteration = double(allocs) / iterations;
+	result.allocBytesPerIteration = double(allocBytes) / iterations;
+	results.push_back(result);
+	std::cerr << model.name << " / " << name << ": " << result.nsPerItem << " ns/" << unit << std::endl;
+}
+
+void VoxelBench::run(BenchModel &model, SceneProxy *proxy, GlViewportWidget *viewport, VoxelScene *scene)
+{
+	VoxelAggregate &ag = *model.aggregate;
+	const blockMap_t &blocks = ag.getBlockMap();
+	IBBox bound(IVector3D(0, 0, 0), IVector3D(0, 0, 0));
+	if (!ag.getBound(bound) || model.voxels == 0)
+	{
+		std::cerr << "skipping empty model " << model.name << std::endl;
+		return;
+	}
+
+	//== tesselation ==//
+	std::vector<const VoxelGrid*> grids;
+	std::vector<std::array<const VoxelGrid*, 27>> neighbours;
+	for (auto &block: blocks)
+	{
+		grids.push_back(block.second.get());
+		neighbours.emplace_back();
+		ag.getNeighbours(block.second->getGridPos(), neighbours.back().data());
+	}
+	std::unique_ptr<GlVoxelVertex_t[]> vertices(new GlVoxelVertex_t[RenderGrid::maxVertices()]);
+	measure("tesselate", model, model.voxels, "voxel", [&]()
+	{
+		int nTris[2];
+		for (size_t i = 0; i < grids.size(); ++i)
+			grids[i]->tesselate(vertices.get(), nTris, neighbours[i].data());
+	});
+	std::unique_ptr<GlPackedVoxelVertex_t[]> packedVertices(new GlPackedVoxelVertex_t[RenderGrid::maxVertices()]);
+	measure("tesselate_packed", model, model.voxels, "voxel", [&]()
+	{
+		int nTris[2];
+		for (size_t i = 0; i < grids.size(); ++i)
+			grids[i]->tesselate(packedVertices.get(), nTris, neighbours[i].data());
+	});
+	std::unique_ptr<GlVoxelFace_t[]> faces(new GlVoxelFace_t[RenderGrid::maxVertices()]);
+	measure("tesselate_faces", model, model.voxels, "voxel", [&]()
+	{
+		int nTris[2];
+		for (size_t i = 0; i < grids.size(); ++i)
+			grids[i]->tesselate(faces.get(), nTris, neighbours[i].data());
+	});
+	measure("tesselate_greedy", model, model.voxels, "voxel", [&]()
+	{
+		int nTris[2];
+		for (size_t i = 0; i < grids.size(); ++i)
+			grids[i]->tesselateGreedy(vertices.get(), nTris, neighbours[i].data());
+	});
+
+	//== neighbour masks ==//
+	std::vector<std::unique_ptr<MaskProbe>> probes;
+	for (auto grid: grids)
+		probes.emplace_back(new MaskProbe(*grid));
+	std::unique_ptr<int[]> masks(new int[GRID_VOLUME]);
+	measure("neighbour_masks", model, model.voxels, "voxel", [&]()
+	{
+		for (size_t i = 0; i < probes.size(); ++i)
+			probes[i]->masks(neighbours[i].data(), masks.get());
+	});
+
+	//== ray casting ==//
+	// rays from a sphere around the model towards random points inside its bound
+	QVector3D center = 0.5f * QVector3D(bound.pMin.x + bound.pMax.x, bound.pMin.y + bound.pMax.y,
+										bound.pMin.z + bound.pMax.z);
+	QVector3D extent = QVector3D(bound.pMax.x - bound.pMin.x, bound.pMax.y - bound.pMin.y,
+								 bound.pMax.z - bound.pMin.z);
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> unit(-1.f, 1.f);
+	RayPacket rays;
+	const int rayCount = 1 << 16;
+	for (int i = 0; i < rayCount; ++i)
+	{
+		QVector3D onSphere(unit(rng), unit(rng), unit(rng));
+		if (onSphere.lengthSquared() < 1e-4f)
+			onSphere = QVector3D(1.f, 0.f, 0.f);
+		QVector3D target = center + 0.5f * QVector3D(unit(rng) * extent.x(), unit(rng) * extent.y(), unit(rng) * extent.z());
+		ray_t ray;
+		ray.from = center + onSphere.normalized() * extent.length();
+		ray.dir = (target - ray.from).normalized();
+		ray.t_min = 0.f;
+		ray.t_max = 1e6f;
+		rays.add(ray);
+	}
+	std::vector<SceneRayHit> hits(rayCount);
+	measure("ray_cast", model, rayCount, "ray", [&]()
+	{
+		for (int i = 0; i < rayCount; ++i)
+			ag.rayIntersect(rays.getRay(i), hits[i]);
+	});
+	measure("ray_cast_batch", model, rayCount, "ray", [&]()
+	{
+		ag.rayIntersectBatch(rays, hits.data());
+	});
+
+	//== merge / applyChanges ==//
+	// the model moved by one voxel changes nearly every voxel of the surface
+	std::unique_ptr<VoxelAggregate> shifted(transformAggregate(&ag, VTTranslate(IVector3D(1, 0, 0))));
+	std::unique_ptr<VoxelAggregate> target(ag.duplicate());
+	measure("merge", model, model.voxels, "voxel", [&]()
+	{
+		target->merge(*shifted);
+	}, [&]()
+	{
+		target.reset(ag.duplicate());
+	});
+	std::unique_ptr<AggregateMemento> memento(new AggregateMemento);
+	measure("apply_changes", model, model.voxels, "voxel", [&]()
+	{
+		target->applyChanges(*shifted, memento.get());
+	}, [&]()
+	{
+		target.reset(ag.duplicate());
+		memento.reset(new AggregateMemento);
+	});
+	shifted.reset();
+	target.reset();
+	memento.reset();
+
+	//== transforms ==//
+	std::unique_ptr<VoxelAggregate> transformed;
+	auto dropTransformed = [&]() { transformed.reset(); };
+	measure("transform_translate_blocks", model, model.voxels, "voxel", [&]()
+	{
+		transformed.reset(transformAggregate(&ag, VTTranslate(IVector3D(GRID_LEN, 0, -GRID_LEN))));
+	}, dropTransformed);
+	measure("transform_translate", model, model.voxels, "voxel", [&]()
+	{
+		transformed.reset(transformAggregate(&ag, VTTranslate(IVector3D(5, 3, 1))));
+	}, dropTransformed);
+	measure("transform_mirror", model, model.voxels, "voxel", [&]()
+	{
+		transformed.reset(transformAggregate(&ag, VTMirror(0, 0)));
+	}, dropTransformed);
+	measure("transform_rotate", model, model.voxels, "voxel", [&]()
+	{
+		transformed.reset(transformAggregate(&ag, VTRotate(2, VTRotate::Rot90)));
+	}, dropTransformed);
+
+	//== scene based: flood fill and .qb I/O ==//
+	VoxelLayer *layer = new VoxelLayer;
+	layer->aggregate = ag.duplicate();
+	layer->name = model.name;
+	int layerN = proxy->layerCount();
+	proxy->insertLayer(layer, layerN);
+	proxy->setActiveLayer(layerN);
+
+	// fill the connected region of the first voxel's color
+	IVector3D seedPos;
+	const VoxelEntry *seedVoxel = nullptr;
+	for (auto &block: blocks)
+	{
+		std::unique_ptr<VoxelEntry[]> dense(new VoxelEntry[GRID_VOLUME]);
+		block.second->getVoxels(dense.get());
+		for (int i = 0; i < GRID_VOLUME && !seedVoxel; ++i)
+			if (dense[i].flags & Voxel::VF_NON_EMPTY)
+			{
+				const IVector3D &gridPos = block.second->getGridPos();
+				seedPos = IVector3D(gridPos.x + (i & (GRID_LEN - 1)), gridPos.y + ((i >> LOG_GRID_LEN) & (GRID_LEN - 1)),
+									gridPos.z + (i >> (2 * LOG_GRID_LEN)));
+				seedVoxel = layer->aggregate->getVoxel(seedPos);
+			}
+		if (seedVoxel)
+			break;
+	}
+	ProbeFloodFill fill;
+	fill.initialize(scene);
+	ToolEvent event(viewport, nullptr, ray_t());
+	int filled = fill.fillVolume(event, seedVoxel, seedPos, layer->aggregate);
+	measure("flood_fill", model, filled, "voxel", [&]()
+	{
+		fill.fillVolume(event, seedVoxel, seedPos, layer->aggregate);
+	});
+
+	// save and load with only this model in the scene
+	while (proxy->layerCount() > 1)
+		proxy->deleteLayer(0);
+	QTemporaryDir tempDir;
+	QString fileName = QDir(tempDir.path()).filePath("bench.qb");
+	measure("qb_save", model, model.voxels, "voxel", [&]()
+	{
+		qubicle_export(fileName, proxy, false);
+	});
+	measure("qb_load", model, model.voxels, "voxel", [&]()
+	{
+		qubicle_import(fileName, proxy);
+	}, [&]()
+	{
+		while (proxy->layerCount() > 1)
+			proxy->deleteLayer(proxy->layerCount() - 1);
+	});
+}
+
+static void writeString(std::ostream &out, const std::string &str)
+{
+	out << '"';
+	for (char c: str)
+	{
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if ((unsigned char)c < 0x20)
+			out << ' ';
+		else
+			out << c;
+	}
+	out << '"';
+}
+
+void VoxelBench::writeJson(std::ostream &out) const
+{
+	out << "{\n  \"benchmark\": \"voxelgem_bench\",\n";
+	out << "  \"isa\": ";
+	writeString(out, VoxelKernels::isaName(VoxelKernels::activeIsa()));
+#ifdef VG_VOXEL_SOA
+	out << ",\n  \"layout\": \"soa\"";
+#else
+	out << ",\n  \"layout\": \"aos\"";
+#endif
+	out << ",\n  \"threads\": " << ThreadPool::global().size();
+	out << ",\n  \"iterations\": " << iterations;
+	out << ",\n  \"results\": [";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult &res = results[i];
+		out << (i ? ",\n" : "\n") << "    {\"name\": ";
+		writeString(out, res.name);
+		out << ", \"model\": ";
+		writeString(out, res.model);
+		out << ", \"unit\": ";
+		writeString(out, res.unit);
+		out << ", \"items\": " << res.items << ", \"total_ms\": " << res.totalMs
+			<< ", \"ns_per_item\": " << res.nsPerItem
+			<< ", \"allocs_per_iteration\": " << res.allocsPerIteration
+			<< ", \"alloc_bytes_per_iteration\": " << res.allocBytesPerIteration << "}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+uint64_t VoxelBench::countVoxels(const VoxelAggregate &aggregate)
+{
+	uint64_t count = 0;
+	std::unique_ptr<VoxelEntry[]> dense(new VoxelEntry[GRID_VOLUME]);
+	for (auto &block: aggregate.getBlockMap())
+	{
+		block.second->getVoxels(dense.get());
+		for (int i = 0; i < GRID_VOLUME; ++i)
+			count += (dense[i].flags & Voxel::VF_NON_EMPTY) ? 1 : 0;
+	}
+	return count;
+}
+
+//! solid sphere in four color bands, the typical case of large uniform regions
+BenchModel VoxelBench::makeSphere(int radius)
+{
+	BenchModel model;
+	model.name = "sphere_r" + std::to_string(radius);
+	model.aggregate.reset(new VoxelAggregate);
+	const rgba_t bands[4] = { rgba_t(200, 60, 60, 255), rgba_t(60, 200, 60, 255),
+							  rgba_t(60, 60, 200, 255), rgba_t(200, 200, 60, 255) };
+	for (int z = -radius; z <= radius; ++z)
+		for (int y = -radius; y <= radius; ++y)
+			for (int x = -radius; x <= radius; ++x)
+	{
+		if (x * x + y * y + z * z > radius * radius)
+			continue;
+		VoxelEntry voxel;
+		voxel.col = bands[((z + radius) * 4) / (2 * radius + 1)];
+		voxel.flags = Voxel::VF_NON_EMPTY;
+		model.aggregate->setVoxel(IVector3D(x, y, z), voxel);
+	}
+	model.voxels = countVoxels(*model.aggregate);
+	return model;
+}
+
+//! random voxels of random colors, the worst case for palettes and tesselation
+BenchModel VoxelBench::makeNoise(int size, float density)
+{
+	BenchModel model;
+	model.name = "noise_" + std::to_string(size);
+	model.aggregate.reset(new VoxelAggregate);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> chance(0.f, 1.f);
+	std::uniform_int_distribution<int> channel(0, 255);
+	for (int z = 0; z < size; ++z)
+		for (int y = 0; y < size; ++y)
+			for (int x = 0; x < size; ++x)
+	{
+		if (chance(rng) >= density)
+			continue;
+		VoxelEntry voxel;
+		voxel.col = rgba_t(channel(rng), channel(rng), channel(rng), 255);
+		voxel.flags = Voxel::VF_NON_EMPTY;
+		model.aggregate->setVoxel(IVector3D(x, y, z), voxel);
+	}
+	model.voxels = countVoxels(*model.aggregate);
+	return model;
+}
+
+//! merges all layers of a .qb file into one aggregate
+bool VoxelBench::loadModel(const QString &fileName, VoxelScene *scene, SceneProxy *proxy, BenchModel &model)
+{
+	int firstLayer = proxy->layerCount();
+	qubicle_import(fileName, proxy);
+	if (proxy->layerCount() == firstLayer)
+		return false;
+	model.name = QFileInfo(fileName).fileName().toStdString();
+	model.aggregate.reset(new VoxelAggregate);
+	for (int i = firstLayer; i < proxy->layerCount(); ++i)
+		model.aggregate->merge(*proxy->getLayer(i)->aggregate);
+	while (proxy->layerCount() > firstLayer)
+		proxy->deleteLayer(proxy->layerCount() - 1);
+	model.voxels = countVoxels(*model.aggregate);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	// the scene needs a viewport widget, but nothing gets shown
+	if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	QApplication app(argc, argv);
+
+	int iterations = 5;
+	std::string output;
+	QStringList files;
+	QStringList args = app.arguments();
+	for (int i = 1; i < args.size(); ++i)
+	{
+		if (args[i] == "--iterations" && i + 1 < args.size())
+			iterations = std::max(1, args[++i].toInt());
+		else if (args[i] == "--output" && i + 1 < args.size())
+			output = args[++i].toStdString();
+		else
+			files.append(args[i]);
+	}
+
+	// the core logs to std::cout, keep that out of the JSON
+	std::streambuf *jsonBuf = std::cout.rdbuf(std::cerr.rdbuf());
+
+	VoxelScene scene;
+	GlViewportWidget viewport(&scene);
+	SceneProxy proxy(&scene);
+
+	std::vector<BenchModel> models;
+	models.push_back(VoxelBench::makeSphere(48));
+	models.push_back(VoxelBench::makeNoise(64, 0.4f));
+	for (auto &file: files)
+	{
+		BenchModel model;
+		if (VoxelBench::loadModel(file, &scene, &proxy, model))
+			models.push_back(std::move(model));
+		else
+			std::cerr << "could not load " << file.toStdString() << std::endl;
+	}
+
+	VoxelBench bench(iterations);
+	for (auto &model: models)
+		bench.run(model, &proxy, &viewport, &scene);
+
+	std::cout.rdbuf(jsonBuf);
+	if (output.empty())
+		bench.writeJson(std::cout);
+	else
+	{
+		std::ofstream out(output);
+		bench.writeJson(out);
+		if (!out)
+		{
+			std::cerr << "could not write " << output << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -49,8 +49,10 @@ class SceneOp
 {
 	public:
 		virtual void operator()(rgba_t data, int x, int y, int z) = 0;
-		virtual rgba_t operator()(int x, int y, int z) const { return rgba_t(0); } // TODO: make pure virtual
+		//! entry may be null for positions without block
+		virtual rgba_t operator()(const VoxelEntry *entry) const { return rgba_t(0); } // TODO: make pure virtual
 		void setAggregate(VoxelAggregate* agg) { aggregate = agg; }
+		const VoxelAggregate* getAggregate() const { return aggregate; }
 		static bool matches(rgba_t c1, rgba_t c2)
 		{
 			return ((c1.raw ^ c2.raw) & col_mask.raw) == 0;
@@ -68,10 +70,8 @@ class BaseColOp: public SceneOp
 			IVector3D pos(x, y, z);
 			aggregate->setVoxel(pos, voxel);
 		}
-		rgba_t operator()(int x, int y, int z) const override
+		rgba_t operator()(const VoxelEntry *entry) const override
 		{
-			IVector3D pos(x, y, z);
-			const VoxelEntry *entry = aggregate->getVoxel(pos);
 			if (entry && entry->flags & Voxel::VF_NON_EMPTY)
 			{
 				rgba_t data(entry->col.raw);
@@ -105,10 +105,8 @@ class TypeMapOp: public SceneOp
 				aggregate->setVoxel(pos, voxel);
 			}
 		}
-		rgba_t operator()(int x, int y, int z) const override
+		rgba_t operator()(const VoxelEntry *entry) const override
 		{
-			IVector3D pos(x, y, z);
-			const VoxelEntry *entry = aggregate->getVoxel(pos);
 			if (entry && entry->flags & Voxel::VF_NON_EMPTY)
 			{
 				int material = entry->getMaterial();
@@ -143,10 +141,8 @@ class SpecMapOp: public SceneOp
 				aggregate->setVoxel(pos, voxel);
 			}
 		}
-		rgba_t operator()(int x, int y, int z) const override
+		rgba_t operator()(const VoxelEntry *entry) const override
 		{
-			IVector3D pos(x, y, z);
-			const VoxelEntry *entry = aggregate->getVoxel(pos);
 			if (entry && entry->flags & Voxel::VF_NON_EMPTY)
 			{
 				int specular = entry->getSpecular();
@@ -174,10 +170,8 @@ class AlphaMapOp: public SceneOp
 			voxel.col.a = data.r;
 			aggregate->setVoxel(pos, voxel);
 		}
-		rgba_t operator()(int x, int y, int z) const override
+		rgba_t operator()(const VoxelEntry *entry) const override
 		{
-			IVector3D pos(x, y, z);
-			const VoxelEntry *entry = aggregate->getVoxel(pos);
 			if (entry && entry->flags & Voxel::VF_NON_EMPTY)
 			{
 				if (matches(entry->col, refpoint_col))
@@ -389,10 +383,33 @@ void write_layer(QDataStream &fstream, const std::string &name, IBBox bound, Sce
 	fstream << bound.pMax[2] - bound.pMin[2];
 	// matrix position; z gets inverted here => upper bound becomes lower pos
 	fstream << bound.pMin[0] << bound.pMin[1] << -bound.pMax[2] + 1;
-	if (compressed)
+
+	// slices are written in z order, so look up the blocks of one block layer at a time
+	const VoxelAggregate *aggregate = dataOp.getAggregate();
+	const int gridMask = ~(GRID_LEN - 1);
+	const int blockX0 = bound.pMin[0] >> LOG_GRID_LEN;
+	const int blockY0 = bound.pMin[1] >> LOG_GRID_LEN;
+	const int blocksX = ((bound.pMax[0] - 1) >> LOG_GRID_LEN) - blockX0 + 1;
+	std::vector<const VoxelGrid*> blocks;
+	auto voxelData = [&](int x, int y, int z)
+	{
+		const VoxelGrid *grid = blocks[(x >> LOG_GRID_LEN) - blockX0 + ((y >> LOG_GRID_LEN) - blockY0) * blocksX];
+		if (!grid)
+			return dataOp(nullptr);
+		return dataOp(grid->getVoxel(IVector3D(x & (GRID_LEN - 1), y & (GRID_LEN - 1), z & (GRID_LEN - 1))));
+	};
+
+	// voxels; z gets inverted here
+	for (int z = bound.pMax[2] - 1; z >= bound.pMin[2]; --z)
 	{
-		// voxels; z gets inverted here
-		for (int z =  bound.pMax[2] - 1; z >= bound.pMin[2]; --z)
+		if (z == bound.pMax[2] - 1 || (z & (GRID_LEN - 1)) == GRID_LEN - 1)
+		{
+			IBBox layerBound(IVector3D(bound.pMin[0], bound.pMin[1], std::max(z & gridMask, bound.pMin[2])),
+							 IVector3D(bound.pMax[0], bound.pMax[1], z + 1));
+			blocks.clear();
+			aggregate->forEachBlock(layerBound, [&](const VoxelGrid *grid, const IBBox &) { blocks.push_back(grid); });
+		}
+		if (compressed)
 		{
 			rgba_t lastData(0);
 			uint32_t count = 0;
@@ -400,7 +417,7 @@ void write_layer(QDataStream &fstream, const std::string &name, IBBox bound, Sce
 			for (int y = bound.pMin[1]; y < bound.pMax[1]; ++y)
 				for (int x = bound.pMin[0]; x < bound.pMax[0]; ++x)
 			{
-				rgba_t data = dataOp(x, y, z);
+				rgba_t data = voxelData(x, y, z);
 				if (data != lastData)
 				{
 					writeRun(fstream, lastData, count);
@@ -413,15 +430,13 @@ void write_layer(QDataStream &fstream, const std::string &name, IBBox bound, Sce
 			count = 0;
 			fstream << NEXTSLICEFLAG.raw;
 		}
-	}
-	else
-	{
-		// voxels; z gets inverted here
-		for (int z =  bound.pMax[2] - 1; z >= bound.pMin[2]; --z)
+		else
+		{
 			for (int y = bound.pMin[1]; y < bound.pMax[1]; ++y)
 				for (int x = bound.pMin[0]; x < bound.pMax[0]; ++x)
-		{
-			fstream << dataOp(x, y, z).raw;
+			{
+				fstream << voxelData(x, y, z).raw;
+			}
 		}
 	}
 }
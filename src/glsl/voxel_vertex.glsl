@@ -7,6 +7,8 @@ layout(location = 2) in uint v_index;
 layout(location = 3) in uint v_mat_index;
 layout(location = 4) in uint v_tex_index;
 layout(location = 5) in float v_occlusion;
+// GlPackedVoxelVertex_t: replaces all but v_color, position is relative to the block origin
+layout(location = 6) in uint v_packed;
 out vec4 frag_color;
 out vec3 frag_normal;
 out vec3 frag_tangent;
@@ -17,22 +19,71 @@ out float frag_occlusion;
 
 uniform mat4 mvp_mat;
 uniform mat4 view_mat;
+// RenderOptions::VertexFormats
+uniform int vertex_format;
+// block origin of each VertexArena page, meshes of many blocks get drawn in one call
+uniform samplerBuffer page_origins;
+uniform int page_shift;
+// GlVoxelFace_t records for VERTEX_PULLED, color and attributes
+uniform usamplerBuffer face_buffer;
 
 layout (std140) uniform sRGB_LUT
 {
 	vec4 val[256];
 };
 
+const int VERTEX_FULL = 0;
+const int VERTEX_PACKED = 1;
+const int VERTEX_PULLED = 2;
+
+// corner positions of the faces, by vertex index (4 * face + corner)
+const vec3 face_corners[24] = vec3[24](
+	vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 1), vec3(0, 1, 0),
+	vec3(1, 1, 0), vec3(1, 1, 1), vec3(1, 0, 1), vec3(1, 0, 0),
+	vec3(0, 0, 0), vec3(1, 0, 0), vec3(1, 0, 1), vec3(0, 0, 1),
+	vec3(0, 1, 1), vec3(1, 1, 1), vec3(1, 1, 0), vec3(0, 1, 0),
+	vec3(0, 0, 0), vec3(0, 1, 0), vec3(1, 1, 0), vec3(1, 0, 0),
+	vec3(1, 0, 1), vec3(1, 1, 1), vec3(0, 1, 1), vec3(0, 0, 1));
+
 void main()
 {
-	gl_Position = mvp_mat * vec4(v_position, 1);
-	frag_color = vec4(val[v_color.r].a, val[v_color.g].a, val[v_color.b].a, float(v_color.a)/255.0);
-	frag_pos_view = vec3(view_mat * vec4(v_position, 1));
-	frag_normal = mat3(view_mat) * val[3u * v_index].xyz;
-	frag_tangent = mat3(view_mat) * val[3u * v_index + 1u].xyz;
-	frag_uv = vec3(val[3u * v_index + 2u].xy, v_tex_index);
+	vec3 position = v_position;
+	uvec4 color = v_color;
+	uint index = v_index;
+	uint mat_index = v_mat_index;
+	uint tex_index = v_tex_index;
+	float occlusion = v_occlusion;
+	vec3 block_origin = vec3(0);
+	if (vertex_format != VERTEX_FULL)
+		block_origin = texelFetch(page_origins, gl_VertexID >> page_shift).xyz;
+	if (vertex_format == VERTEX_PACKED)
+	{
+		position = block_origin + vec3(v_packed & 31u, (v_packed >> 5) & 31u, (v_packed >> 10) & 31u);
+		index = (v_packed >> 15) & 31u;
+		mat_index = (v_packed >> 20) & 15u;
+		tex_index = (v_packed >> 24) & 15u;
+		occlusion = float((v_packed >> 28) & 3u);
+	}
+	else if (vertex_format == VERTEX_PULLED)
+	{
+		// the index buffer makes 4 consecutive vertices of each face
+		uvec2 face = texelFetch(face_buffer, gl_VertexID >> 2).rg;
+		uint corner = uint(gl_VertexID) & 3u;
+		color = uvec4(face.r & 255u, (face.r >> 8) & 255u, (face.r >> 16) & 255u, face.r >> 24);
+		index = 4u * ((face.g >> 12) & 7u) + corner;
+		position = block_origin + vec3(face.g & 15u, (face.g >> 4) & 15u, (face.g >> 8) & 15u) + face_corners[index];
+		mat_index = (face.g >> 15) & 15u;
+		tex_index = (face.g >> 19) & 15u;
+		occlusion = float((face.g >> (23u + 2u * corner)) & 3u);
+	}
+	gl_Position = mvp_mat * vec4(position, 1);
+	frag_color = vec4(val[color.r].a, val[color.g].a, val[color.b].a, float(color.a)/255.0);
+	frag_pos_view = vec3(view_mat * vec4(position, 1));
+	frag_normal = mat3(view_mat) * val[3u * index].xyz;
+	frag_tangent = mat3(view_mat) * val[3u * index + 1u].xyz;
+	frag_uv = vec3(val[3u * index + 2u].xy, tex_index);
 	// occlusion goes from 0 (no occlusion) to 3 (occluded quadrants), 4 quadrants considered
-	frag_occlusion = 0.25 * (4 - v_occlusion);
+	frag_occlusion = 0.25 * (4 - occlusion);
 	// just forward
-	frag_mat_index = v_mat_index;
+	frag_mat_index = mat_index;
 }
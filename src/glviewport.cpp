@@ -15,6 +15,7 @@
 #include <iostream>
 #include <cmath>
 #include <QSurfaceFormat>
+#include <QOpenGLContext>
 #include <QOpenGLShaderProgram>
 #include <QMouseEvent>
 //#include <QMatrix4x4>
@@ -109,6 +110,19 @@ GlViewportWidget::GlViewportWidget(VoxelScene *pscene, QWidget *parent):
 	scene->viewport = this;  // TODO: think about a nicer way...
 }
 
+GlViewportWidget::~GlViewportWidget()
+{
+	cleanupGL();
+}
+
+void GlViewportWidget::cleanupGL()
+{
+	// does nothing if the context was never initialized
+	makeCurrent();
+	RenderGrid::cleanupArenas(*this);
+	doneCurrent();
+}
+
 void GlViewportWidget::generateUBOs()
 {
 	m_ubo_LUT = genVertexUBO(*this);
@@ -168,6 +182,11 @@ void GlViewportWidget::initializeGL()
 	generateUBOs();
 	// load shaders
 	initShaders(*this);
+	RenderGrid::initializeShader(getShaderProgram(SHADER_VOXEL));
+	RenderGrid::initializeArenas();
+	connect(context(), &QOpenGLContext::aboutToBeDestroyed, this, &GlViewportWidget::cleanupGL);
+	// a new context after reparenting starts with empty arenas, all meshes and their caches are gone
+	scene->renderInitialized = false;
 	m_normal_tex = genNormalTex(*this);
 
 	QOpenGLShaderProgram* flatProgram = getShaderProgram(SHADER_FLAT_COLOR);
@@ -214,10 +233,7 @@ void GlViewportWidget::paintGL()
 		scene->update();
 	if (tesselationChanged)
 	{
-		for (auto layer: scene->layers)
-		{
-			layer->renderAg->rebuild(*this, &renderOptions);
-		}
+		scene->flatRenderAg->rebuild(*this, &renderOptions);
 		tesselationChanged = false;
 	}
 	// TODO: multiply with devicePixelRatio() or the devicePixelRatioF() for Qt 5.6+
@@ -249,8 +265,9 @@ void GlViewportWidget::paintGL()
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, m_normal_tex);
 	//scene->renderLayer->render(*this);
-	scene->render(*this);
+	scene->render(*this, final);
 	glDisable(GL_CULL_FACE);
+	RenderGrid::endFrame(*this);
 
 #if DEBUG_GL
 	QDebug dbg = qDebug();
@@ -283,6 +300,26 @@ void GlViewportWidget::setViewMode(RenderOptions::Modes mode)
 	}
 };
 
+void GlViewportWidget::setGreedyMeshing(bool enabled)
+{
+	if (enabled != renderOptions.greedyMeshing)
+	{
+		renderOptions.greedyMeshing = enabled;
+		tesselationChanged = true;
+		update();
+	}
+}
+
+void GlViewportWidget::setVertexFormat(RenderOptions::VertexFormats format)
+{
+	if (format != renderOptions.vertexFormat)
+	{
+		renderOptions.vertexFormat = format;
+		tesselationChanged = true;
+		update();
+	}
+}
+
 void GlViewportWidget::setShowGrid(bool enabled)
 {
 	if (enabled != showGrid)
@@ -419,7 +456,7 @@ void GlViewportWidget::on_renderDataChanged()
 void GlViewportWidget::on_layerSettingsChanged(int layerN, int change_flags)
 {
 	bool redraw = false;
-	if (change_flags & VoxelLayer::VISIBILITY_CHANGED)
+	if (change_flags & (VoxelLayer::VISIBILITY_CHANGED | VoxelLayer::BLEND_MODE_CHANGED))
 		redraw = true;
 	if (layerN == scene->activeLayerN)
 	{
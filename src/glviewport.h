@@ -66,8 +66,11 @@ class GlViewportWidget : public QOpenGLWidget, protected QOpenGLFunctions_3_3_Co
 	Q_OBJECT
 	public:
 		GlViewportWidget(VoxelScene *pscene, QWidget *parent = nullptr);
+		~GlViewportWidget();
 		void setSamples(int numSamples);
 		void setViewMode(RenderOptions::Modes mode);
+		void setGreedyMeshing(bool enabled);
+		void setVertexFormat(RenderOptions::VertexFormats format);
 		void setShowGrid(bool enabled);
 		static float sRGB_LUT[1024];
 		GLRenderable* getGrid();
@@ -77,6 +80,9 @@ class GlViewportWidget : public QOpenGLWidget, protected QOpenGLFunctions_3_3_Co
 		void on_activeToolChanged(EditTool *tool);
 		void on_layerSettingsChanged(int layerN, int change_flags);
 		void on_renderDataChanged();
+	protected Q_SLOTS:
+		//! releases the GL resources that live as long as the context
+		void cleanupGL();
 	protected:
 		void generateUBOs();
 		void initializeGL() override;
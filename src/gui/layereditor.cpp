@@ -45,6 +45,8 @@ LayerEditor::LayerEditor(QWidget *parent, SceneProxy *manager):
 	connect(ui->sb_max_z, static_cast<void (QSpinBox::*)(int)>(&QSpinBox::valueChanged),
 			this, [this](int val){ this->adjustUpperBound(val, 2); });
 	connect(ui->group_bound, &QGroupBox::clicked, this, &LayerEditor::on_layer_bound_toggled);
+	connect(ui->cb_blend_mode, static_cast<void (QComboBox::*)(int)>(&QComboBox::currentIndexChanged),
+			this, &LayerEditor::on_blend_mode_changed);
 	connect(ui->action_add_layer, &QAction::triggered, this, &LayerEditor::on_action_add_layer_triggered);
 	connect(ui->action_layer_up, &QAction::triggered, this, &LayerEditor::on_action_layer_up_triggered);
 	connect(ui->action_layer_down, &QAction::triggered, this, &LayerEditor::on_action_layer_down_triggered);
@@ -132,7 +134,7 @@ void LayerEditor::loadLayerDetails(int layerN)
 {
 	// we don't want signals from modifying the UI elements here:
 	QSignalBlocker b1(ui->sb_min_x), b2(ui->sb_min_y), b3(ui->sb_min_z),
-					b4(ui->sb_max_x), b5(ui->sb_max_y), b6(ui->sb_max_z);
+					b4(ui->sb_max_x), b5(ui->sb_max_y), b6(ui->sb_max_z), b7(ui->cb_blend_mode);
 	const VoxelLayer *layer = hub->getLayer(layerN);
 	ui->sb_min_x->setValue(layer->bound.pMin.x);
 	ui->sb_min_x->setMaximum(layer->bound.pMax.x - 1);
@@ -147,6 +149,7 @@ void LayerEditor::loadLayerDetails(int layerN)
 	ui->sb_max_z->setValue(layer->bound.pMax.z);
 	ui->sb_max_z->setMinimum(layer->bound.pMin.z + 1);
 	ui->group_bound->setChecked(layer->useBound);
+	ui->cb_blend_mode->setCurrentIndex(layer->blendMode);
 }
 
 void LayerEditor::activateLayer(int layerNum)
@@ -216,7 +219,7 @@ void LayerEditor::layerSettingsChanged(int layerN, int change_flags)
 		layerWidgets[layerN]->setVisibilityStatus(layer->visible);
 	if (change_flags & VoxelLayer::NAME_CHANGED)
 		layerWidgets[layerN]->setLayerName(QString::fromStdString(layer->name));
-	if (layerN == hub->activeLayer() &&	(change_flags & (VoxelLayer::BOUND_CHANGED | VoxelLayer::USE_BOUND_CHANGED)))
+	if (layerN == hub->activeLayer() &&	(change_flags & (VoxelLayer::BOUND_CHANGED | VoxelLayer::USE_BOUND_CHANGED | VoxelLayer::BLEND_MODE_CHANGED)))
 		loadLayerDetails(layerN);
 }
 
@@ -244,6 +247,12 @@ void LayerEditor::on_layer_bound_toggled(bool enabled)
 	hub->setLayerBoundUse(hub->activeLayer(), enabled);
 }
 
+void LayerEditor::on_blend_mode_changed(int index)
+{
+	// combo box items are in VoxelLayer::BlendMode order
+	hub->setLayerBlendMode(hub->activeLayer(), index);
+}
+
 void LayerEditor::on_action_layer_up_triggered()
 {
 	int activeLayer = hub->activeLayer();
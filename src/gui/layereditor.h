@@ -44,6 +44,7 @@ class LayerEditor: public QObject
 		void activeLayerChanged(int layerN, int prev);
 		void on_nameEdit_editingFinished();
 		void on_layer_bound_toggled(bool enabled);
+		void on_blend_mode_changed(int index);
 		void on_action_add_layer_triggered();
 		void on_action_layer_up_triggered();
 		void on_action_layer_down_triggered();
@@ -7,6 +7,7 @@
  */
 
 #include <QApplication>
+#include <QStringList>
 #include <QSurfaceFormat>
 #include "mainwindow.h"
 
@@ -31,7 +32,15 @@ int main(int argc, char **argv)
 	// create application and load gui
 	QApplication app(argc, argv);
 
-	VGMainWindow window;
+	bool undoJournal = false;
+	QStringList args = app.arguments();
+	for (int i = 1; i < args.size(); ++i)
+	{
+		if (args[i] == "--undo-journal")
+			undoJournal = true;
+	}
+
+	VGMainWindow window(undoJournal);
     window.show();
 
 	return app.exec();
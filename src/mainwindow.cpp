@@ -16,6 +16,7 @@
 #include "voxelscene.h"
 #include "sceneproxy.h"
 #include "transform.h"
+#include "undojournal.h"
 // tools
 #include "tools/draw.h"
 #include "tools/paint.h"
@@ -25,8 +26,9 @@
 #include <QFileDialog>
 #include <QActionGroup>
 #include <QIcon>
+#include <QMessageBox>
 
-VGMainWindow::VGMainWindow():
+VGMainWindow::VGMainWindow(bool undoJournal):
 	mainUi(new Ui::MainWindow),
 	paletteView(new ColorPaletteView),
 	scene(new VoxelScene)
@@ -47,6 +49,11 @@ VGMainWindow::VGMainWindow():
 	mainUi->action_view3D->setActionGroup(viewModeGroup);
 	mainUi->action_view2D->setActionGroup(viewModeGroup);
 	connect(viewModeGroup, &QActionGroup::triggered, this, &VGMainWindow::on_viewModeActionTriggered);
+	vertexFormatGroup = new QActionGroup(this);
+	mainUi->action_vertices_full->setActionGroup(vertexFormatGroup);
+	mainUi->action_vertices_packed->setActionGroup(vertexFormatGroup);
+	mainUi->action_vertices_pulled->setActionGroup(vertexFormatGroup);
+	connect(vertexFormatGroup, &QActionGroup::triggered, this, &VGMainWindow::on_vertexFormatActionTriggered);
 	// color palette
 	ColorPaletteModel *paletteModel = new ColorPaletteModel;
 	colorSet = loadGimpPalette(":assets/trove.gpl");
@@ -63,6 +70,17 @@ VGMainWindow::VGMainWindow():
 	connect(sceneProxy, &SceneProxy::layerSettingsChanged, viewport, &GlViewportWidget::on_layerSettingsChanged);
 	LayerEditor *layer_ed = new LayerEditor(mainUi->layers, sceneProxy);
 	layer_ed->setParent(this);
+	if (undoJournal)
+	{
+		// the journal of a session that did not end cleanly is still around
+		UndoJournal *journal = UndoJournal::findRecoverable();
+		bool recover = journal &&
+			QMessageBox::question(this, "Recover Session", "VoxelGem was not closed properly.\n"
+				"Do you want to recover the unsaved changes of the last session?") == QMessageBox::Yes;
+		if (!journal)
+			journal = new UndoJournal(UndoJournal::newSessionPath());
+		sceneProxy->setJournal(journal, recover);
+	}
 	// TODO: load tools in a better place...
 	ToolInstance *tool = DrawTool::getInstance();
 	addTool(tool);
@@ -124,6 +142,11 @@ void VGMainWindow::on_action_axis_grids_toggled(bool checked)
 	viewport->setShowGrid(checked);
 }
 
+void VGMainWindow::on_action_greedy_meshing_toggled(bool checked)
+{
+	viewport->setGreedyMeshing(checked);
+}
+
 void VGMainWindow::on_action_rotate_x_triggered()
 {
 	const VoxelLayer *layer = sceneProxy->getLayer(sceneProxy->activeLayer());
@@ -228,6 +251,7 @@ void VGMainWindow::on_action_save_triggered()
 		return;
 	// TODO: add proper extension if not entered
 	qubicle_export(fileName, sceneProxy, false);
+	sceneProxy->journalSnapshot(fileName);
 }
 
 void VGMainWindow::on_action_export_trove_triggered()
@@ -297,3 +321,13 @@ void VGMainWindow::on_viewModeActionTriggered(QAction *action)
 	else if (action == mainUi->action_view2D)
 		viewport->setViewMode(RenderOptions::MODE_SLICE);
 }
+
+void VGMainWindow::on_vertexFormatActionTriggered(QAction *action)
+{
+	if (action == mainUi->action_vertices_full)
+		viewport->setVertexFormat(RenderOptions::VERTEX_FULL);
+	else if (action == mainUi->action_vertices_packed)
+		viewport->setVertexFormat(RenderOptions::VERTEX_PACKED);
+	else if (action == mainUi->action_vertices_pulled)
+		viewport->setVertexFormat(RenderOptions::VERTEX_PULLED);
+}
@@ -31,7 +31,9 @@ class VGMainWindow : public QMainWindow
 {
     Q_OBJECT
 	public:
-		VGMainWindow();
+		/*! @param undoJournal: record the session to a disk journal for crash recovery, which also
+			takes undo history beyond the memory budget */
+		explicit VGMainWindow(bool undoJournal = false);
 		virtual ~VGMainWindow();
 		void addTool(ToolInstance *tool);
 	protected:
@@ -45,6 +47,7 @@ class VGMainWindow : public QMainWindow
 		void on_action_undo_triggered();
 		void on_action_redo_triggered();
 		void on_action_axis_grids_toggled(bool checked);
+		void on_action_greedy_meshing_toggled(bool checked);
 		void on_action_rotate_x_triggered();
 		void on_action_rotate_y_triggered();
 		void on_action_rotate_z_triggered();
@@ -61,6 +64,7 @@ class VGMainWindow : public QMainWindow
 		void on_colorSetEntrySelected(const ColorSetEntry &entry);
 		void on_toolActionTriggered(QAction *action);
 		void on_viewModeActionTriggered(QAction *action);
+		void on_vertexFormatActionTriggered(QAction *action);
 	Q_SIGNALS:
 		void colorSelectionChanged(QColor col);
 		void activeToolChanged(EditTool *tool);
@@ -69,6 +73,7 @@ class VGMainWindow : public QMainWindow
 		Ui::MainWindow *mainUi;
 		QActionGroup *toolGroup;
 		QActionGroup *viewModeGroup;
+		QActionGroup *vertexFormatGroup;
 		std::map<QAction *, EditTool *> toolMap;
 		GlViewportWidget *viewport;
 		ColorPaletteView *paletteView;
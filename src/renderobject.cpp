@@ -49,6 +49,69 @@ void GLRenderable::deleteBuffer(QOpenGLFunctions_3_3_Core &glf)
 	glBufferSize = 0;
 }
 
+//======= Frustum =========== //
+
+Frustum::Frustum(const QMatrix4x4 &viewProj)
+{
+	// inside is -w <= x, y, z <= w in clip space, so each plane is row 3 plus or minus row 0, 1 or 2
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			planes[2 * axis][i] = viewProj(3, i) + viewProj(axis, i);
+			planes[2 * axis + 1][i] = viewProj(3, i) - viewProj(axis, i);
+		}
+	}
+}
+
+int Frustum::cullBoxes(const BoundsPacket &boxes, char *visible) const
+{
+	const int count = boxes.size();
+	// the box corner furthest along the plane normal decides, its coordinates come from
+	// pMax where the normal is positive and from pMin otherwise
+	const float *corner[6][3];
+	for (int p = 0; p < 6; ++p)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+			corner[p][axis] = planes[p][axis] >= 0.f ? boxes.pMax[axis].data() : boxes.pMin[axis].data();
+	}
+	int nVisible = 0;
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p)
+		{
+			__m128 dist = _mm_set1_ps(planes[p][3]);
+			for (int axis = 0; axis < 3; ++axis)
+				dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(planes[p][axis]), _mm_loadu_ps(corner[p][axis] + i)));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, _mm_setzero_ps()));
+		}
+		int insideBits = _mm_movemask_ps(inside);
+		for (int j = 0; j < 4; ++j)
+		{
+			visible[i + j] = (insideBits >> j) & 1;
+			nVisible += visible[i + j];
+		}
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; ++p)
+		{
+			float dist = planes[p][3];
+			for (int axis = 0; axis < 3; ++axis)
+				dist += planes[p][axis] * corner[p][axis][i];
+			inside = dist >= 0.f;
+		}
+		visible[i] = inside;
+		nVisible += inside;
+	}
+	return nVisible;
+}
+
 //======= LineGrid =========== //
 
 void LineGrid::setup(QOpenGLFunctions_3_3_Core &glf)
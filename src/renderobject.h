@@ -11,6 +11,7 @@
 
 #include "voxelgem.h"
 
+#include <QMatrix4x4>
 #include <QOpenGLFunctions_3_3_Core>
 #include <QOpenGLVertexArrayObject>
 //#include <QVector3D>
@@ -31,6 +32,54 @@ struct GlVoxelVertex_t
 	unsigned char occlusion;
 };
 
+/*! Compact alternative to GlVoxelVertex_t. The position is relative to the grid origin,
+	which gets supplied per draw, so everything but the color fits into one 32 bit word */
+struct GlPackedVoxelVertex_t
+{
+	enum Bits
+	{
+		POS_BITS = 5,		//!< x, y, z in bits 0-14, 0..GRID_LEN each
+		INDEX_SHIFT = 15,	//!< 5 bits
+		MAT_SHIFT = 20,		//!< 4 bits
+		TEX_SHIFT = 24,		//!< 4 bits
+		OCCLUSION_SHIFT = 28	//!< 2 bits
+	};
+	unsigned char col[4];
+	uint32_t attributes;
+};
+static_assert(sizeof(GlPackedVoxelVertex_t) == 8, "packed vertex must be 8 bytes");
+
+/*! One visible voxel face, read by the vertex shader from a buffer texture. The shader builds
+	the four corners from gl_VertexID, so there are no vertex attributes at all */
+struct GlVoxelFace_t
+{
+	enum Bits
+	{
+		POS_BITS = 4,		//!< x, y, z of the voxel in bits 0-11
+		FACE_SHIFT = 12,	//!< 3 bits
+		MAT_SHIFT = 15,		//!< 4 bits
+		TEX_SHIFT = 19,		//!< 4 bits
+		OCCLUSION_SHIFT = 23	//!< 2 bits for each corner
+	};
+	unsigned char col[4];
+	uint32_t attributes;
+};
+static_assert(sizeof(GlVoxelFace_t) == 8, "face record must be 8 bytes");
+
+//! the six clip planes of a view projection matrix, for culling what is off screen
+class Frustum
+{
+	public:
+		Frustum(const QMatrix4x4 &viewProj);
+		/*! sets visible[i] to 1 if box i intersects the frustum and to 0 if it is outside, four
+			boxes at a time with SSE2. Boxes near the corners may pass without being visible.
+			Returns the number of visible boxes */
+		int cullBoxes(const BoundsPacket &boxes, char *visible) const;
+	protected:
+		//! a, b, c, d of ax + by + cz + d >= 0 for points inside
+		float planes[6][4];
+};
+
 class GLRenderable
 {
 	public:
@@ -9,7 +9,11 @@
 #include "sceneproxy.h"
 #include "voxelscene.h"
 #include "voxelaggregate.h"
+#include "undojournal.h"
 
+#include <QDataStream>
+
+#include <algorithm>
 #include <iostream>
 
 SceneMemento::~SceneMemento()
@@ -20,12 +24,29 @@ SceneMemento::~SceneMemento()
 	delete memento;
 }
 
+size_t SceneMemento::memoryUsage() const
+{
+	size_t bytes = sizeof(SceneMemento);
+	if (memento)
+		bytes += memento->memoryUsage();
+	for (auto layer: sourceLayers)
+		bytes += sizeof(VoxelLayer) + layer->aggregate->memoryUsage();
+	return bytes;
+}
+
 SceneProxy::SceneProxy(VoxelScene *scene_, QObject *parent):
 	QObject(parent), scene(scene_)
 {
 	undoState = editHistory.end();
 }
 
+SceneProxy::~SceneProxy()
+{
+	if (journal)
+		journal->discard();
+	delete journal;
+}
+
 void SceneProxy::dropRedoHistory()
 {
 	if (undoState != editHistory.end())
@@ -35,6 +56,253 @@ void SceneProxy::dropRedoHistory()
 	}
 }
 
+void SceneProxy::commitHistoryEntry()
+{
+	undoState = editHistory.end();
+	editHistory.back().memory = editHistory.back().memoryUsage();
+	// compress older voxel edits, back to the first one still compressed; entries only
+	// get unpacked by undo and redo, which happen near the end of the history
+	auto entry = editHistory.rbegin();
+	for (int i = 0; i < UNCOMPRESSED_HISTORY && entry != editHistory.rend(); ++i)
+		++entry;
+	for (; entry != editHistory.rend(); ++entry)
+	{
+		if (!entry->memento)
+			continue;
+		if (entry->memento->isCompressed())
+			break;
+		entry->memento->compress();
+		entry->memory = entry->memoryUsage();
+	}
+	enforceHistoryBudget();
+}
+
+void SceneProxy::enforceHistoryBudget()
+{
+	HistoryStats stats = getHistoryStats();
+	size_t memory = stats.memory;
+	int evicted = 0, spilled = 0;
+	// with a journal, move voxel edits to disk before giving up any undo steps
+	if (journal && journal->isOpen())
+	{
+		for (auto entry = editHistory.begin(); memory > historyBudget && entry != undoState; ++entry)
+		{
+			if (!entry->memento)
+				continue;
+			qint64 offset = journal->spillMemento(*entry->memento);
+			if (offset < 0)
+				break;
+			delete entry->memento;
+			entry->memento = nullptr;
+			entry->journalOffset = offset;
+			memory -= entry->memory;
+			entry->memory = entry->memoryUsage();
+			memory += entry->memory;
+			++spilled;
+		}
+	}
+	if (spilled)
+		std::cout << "undo history over budget, spilled " << spilled << " entries to the journal\n";
+	// the oldest undo steps go first; redo steps and the current state are kept
+	while (memory > historyBudget && editHistory.begin() != undoState)
+	{
+		memory -= editHistory.front().memory;
+		editHistory.pop_front();
+		++evicted;
+	}
+	if (evicted)
+	{
+		evictedEntries += evicted;
+		std::cout << "undo history over budget, dropped " << evicted << " entries; now "
+				  << editHistory.size() << " entries using " << (memory >> 10) << " KiB\n";
+	}
+}
+
+void SceneProxy::setHistoryBudget(size_t bytes)
+{
+	historyBudget = bytes;
+	enforceHistoryBudget();
+}
+
+HistoryStats SceneProxy::getHistoryStats() const
+{
+	HistoryStats stats = { (int)editHistory.size(), 0, evictedEntries, 0, 0, historyBudget, 0 };
+	for (auto &entry: editHistory)
+	{
+		stats.memory += entry.memory;
+		if (entry.memento && entry.memento->isCompressed())
+			++stats.compressedEntries;
+		else if (!entry.memento && entry.journalOffset >= 0)
+			++stats.spilledEntries;
+	}
+	if (journal)
+		stats.journalSize = journal->size();
+	return stats;
+}
+
+bool SceneProxy::loadSpilled(SceneMemento &state)
+{
+	if (state.memento)
+		return true;
+	if (!journal || state.journalOffset < 0)
+		return false;
+	state.memento = journal->loadMemento(state.journalOffset);
+	// restoring flips the memento, so the journal copy is outdated from here on
+	state.journalOffset = -1;
+	return state.memento != nullptr;
+}
+
+void SceneProxy::setJournal(UndoJournal *journal_, bool recover)
+{
+	if (journal)
+	{
+		journal->discard();
+		delete journal;
+	}
+	journal = journal_;
+	if (!journal)
+		return;
+	if (recover)
+	{
+		if (journal->open(true) && recoverSession())
+			return;
+		std::cout << "(!) session recovery failed, starting a new journal\n";
+		journal->discard();
+	}
+	if (journal->open(false))
+		journal->writeSnapshot(scene->layers, scene->activeLayerN, QString());
+}
+
+void SceneProxy::journalSnapshot(const QString &savedFile)
+{
+	if (journal && journal->isOpen())
+		journal->writeSnapshot(scene->layers, scene->activeLayerN, savedFile);
+}
+
+bool SceneProxy::recoverSession()
+{
+	// the history refers to the scene being replaced
+	editHistory.clear();
+	undoState = editHistory.end();
+	bool replayed = journal->replay([this](UndoJournal::RecordType type, QDataStream &stream)
+									{ return replayRecord(type, stream); });
+	if (!replayed)
+		return false;
+	std::cout << "recovered session";
+	if (!journal->getBaseFile().isEmpty())
+		std::cout << " of " << journal->getBaseFile().toStdString();
+	std::cout << std::endl;
+	emit(renderDataChanged());
+	return true;
+}
+
+bool SceneProxy::replayRecord(int type, QDataStream &stream)
+{
+	qint32 layerN, targetN;
+	// records were valid when written, but the checks keep a corrupt journal from crashing
+	switch (type)
+	{
+		case UndoJournal::SNAPSHOT:
+		{
+			quint32 nLayers;
+			qint32 active;
+			stream >> nLayers >> active;
+			std::vector<VoxelLayer*> loaded;
+			for (quint32 i = 0; i < nLayers && stream.status() == QDataStream::Ok; ++i)
+			{
+				if (VoxelLayer *layer = UndoJournal::readLayer(stream))
+					loaded.push_back(layer);
+			}
+			if (loaded.size() != nLayers || nLayers == 0)
+			{
+				for (auto layer: loaded)
+					delete layer;
+				return false;
+			}
+			// add the snapshot behind the current layers, then drop those
+			int oldCount = layerCount();
+			for (size_t i = 0; i < loaded.size(); ++i)
+			{
+				scene->insertLayer(loaded[i], oldCount + i);
+				emit(layerCreated(oldCount + i));
+			}
+			setActiveLayer(oldCount + std::max(0, std::min(active, (qint32)nLayers - 1)));
+			for (int i = oldCount - 1; i >= 0; --i)
+			{
+				delete scene->removeLayer(i);
+				emit(layerDeleted(i));
+			}
+			break;
+		}
+		case UndoJournal::EDIT_VOXELS:
+		{
+			stream >> layerN;
+			AggregateMemento *memento = UndoJournal::readMemento(stream);
+			if (!memento)
+				return false;
+			if (layerN >= 0 && layerN < layerCount())
+				scene->restoreAggregate(scene->layers[layerN], memento);
+			delete memento;
+			break;
+		}
+		case UndoJournal::ADD_LAYER:
+		{
+			stream >> layerN;
+			VoxelLayer *layer = UndoJournal::readLayer(stream);
+			if (!layer)
+				return false;
+			if (layerN < 0 || layerN > layerCount())
+			{
+				delete layer;
+				break;
+			}
+			scene->insertLayer(layer, layerN);
+			emit(layerCreated(layerN));
+			break;
+		}
+		case UndoJournal::DELETE_LAYER:
+			stream >> layerN;
+			if (layerCount() < 2 || layerN < 0 || layerN >= layerCount())
+				break;
+			moveActiveLayer(layerN);
+			delete scene->removeLayer(layerN);
+			emit(layerDeleted(layerN));
+			break;
+		case UndoJournal::MOVE_LAYER:
+			stream >> layerN >> targetN;
+			if (layerN == targetN || layerN < 0 || layerN >= layerCount() ||
+				targetN < 0 || targetN >= layerCount())
+				break;
+			scene->moveLayer(layerN, targetN);
+			emit(layerMoved(layerN, targetN));
+			break;
+		case UndoJournal::REPLACE_AGGREGATE:
+		{
+			stream >> layerN;
+			VoxelAggregate *aggregate = UndoJournal::readAggregate(stream);
+			if (!aggregate)
+				return false;
+			if (layerN >= 0 && layerN < layerCount())
+				delete scene->replaceAggregate(layerN, aggregate);
+			else
+				delete aggregate;
+			break;
+		}
+		case UndoJournal::LAYER_SETTINGS:
+			stream >> layerN;
+			if (layerN < 0 || layerN >= layerCount())
+				break;
+			if (!UndoJournal::readLayerSettings(stream, *scene->layers[layerN]))
+				return false;
+			scene->invalidateLayer(scene->layers[layerN]);
+			emit(layerSettingsChanged(layerN, VoxelLayer::ALL_CHANGED));
+			break;
+		default:
+			std::cout << "(!) undo journal: unknown record type " << type << std::endl;
+	}
+	return stream.status() == QDataStream::Ok;
+}
+
 void SceneProxy::moveActiveLayer(int layerN)
 {
 	if (layerN == activeLayer())
@@ -68,7 +336,9 @@ void SceneProxy::completeToolAction()
 	scene->applyToolChanges(memento);
 	dropRedoHistory();
 	editHistory.emplace_back(memento, scene->activeLayerN);
-	undoState = editHistory.end();
+	if (journal)
+		journal->writeEdit(scene->activeLayerN, *memento, *scene->layers[scene->activeLayerN]->aggregate);
+	commitHistoryEntry();
 }
 
 bool SceneProxy::createLayer(int layerN)
@@ -92,7 +362,9 @@ bool SceneProxy::createLayer(int layerN)
 	memento.action = SceneMemento::ADD_LAYER;
 	//memento.sourceLayers.push_back(newLayer); // ??
 	memento.targetLayerIndex = layerN;
-	undoState = editHistory.end();
+	commitHistoryEntry();
+	if (journal)
+		journal->writeAddLayer(layerN, *scene->layers[layerN]);
 
 	emit(layerCreated(layerN));
 	return true;
@@ -112,7 +384,9 @@ bool SceneProxy::insertLayer(VoxelLayer *layer, int layerN)
 	SceneMemento &memento = editHistory.back();
 	memento.action = SceneMemento::ADD_LAYER;
 	memento.targetLayerIndex = layerN;
-	undoState = editHistory.end();
+	commitHistoryEntry();
+	if (journal)
+		journal->writeAddLayer(layerN, *scene->layers[layerN]);
 
 	emit(layerCreated(layerN));
 	emit(renderDataChanged());
@@ -132,7 +406,9 @@ bool SceneProxy::deleteLayer(int layerN)
 	memento.action = SceneMemento::DELETE_LAYER;
 	memento.sourceLayers.push_back(removed);
 	memento.targetLayerIndex = layerN;
-	undoState = editHistory.end();
+	commitHistoryEntry();
+	if (journal)
+		journal->writeDeleteLayer(layerN);
 
 	emit(layerDeleted(layerN));
 	emit(renderDataChanged());
@@ -152,7 +428,9 @@ bool SceneProxy::moveLayer(int layerN, int targetN)
 	memento.action = SceneMemento::MOVE_LAYER;
 	memento.sourceLayerIndex = layerN;
 	memento.targetLayerIndex = targetN;
-	undoState = editHistory.end();
+	commitHistoryEntry();
+	if (journal)
+		journal->writeMoveLayer(layerN, targetN);
 
 	emit(layerMoved(layerN, targetN));
 	emit(renderDataChanged());
@@ -190,6 +468,8 @@ bool SceneProxy::setLayerBound(int layerN, const IBBox &bound)
 	if (layerN < 0 || layerN >= (int)scene->layers.size())
 		return false;
 	scene->layers[layerN]->bound = bound;
+	if (journal)
+		journal->writeLayerSettings(layerN, *scene->layers[layerN]);
 	emit(layerSettingsChanged(layerN, VoxelLayer::BOUND_CHANGED));
 	return true;
 }
@@ -199,6 +479,8 @@ bool SceneProxy::setLayerBoundUse(int layerN, bool enabled)
 	if (layerN < 0 || layerN >= (int)scene->layers.size())
 		return false;
 	scene->layers[layerN]->useBound = enabled;
+	if (journal)
+		journal->writeLayerSettings(layerN, *scene->layers[layerN]);
 	emit(layerSettingsChanged(layerN, VoxelLayer::USE_BOUND_CHANGED));
 	return true;
 }
@@ -207,16 +489,41 @@ bool SceneProxy::setLayerVisibility(int layerN, bool visible)
 {
 	if (layerN < 0 || layerN >= (int)scene->layers.size())
 		return false;
+	if (scene->layers[layerN]->visible == visible)
+		return true;
 	scene->layers[layerN]->visible = visible;
+	scene->invalidateLayer(scene->layers[layerN]);
+	if (journal)
+		journal->writeLayerSettings(layerN, *scene->layers[layerN]);
 	emit(layerSettingsChanged(layerN, VoxelLayer::VISIBILITY_CHANGED));
 	return true;
 }
 
+bool SceneProxy::setLayerBlendMode(int layerN, int blendMode)
+{
+	if (layerN < 0 || layerN >= (int)scene->layers.size())
+		return false;
+	if (blendMode < VoxelLayer::BLEND_REPLACE || blendMode > VoxelLayer::BLEND_MASK)
+		return false;
+	VoxelLayer *layer = scene->layers[layerN];
+	if (layer->blendMode == blendMode)
+		return true;
+	layer->blendMode = (VoxelLayer::BlendMode)blendMode;
+	if (layer->visible)
+		scene->invalidateLayer(layer);
+	if (journal)
+		journal->writeLayerSettings(layerN, *scene->layers[layerN]);
+	emit(layerSettingsChanged(layerN, VoxelLayer::BLEND_MODE_CHANGED));
+	return true;
+}
+
 bool SceneProxy::renameLayer(int layerN, const std::string &name)
 {
 	if (layerN < 0 || layerN >= (int)scene->layers.size())
 		return false;
 	scene->layers[layerN]->name = name;
+	if (journal)
+		journal->writeLayerSettings(layerN, *scene->layers[layerN]);
 	emit(layerSettingsChanged(layerN, VoxelLayer::NAME_CHANGED));
 	return true;
 }
@@ -235,7 +542,9 @@ bool SceneProxy::replaceAggregate(int layerN, VoxelAggregate *aggregate)
 	memento.action = SceneMemento::REPLACE_AGGREGATE;
 	memento.sourceLayers.push_back(dummyLayer);
 	memento.targetLayerIndex = layerN;
-	undoState = editHistory.end();
+	commitHistoryEntry();
+	if (journal)
+		journal->writeReplaceAggregate(layerN, *aggregate);
 	emit(renderDataChanged());
 	return true;
 }
@@ -257,24 +566,39 @@ void SceneProxy::undo()
 	// undoState points one beyond current state, i.e. the first redo state
 	--undoState;
 	SceneMemento &state = *undoState;
+	// the journal records the effect of undo like any other change
 	switch (state.action)
 	{
 		case SceneMemento::EDIT_VOXELS:
+			if (!loadSpilled(state) || !state.memento->decompress())
+			{
+				std::cout << "(!) undo data lost or corrupt, cannot undo further\n";
+				++undoState;
+				return;
+			}
 			scene->restoreAggregate(scene->layers[state.targetLayerIndex], state.memento);
+			if (journal)
+				journal->writeEdit(state.targetLayerIndex, *state.memento, *scene->layers[state.targetLayerIndex]->aggregate);
 			break;
 		case SceneMemento::ADD_LAYER:
 			state.sourceLayers.push_back(scene->layers[state.targetLayerIndex]);
 			moveActiveLayer(state.targetLayerIndex);
 			scene->removeLayer(state.targetLayerIndex);
+			if (journal)
+				journal->writeDeleteLayer(state.targetLayerIndex);
 			emit(layerDeleted(state.targetLayerIndex));
 			break;
 		case SceneMemento::DELETE_LAYER:
 			scene->insertLayer(state.sourceLayers.back(), state.targetLayerIndex);
 			state.sourceLayers.pop_back();
+			if (journal)
+				journal->writeAddLayer(state.targetLayerIndex, *scene->layers[state.targetLayerIndex]);
 			emit(layerCreated(state.targetLayerIndex));
 			break;
 		case SceneMemento::MOVE_LAYER:
 			scene->moveLayer(state.targetLayerIndex, state.sourceLayerIndex);
+			if (journal)
+				journal->writeMoveLayer(state.targetLayerIndex, state.sourceLayerIndex);
 			emit(layerMoved(state.targetLayerIndex, state.sourceLayerIndex));
 			break;
 		case SceneMemento::EDIT_LAYER:
@@ -282,10 +606,14 @@ void SceneProxy::undo()
 			break;
 		case SceneMemento::REPLACE_AGGREGATE:
 			state.sourceLayers.back()->aggregate = scene->replaceAggregate(state.targetLayerIndex, state.sourceLayers.back()->aggregate);
+			if (journal)
+				journal->writeReplaceAggregate(state.targetLayerIndex, *scene->layers[state.targetLayerIndex]->aggregate);
 			break;
 		case SceneMemento::INVALID_ACTION:
 			std::cout << "Invalid undo state!\n";
 	}
+	// restoring unpacks mementos and moves layers in or out of the entry
+	state.memory = state.memoryUsage();
 	emit(renderDataChanged());
 }
 
@@ -297,21 +625,34 @@ void SceneProxy::redo()
 	switch (state.action)
 	{
 		case SceneMemento::EDIT_VOXELS:
+			if (!loadSpilled(state) || !state.memento->decompress())
+			{
+				std::cout << "(!) redo data lost or corrupt, cannot redo further\n";
+				return;
+			}
 			scene->restoreAggregate(scene->layers[state.targetLayerIndex], state.memento);
+			if (journal)
+				journal->writeEdit(state.targetLayerIndex, *state.memento, *scene->layers[state.targetLayerIndex]->aggregate);
 			break;
 		case SceneMemento::ADD_LAYER:
 			scene->insertLayer(state.sourceLayers.back(), state.targetLayerIndex);
 			state.sourceLayers.pop_back();
+			if (journal)
+				journal->writeAddLayer(state.targetLayerIndex, *scene->layers[state.targetLayerIndex]);
 			emit(layerCreated(state.targetLayerIndex));
 			break;
 		case SceneMemento::DELETE_LAYER:
 			state.sourceLayers.push_back(scene->layers[state.targetLayerIndex]);
 			moveActiveLayer(state.targetLayerIndex);
 			scene->removeLayer(state.targetLayerIndex);
+			if (journal)
+				journal->writeDeleteLayer(state.targetLayerIndex);
 			emit(layerDeleted(state.targetLayerIndex));
 			break;
 		case SceneMemento::MOVE_LAYER:
 			scene->moveLayer(state.sourceLayerIndex, state.targetLayerIndex);
+			if (journal)
+				journal->writeMoveLayer(state.sourceLayerIndex, state.targetLayerIndex);
 			emit(layerMoved(state.sourceLayerIndex, state.targetLayerIndex));
 			break;
 		case SceneMemento::EDIT_LAYER:
@@ -319,10 +660,13 @@ void SceneProxy::redo()
 			break;
 		case SceneMemento::REPLACE_AGGREGATE:
 			state.sourceLayers.back()->aggregate = scene->replaceAggregate(state.targetLayerIndex, state.sourceLayers.back()->aggregate);
+			if (journal)
+				journal->writeReplaceAggregate(state.targetLayerIndex, *scene->layers[state.targetLayerIndex]->aggregate);
 			break;
 		case SceneMemento::INVALID_ACTION:
 			std::cout << "Invalid redo state!\n";
 	}
+	state.memory = state.memoryUsage();
 	// undoState points one beyond current state, i.e. the first redo state
 	++undoState;
 	emit(renderDataChanged());
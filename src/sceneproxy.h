@@ -20,6 +20,9 @@ class VoxelScene;
 class VoxelLayer;
 class VoxelAggregate;
 class AggregateMemento;
+class UndoJournal;
+class QDataStream;
+class QString;
 
 class SceneMemento
 {
@@ -38,6 +41,8 @@ class SceneMemento
 		SceneMemento(AggregateMemento *mem, unsigned int layer):
 			action(EDIT_VOXELS), targetLayerIndex(layer), memento(mem) {}
 		~SceneMemento();
+		//! heap memory of the undo data in bytes
+		size_t memoryUsage() const;
 	//protected:
 		Action action;
 		//bool redoAction = false; // redundant?
@@ -46,6 +51,23 @@ class SceneMemento
 		unsigned int targetLayerIndex;
 		//VoxelLayer *targetLayer; // redundant?
 		AggregateMemento *memento;
+		//! memoryUsage() when last measured, kept for the history budget
+		size_t memory = 0;
+		//! where memento was spilled to the undo journal, memento is null then
+		qint64 journalOffset = -1;
+};
+
+struct HistoryStats
+{
+	int entries;
+	int compressedEntries;
+	//! entries dropped for the budget since the start
+	int evictedEntries;
+	//! entries whose undo data only resides in the journal
+	int spilledEntries;
+	size_t memory;
+	size_t budget;
+	qint64 journalSize;
 };
 
 /* This class handles all the Qt signals and slots associated with scene editing.
@@ -56,6 +78,8 @@ class SceneProxy: public QObject
 	Q_OBJECT
 	public:
 		SceneProxy(VoxelScene *scene, QObject *parent = 0);
+		//! a proxy that gets destroyed ends the session cleanly and discards the journal
+		~SceneProxy();
 		int activeLayer() const;
 		int layerCount() const;
 		const VoxelLayer* getLayer(int layerN) const;
@@ -71,11 +95,23 @@ class SceneProxy: public QObject
 		bool setLayerBound(int layerN, const IBBox &bound);
 		bool setLayerBoundUse(int layerN, bool enabled);
 		bool setLayerVisibility(int layerN, bool visible);
+		//! @param blendMode: one of VoxelLayer::BlendMode
+		bool setLayerBlendMode(int layerN, int blendMode);
 		bool renameLayer(int layerN, const std::string &name);
 		bool replaceAggregate(int layerN, VoxelAggregate *aggregate);
 		void setTemplateColor(rgba_t col);
 		void undo();
 		void redo();
+		//! the undo history drops its oldest entries beyond this many bytes
+		void setHistoryBudget(size_t bytes);
+		HistoryStats getHistoryStats() const;
+		/*! takes ownership of the journal, which then records all changes and takes spilled undo data.
+			With recover set, the session of the journal gets restored first */
+		void setJournal(UndoJournal *journal, bool recover);
+		//! starts a new replay point in the journal after the scene got saved
+		void journalSnapshot(const QString &savedFile);
+		//! number of most recent entries that stay uncompressed for fast undo
+		static const int UNCOMPRESSED_HISTORY = 8;
 	Q_SIGNALS:
 		void layerDeleted(int layerN);
 		void layerCreated(int layerN);
@@ -86,10 +122,21 @@ class SceneProxy: public QObject
 		void renderDataChanged();
 	protected:
 		void dropRedoHistory();
+		//! finishes adding the entry at the back of editHistory, then compresses and evicts old entries
+		void commitHistoryEntry();
+		void enforceHistoryBudget();
+		//! makes sure the memento of state is in memory, reading it back from the journal if needed
+		bool loadSpilled(SceneMemento &state);
+		bool recoverSession();
+		//! returns false if the record is incomplete
+		bool replayRecord(int type, QDataStream &stream);
 		void moveActiveLayer(int layerN);
 		VoxelScene *scene;
 		std::list<SceneMemento> editHistory;
 		std::list<SceneMemento>::iterator undoState;
+		size_t historyBudget = 256 << 20;
+		int evictedEntries = 0;
+		UndoJournal *journal = nullptr;
 };
 
 #endif // VG_SCENEPROXY_H
@@ -23,17 +23,23 @@ const int axis_map[3][3] =
 template <typename T>
 void ExtrudeTool::extrude(T &op, int start, int end)
 {
-	for (int z = selBound.low[2]; z <= selBound.high[2]; ++z)
-		for (int y = selBound.low[1]; y <= selBound.high[1]; ++y)
-			for (int x = selBound.low[0]; x <= selBound.high[0]; ++x)
+	IBBox bound(selBound.low, selBound.high + IVector3D(1, 1, 1));
+	selection.forEachBlock(bound, [&](const VoxelGrid *grid, const IBBox &clipBound)
 	{
-		IVector3D pos(x, y, z);
-		const VoxelEntry *voxel = selection.getVoxel(pos);
-		if (voxel && (voxel->flags & Voxel::VF_TOOL_SELECT))
+		if (!grid)
+			return;
+		const IVector3D &gridPos = grid->getGridPos();
+		for (int z = clipBound.pMin.z; z < clipBound.pMax.z; ++z)
+			for (int y = clipBound.pMin.y; y < clipBound.pMax.y; ++y)
+				for (int x = clipBound.pMin.x; x < clipBound.pMax.x; ++x)
 		{
-			op(pos, start, end);
+			const VoxelEntry *voxel = grid->getVoxel(IVector3D(x - gridPos.x, y - gridPos.y, z - gridPos.z));
+			if (voxel->flags & Voxel::VF_TOOL_SELECT)
+			{
+				op(IVector3D(x, y, z), start, end);
+			}
 		}
-	}
+	});
 }
 
 void ExtrudeTool::mouseMoved(const ToolEvent &event)
@@ -114,6 +120,8 @@ void ExtrudeTool::selectFace(SceneRayHit &hit, const VoxelAggregate *aggregate)
 	n_offset[2][axis_map[axis][2]] += 1;
 	n_offset[3][axis_map[axis][2]] -= 1;
 	queue.push_back(hit.voxelPos);
+	// the search visits neighbouring positions, so nearly all reads hit the cached blocks
+	AggregateAccessor source(aggregate);
 
 	while (queue.size())
 	{
@@ -123,9 +131,9 @@ void ExtrudeTool::selectFace(SceneRayHit &hit, const VoxelAggregate *aggregate)
 		const VoxelEntry *sel_voxel = selection.getVoxel(pos);
 		if (sel_voxel && sel_voxel->flags != 0)
 			continue;
-		const VoxelEntry *voxel = aggregate->getVoxel(pos);
+		const VoxelEntry *voxel = source.getVoxel(pos);
 		IVector3D top_pos = pos + top_offset;
-		const VoxelEntry *top_voxel = aggregate->getVoxel(top_pos);
+		const VoxelEntry *top_voxel = source.getVoxel(top_pos);
 		// reject if the voxel is empty or the top is non-empty
 		if (!voxel || !(voxel->flags & Voxel::VF_NON_EMPTY) ||
 			(top_voxel && (top_voxel->flags & Voxel::VF_NON_EMPTY)))
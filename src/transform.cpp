@@ -8,17 +8,47 @@
 
 #include "transform.h"
 #include "voxelaggregate.h"
+#include "util/threadpool.h"
 
-void VTTranslate::operator()(const IVector3D &pos, const VoxelEntry *voxel, VoxelAggregate *target)
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+
+IVector3D VoxelTransform::operator()(const IVector3D &pos) const
 {
-	target->setVoxel(pos + offset, *voxel);
+	IVector3D mPos;
+	for (int i = 0; i < 3; ++i)
+		mPos[axisMap[i]] = pos[i] * axisScale[i];
+	return mPos + offset;
 }
 
-void VTMirror::operator()(const IVector3D &pos, const VoxelEntry *voxel, VoxelAggregate *target)
+bool VoxelTransform::isBlockTranslation() const
 {
-	IVector3D mPos(pos);
-	mPos[axis] = -pos[axis] + 2 * center;
-	target->setVoxel(mPos, *voxel);
+	for (int i = 0; i < 3; ++i)
+	{
+		if (axisMap[i] != i || axisScale[i] != 1 || (offset[i] & (GRID_LEN - 1)))
+			return false;
+	}
+	return true;
+}
+
+void VoxelTransform::getPermutation(uint16_t table[GRID_VOLUME]) const
+{
+	for (int z = 0, index = 0; z < GRID_LEN; ++z)
+		for (int y = 0; y < GRID_LEN; ++y)
+			for (int x = 0; x < GRID_LEN; ++x, ++index)
+	{
+		IVector3D pos(x, y, z), mPos;
+		for (int i = 0; i < 3; ++i)
+			mPos[axisMap[i]] = axisScale[i] > 0 ? pos[i] : GRID_LEN - 1 - pos[i];
+		table[index] = mPos.x + mPos.y * GRID_LEN + mPos.z * GRID_LEN * GRID_LEN;
+	}
+}
+
+VTMirror::VTMirror(int axis, int center)
+{
+	axisScale[axis] = -1;
+	offset[axis] = 2 * center;
 }
 
 VTRotate::VTRotate(int axis, Rotation rotation)
@@ -63,30 +93,149 @@ VTRotate::VTRotate(int axis, Rotation rotation)
 	}
 }
 
-void VTRotate::operator()(const IVector3D &pos, const VoxelEntry *voxel, VoxelAggregate *target)
+namespace
 {
-	IVector3D mPos;
-	for (int i = 0; i < 3; ++i)
-		mPos[axisMap[i]] = pos[i] * axisScale[i];
-	target->setVoxel(mPos, *voxel);
+	//! a transformed source block, offset by shift from the target block at offset d
+	struct BlockPart
+	{
+		int source;
+		IVector3D shift;
+		IVector3D d;
+	};
+	struct TargetBlock
+	{
+		IVector3D pos;
+		std::vector<BlockPart> parts;
+	};
 }
 
-VoxelAggregate* transformAggregate(const VoxelAggregate *ag, VoxelTransform &xform)
+VoxelAggregate* transformAggregate(const VoxelAggregate *ag, const VoxelTransform &xform)
 {
 	VoxelAggregate *transformed = new VoxelAggregate();
 	const blockMap_t& blockMap = ag->getBlockMap();
+	if (xform.isBlockTranslation())
+	{
+		// the voxels stay as they are, only the blocks move
+		for (auto &grid: blockMap)
+		{
+			IVector3D pos = xform(grid.second->getGridPos());
+			transformed->setBlock(VoxelAggregate::blockID(pos.x, pos.y, pos.z), new VoxelGrid(*grid.second, pos));
+		}
+		return transformed;
+	}
+	// a transformed block generally straddles up to 8 target blocks, collect the parts of each target
+	std::unordered_map<uint64_t, int> targetIndex;
+	std::vector<TargetBlock> targets;
+	std::vector<const VoxelGrid*> sources;
+	const IVector3D last(GRID_LEN - 1, GRID_LEN - 1, GRID_LEN - 1);
 	for (auto &grid: blockMap)
 	{
-		IVector3D gridPos = grid.second->getGridPos();
-		for (int z = 0; z < GRID_LEN; ++z)
-			for (int y = 0; y < GRID_LEN; ++y)
-				for (int x = 0; x < GRID_LEN; ++x)
+		const IVector3D &gridPos = grid.second->getGridPos();
+		IVector3D corner1 = xform(gridPos), corner2 = xform(gridPos + last);
+		BlockPart part;
+		part.source = sources.size();
+		sources.push_back(grid.second.get());
+		IVector3D base;
+		for (int i = 0; i < 3; ++i)
 		{
-			const VoxelEntry *voxel = grid.second->getVoxel(IVector3D(x, y, z));
-			if (!(voxel->flags & Voxel::VF_NON_EMPTY))
-				continue;
-			xform(IVector3D(gridPos.x + x, gridPos.y + y, gridPos.z + z), voxel, transformed);
+			int origin = std::min(corner1[i], corner2[i]);
+			part.shift[i] = origin & (GRID_LEN - 1);
+			base[i] = origin - part.shift[i];
 		}
+		for (int dz = 0; dz <= (part.shift.z ? 1 : 0); ++dz)
+			for (int dy = 0; dy <= (part.shift.y ? 1 : 0); ++dy)
+				for (int dx = 0; dx <= (part.shift.x ? 1 : 0); ++dx)
+		{
+			IVector3D pos(base.x + dx * GRID_LEN, base.y + dy * GRID_LEN, base.z + dz * GRID_LEN);
+			auto inserted = targetIndex.emplace(VoxelAggregate::blockID(pos.x, pos.y, pos.z), targets.size());
+			if (inserted.second)
+				targets.push_back(TargetBlock{ pos, std::vector<BlockPart>() });
+			part.d = IVector3D(dx, dy, dz);
+			targets[inserted.first->second].parts.push_back(part);
+		}
+	}
+	// each source gets decoded and permuted once; going through the targets one z layer at a time,
+	// a permuted source is needed by two consecutive layers at most and then released
+	std::sort(targets.begin(), targets.end(), [](const TargetBlock &a, const TargetBlock &b) { return a.pos.z < b.pos.z; });
+	std::vector<int> pendingParts(sources.size(), 0);
+	for (const TargetBlock &target: targets)
+	{
+		for (const BlockPart &part: target.parts)
+			++pendingParts[part.source];
+	}
+	uint16_t permutation[GRID_VOLUME];
+	xform.getPermutation(permutation);
+	ThreadPool &pool = ThreadPool::global();
+	std::vector<std::unique_ptr<VoxelEntry[]>> permuted(sources.size());
+	std::vector<VoxelEntry> scratch(pool.size() * GRID_VOLUME);
+	std::vector<VoxelGrid*> grids(targets.size(), nullptr);
+	std::vector<int> decode;
+	for (size_t first = 0, end; first < targets.size(); first = end)
+	{
+		for (end = first + 1; end < targets.size() && targets[end].pos.z == targets[first].pos.z; ++end);
+		decode.clear();
+		for (size_t t = first; t < end; ++t)
+		{
+			for (const BlockPart &part: targets[t].parts)
+			{
+				if (!permuted[part.source])
+				{
+					permuted[part.source].reset(new VoxelEntry[GRID_VOLUME]);
+					decode.push_back(part.source);
+				}
+			}
+		}
+		pool.parallelFor(decode.size(), [&](int item, int worker)
+		{
+			VoxelEntry *source = &scratch[worker * GRID_VOLUME];
+			VoxelEntry *dest = permuted[decode[item]].get();
+			sources[decode[item]]->getVoxels(source);
+			for (int i = 0; i < GRID_VOLUME; ++i)
+				dest[permutation[i]] = source[i];
+		});
+		pool.parallelFor(end - first, [&](int item, int worker)
+		{
+			VoxelEntry *dense = &scratch[worker * GRID_VOLUME];
+			std::fill(dense, dense + GRID_VOLUME, VoxelEntry());
+			for (const BlockPart &part: targets[first + item].parts)
+			{
+				// copy the rows of the transformed block that fall into this target
+				const VoxelEntry *block = permuted[part.source].get();
+				IVector3D low, high, delta;
+				for (int i = 0; i < 3; ++i)
+				{
+					low[i] = part.d[i] ? GRID_LEN - part.shift[i] : 0;
+					high[i] = part.d[i] ? GRID_LEN : GRID_LEN - part.shift[i];
+					delta[i] = part.shift[i] - part.d[i] * GRID_LEN;
+				}
+				for (int z = low.z; z < high.z; ++z)
+					for (int y = low.y; y < high.y; ++y)
+				{
+					const VoxelEntry *row = block + y * GRID_LEN + z * GRID_LEN * GRID_LEN;
+					VoxelEntry *targetRow = dense + (y + delta.y) * GRID_LEN + (z + delta.z) * GRID_LEN * GRID_LEN;
+					std::copy(row + low.x, row + high.x, targetRow + low.x + delta.x);
+				}
+			}
+			// targets may only have received empty parts of blocks
+			if (std::any_of(dense, dense + GRID_VOLUME, [](const VoxelEntry &v) { return v.flags & Voxel::VF_NON_EMPTY; }))
+			{
+				grids[first + item] = new VoxelGrid(targets[first + item].pos);
+				grids[first + item]->setVoxels(dense);
+			}
+		});
+		for (size_t t = first; t < end; ++t)
+		{
+			for (const BlockPart &part: targets[t].parts)
+			{
+				if (--pendingParts[part.source] == 0)
+					permuted[part.source].reset();
+			}
+		}
+	}
+	for (size_t i = 0; i < targets.size(); ++i)
+	{
+		if (grids[i])
+			transformed->setBlock(VoxelAggregate::blockID(targets[i].pos.x, targets[i].pos.y, targets[i].pos.z), grids[i]);
 	}
 	return transformed;
 }
@@ -10,32 +10,40 @@
 #define VG_VOXELTRANSFORM_H
 
 #include "voxelgem.h"
+#include "voxelstorage.h"
 
 class VoxelAggregate;
 
+/*! Mapping of voxel positions by axis permutation, axis flips and a translation:
+	pos'[axisMap[i]] = pos[i] * axisScale[i] + offset[axisMap[i]]
+	Such a mapping moves every block as a whole and only reorders the voxels within it,
+	so transformAggregate() works on complete blocks instead of single voxels. */
 class VoxelTransform
 {
 	public:
-		virtual void operator()(const IVector3D &pos, const VoxelEntry *voxel, VoxelAggregate *target) = 0;
+		IVector3D operator()(const IVector3D &pos) const;
+		//! true for translations by multiples of GRID_LEN, which map blocks exactly onto blocks
+		bool isBlockTranslation() const;
+		/*! fills table with the index within the transformed block for each voxel index of a block.
+			The transformed block is the bound of a source block after the mapping */
+		void getPermutation(uint16_t table[GRID_VOLUME]) const;
+	protected:
+		VoxelTransform(): axisMap(0, 1, 2), axisScale(1, 1, 1), offset(0, 0, 0) {}
+		IVector3D axisMap;
+		IVector3D axisScale;
+		IVector3D offset;
 };
 
 class VTTranslate: public VoxelTransform
 {
 	public:
-		VTTranslate(const IVector3D &_offset): offset(_offset) {}
-		virtual void operator()(const IVector3D &pos, const VoxelEntry *voxel, VoxelAggregate *target) override;
-	protected:
-		IVector3D offset;
+		VTTranslate(const IVector3D &_offset) { offset = _offset; }
 };
 
 class VTMirror: public VoxelTransform
 {
 	public:
-		VTMirror(int _axis, int _center = 0): axis(_axis), center(_center) {}
-		virtual void operator()(const IVector3D &pos, const VoxelEntry *voxel, VoxelAggregate *target) override;
-	protected:
-		int axis;
-		int center;
+		VTMirror(int axis, int center = 0);
 };
 
 class VTRotate: public VoxelTransform
@@ -48,12 +56,8 @@ class VTRotate: public VoxelTransform
 			Rot270
 		};
 		VTRotate(int axis, Rotation rotation);
-		virtual void operator()(const IVector3D &pos, const VoxelEntry *voxel, VoxelAggregate *target) override;
-	protected:
-		IVector3D axisMap;
-		IVector3D axisScale;
 };
 
-VoxelAggregate* transformAggregate(const VoxelAggregate *ag, VoxelTransform &xform);
+VoxelAggregate* transformAggregate(const VoxelAggregate *ag, const VoxelTransform &xform);
 
 #endif // VG_VOXELTRANSFORM_H
@@ -0,0 +1,516 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "undojournal.h"
+#include "voxelaggregate.h"
+#include "voxelscene.h"
+#include "util/lzcodec.h"
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+#include <iostream>
+
+static const quint32 JOURNAL_MAGIC = 0x4A474756; // "VGGJ"
+static const quint32 JOURNAL_VERSION = 1;
+static const quint32 RECORD_MAGIC = 0x52474756; // "VGGR"
+// file header: magic, version; record header: magic, type, packed size, raw size, checksum
+static const qint64 FILE_HEADER_SIZE = 8;
+static const qint64 RECORD_HEADER_SIZE = 20;
+
+static quint32 checksum(const uchar *data, size_t size)
+{
+	// FNV-1a
+	quint32 hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+static bool validHeader(QFile &file)
+{
+	quint32 magic = 0, version = 0;
+	if (file.size() < FILE_HEADER_SIZE || !file.seek(0))
+		return false;
+	QDataStream stream(&file);
+	stream >> magic >> version;
+	return magic == JOURNAL_MAGIC && version == JOURNAL_VERSION;
+}
+
+UndoJournal::UndoJournal(const QString &path): file(path), lock(path + ".lock")
+{
+	// the lock is only stale when its process is gone, no matter how long a session runs
+	lock.setStaleLockTime(0);
+}
+
+UndoJournal::~UndoJournal()
+{
+	if (mapped)
+		file.unmap(mapped);
+}
+
+static QString journalDir()
+{
+	QString dir = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+	QDir().mkpath(dir);
+	return dir;
+}
+
+QString UndoJournal::newSessionPath()
+{
+	return journalDir() + QString("/session-%1-%2.journal")
+		.arg(QCoreApplication::applicationPid()).arg(QDateTime::currentMSecsSinceEpoch());
+}
+
+UndoJournal* UndoJournal::findRecoverable()
+{
+	QDir dir(journalDir());
+	for (const QString &name: dir.entryList(QStringList() << "*.journal", QDir::Files))
+	{
+		UndoJournal *journal = new UndoJournal(dir.filePath(name));
+		if (journal->canRecover())
+			return journal;
+		// nothing to recover from a session that was abandoned before its first snapshot
+		if (journal->lock.isLocked())
+			journal->discard();
+		delete journal;
+	}
+	return nullptr;
+}
+
+bool UndoJournal::canRecover()
+{
+	if (file.isOpen())
+		return false;
+	// a live lock belongs to a running instance, a stale one gets taken over
+	if (!lock.isLocked() && !lock.tryLock(0))
+		return false;
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	bool snapshot = replay([](RecordType, QDataStream&) { return true; });
+	if (mapped)
+		file.unmap(mapped);
+	mapped = nullptr;
+	mappedSize = 0;
+	file.close();
+	return snapshot;
+}
+
+bool UndoJournal::open(bool keepRecords)
+{
+	if (file.isOpen())
+		return true;
+	if (!lock.isLocked() && !lock.tryLock(0))
+	{
+		std::cout << "undo journal " << file.fileName().toStdString() << " is in use by another instance\n";
+		return false;
+	}
+	if (keepRecords && file.open(QIODevice::ReadOnly))
+	{
+		keepRecords = validHeader(file);
+		file.close();
+	}
+	if (!keepRecords)
+	{
+		if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate))
+		{
+			std::cout << "could not create undo journal " << file.fileName().toStdString() << std::endl;
+			return false;
+		}
+		QDataStream stream(&file);
+		stream << JOURNAL_MAGIC << JOURNAL_VERSION;
+		file.flush();
+		return true;
+	}
+	if (!file.open(QIODevice::ReadWrite))
+		return false;
+	// drop a damaged tail from the crash, new records must follow the last valid one
+	qint64 offset = FILE_HEADER_SIZE, end = offset;
+	RecordType type;
+	QByteArray payload;
+	while (readRecord(offset, type, payload))
+		end = offset;
+	if (mapped)
+		file.unmap(mapped);
+	mapped = nullptr;
+	mappedSize = 0;
+	if (end < file.size())
+	{
+		std::cout << "undo journal: dropping " << file.size() - end << " bytes of incomplete records\n";
+		file.resize(end);
+	}
+	file.seek(end);
+	return true;
+}
+
+void UndoJournal::discard()
+{
+	if (mapped)
+		file.unmap(mapped);
+	mapped = nullptr;
+	mappedSize = 0;
+	file.close();
+	file.remove();
+	lock.unlock();
+}
+
+bool UndoJournal::replay(const recordFunc_t &func)
+{
+	if (!validHeader(file))
+		return false;
+	qint64 offset = FILE_HEADER_SIZE, snapshot = -1;
+	RecordType type;
+	QByteArray payload;
+	for (qint64 start = offset; readRecord(offset, type, payload); start = offset)
+	{
+		if (type == SNAPSHOT)
+			snapshot = start;
+	}
+	if (snapshot < 0)
+		return false;
+	offset = snapshot;
+	while (readRecord(offset, type, payload))
+	{
+		if (type == SPILLED_MEMENTO)
+			continue;
+		QDataStream stream(payload);
+		if (type == SNAPSHOT)
+		{
+			QString savedFile;
+			stream >> savedFile;
+			baseFile = savedFile;
+		}
+		if (!func(type, stream))
+		{
+			std::cout << "(!) undo journal: incomplete record, replay stops here\n";
+			break;
+		}
+	}
+	return true;
+}
+
+void UndoJournal::writeSnapshot(const std::vector<VoxelLayer*> &layers, int activeLayer, const QString &savedFile)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream << savedFile << (quint32)layers.size() << (qint32)activeLayer;
+	for (auto layer: layers)
+		writeLayer(stream, *layer);
+	writeRecord(SNAPSHOT, payload);
+	baseFile = savedFile;
+}
+
+void UndoJournal::writeEdit(int layerN, AggregateMemento &memento, const VoxelAggregate &aggregate)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream << (qint32)layerN;
+	writeMemento(stream, memento, &aggregate);
+	writeRecord(EDIT_VOXELS, payload);
+}
+
+void UndoJournal::writeAddLayer(int layerN, const VoxelLayer &layer)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream << (qint32)layerN;
+	writeLayer(stream, layer);
+	writeRecord(ADD_LAYER, payload);
+}
+
+void UndoJournal::writeDeleteLayer(int layerN)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream << (qint32)layerN;
+	writeRecord(DELETE_LAYER, payload);
+}
+
+void UndoJournal::writeMoveLayer(int layerN, int targetN)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream << (qint32)layerN << (qint32)targetN;
+	writeRecord(MOVE_LAYER, payload);
+}
+
+void UndoJournal::writeReplaceAggregate(int layerN, const VoxelAggregate &aggregate)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream << (qint32)layerN;
+	writeAggregate(stream, aggregate);
+	writeRecord(REPLACE_AGGREGATE, payload);
+}
+
+void UndoJournal::writeLayerSettings(int layerN, const VoxelLayer &layer)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream << (qint32)layerN;
+	writeLayerSettings(stream, layer);
+	writeRecord(LAYER_SETTINGS, payload);
+}
+
+qint64 UndoJournal::spillMemento(AggregateMemento &memento)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	writeMemento(stream, memento, nullptr);
+	return writeRecord(SPILLED_MEMENTO, payload);
+}
+
+AggregateMemento* UndoJournal::loadMemento(qint64 offset)
+{
+	RecordType type;
+	QByteArray payload;
+	if (!readRecord(offset, type, payload) || type != SPILLED_MEMENTO)
+	{
+		std::cout << "(!) undo journal: no memento at offset " << offset << std::endl;
+		return nullptr;
+	}
+	QDataStream stream(payload);
+	return readMemento(stream);
+}
+
+void UndoJournal::writeMemento(QDataStream &stream, AggregateMemento &memento, const VoxelAggregate *current)
+{
+	stream << (quint32)memento.blockMap.size();
+	for (auto &block: memento.blockMap)
+	{
+		GridMemento &gridMem = *block.second;
+		if (!gridMem.decompress())
+			std::cout << "(!) journal gets no undo data for block " << block.first << "\n";
+		const VoxelGrid *grid = current ? current->getBlock(block.first) : nullptr;
+		bool exists = current ? grid != nullptr : gridMem.blockExists;
+		stream << (quint64)block.first << (quint8)exists;
+		stream << (quint32)gridMem.runs.size() << (quint32)gridMem.values.size();
+		for (auto &run: gridMem.runs)
+			stream << run.start << run.length;
+		std::vector<VoxelEntry> values;
+		if (current)
+		{
+			// missing blocks are all empty
+			values.resize(gridMem.values.size());
+			auto value = values.begin();
+			for (auto &run: gridMem.runs)
+				for (int i = run.start; grid && i < run.start + run.length; ++i, ++value)
+					*value = *grid->getVoxel(IVector3D(i & (GRID_LEN - 1), (i >> LOG_GRID_LEN) & (GRID_LEN - 1), i >> (2 * LOG_GRID_LEN)));
+		}
+		const std::vector<VoxelEntry> &out = current ? values : gridMem.values;
+		// the journal stays on this machine, so raw host byte order is fine
+		stream.writeRawData((const char*)out.data(), out.size() * sizeof(VoxelEntry));
+	}
+}
+
+AggregateMemento* UndoJournal::readMemento(QDataStream &stream)
+{
+	AggregateMemento *memento = new AggregateMemento;
+	quint32 nBlocks;
+	stream >> nBlocks;
+	for (quint32 b = 0; b < nBlocks && stream.status() == QDataStream::Ok; ++b)
+	{
+		quint64 blockId;
+		quint8 exists;
+		quint32 nRuns, nValues;
+		stream >> blockId >> exists >> nRuns >> nValues;
+		if (nRuns > GRID_VOLUME || nValues > GRID_VOLUME)
+		{
+			stream.setStatus(QDataStream::ReadCorruptData);
+			break;
+		}
+		GridMemento *gridMem = new GridMemento;
+		memento->blockMap.emplace(blockId, gridMementoPtr_t(gridMem));
+		gridMem->blockExists = exists;
+		gridMem->runs.resize(nRuns);
+		quint32 covered = 0;
+		for (auto &run: gridMem->runs)
+		{
+			stream >> run.start >> run.length;
+			if (run.start + run.length > GRID_VOLUME)
+				stream.setStatus(QDataStream::ReadCorruptData);
+			covered += run.length;
+		}
+		// restoring relies on one value per voxel of the runs
+		if (covered != nValues)
+			stream.setStatus(QDataStream::ReadCorruptData);
+		gridMem->values.resize(nValues);
+		stream.readRawData((char*)gridMem->values.data(), nValues * sizeof(VoxelEntry));
+	}
+	if (stream.status() != QDataStream::Ok)
+	{
+		std::cout << "(!) undo journal: truncated memento\n";
+		delete memento;
+		return nullptr;
+	}
+	return memento;
+}
+
+void UndoJournal::writeAggregate(QDataStream &stream, const VoxelAggregate &aggregate)
+{
+	const blockMap_t &blocks = aggregate.getBlockMap();
+	stream << (quint32)blocks.size();
+	VoxelEntry dense[GRID_VOLUME];
+	for (auto &block: blocks)
+	{
+		stream << (quint64)block.first;
+		for (int i = 0; i < GRID_VOLUME; ++i)
+			dense[i] = *block.second->getVoxel(IVector3D(i & (GRID_LEN - 1), (i >> LOG_GRID_LEN) & (GRID_LEN - 1), i >> (2 * LOG_GRID_LEN)));
+		stream.writeRawData((const char*)dense, sizeof(dense));
+	}
+}
+
+VoxelAggregate* UndoJournal::readAggregate(QDataStream &stream)
+{
+	VoxelAggregate *aggregate = new VoxelAggregate;
+	quint32 nBlocks;
+	stream >> nBlocks;
+	VoxelEntry dense[GRID_VOLUME];
+	for (quint32 b = 0; b < nBlocks && stream.status() == QDataStream::Ok; ++b)
+	{
+		quint64 blockId;
+		stream >> blockId;
+		if (stream.readRawData((char*)dense, sizeof(dense)) != sizeof(dense))
+			stream.setStatus(QDataStream::ReadPastEnd);
+		if (stream.status() != QDataStream::Ok)
+			break;
+		VoxelGrid *grid = aggregate->writableBlock(blockId);
+		for (int i = 0; i < GRID_VOLUME; ++i)
+		{
+			if (dense[i].flags & Voxel::VF_NON_EMPTY)
+				grid->setVoxel(i & (GRID_LEN - 1), (i >> LOG_GRID_LEN) & (GRID_LEN - 1), i >> (2 * LOG_GRID_LEN), dense[i]);
+		}
+	}
+	if (stream.status() != QDataStream::Ok)
+	{
+		std::cout << "(!) undo journal: truncated aggregate\n";
+		delete aggregate;
+		return nullptr;
+	}
+	return aggregate;
+}
+
+void UndoJournal::writeLayerSettings(QDataStream &stream, const VoxelLayer &layer)
+{
+	stream << QString::fromStdString(layer.name) << (quint8)layer.visible << (quint8)layer.blendMode
+		   << (quint8)layer.useBound;
+	for (int i = 0; i < 3; ++i)
+		stream << (qint32)layer.bound.pMin[i] << (qint32)layer.bound.pMax[i];
+}
+
+bool UndoJournal::readLayerSettings(QDataStream &stream, VoxelLayer &layer)
+{
+	QString name;
+	quint8 visible, blendMode, useBound;
+	qint32 low[3], high[3];
+	stream >> name >> visible >> blendMode >> useBound;
+	for (int i = 0; i < 3; ++i)
+		stream >> low[i] >> high[i];
+	if (stream.status() != QDataStream::Ok)
+		return false;
+	layer.name = name.toStdString();
+	layer.visible = visible;
+	layer.blendMode = blendMode <= VoxelLayer::BLEND_MASK ? (VoxelLayer::BlendMode)blendMode : VoxelLayer::BLEND_REPLACE;
+	layer.useBound = useBound;
+	for (int i = 0; i < 3; ++i)
+	{
+		layer.bound.pMin[i] = low[i];
+		layer.bound.pMax[i] = high[i];
+	}
+	return true;
+}
+
+void UndoJournal::writeLayer(QDataStream &stream, const VoxelLayer &layer)
+{
+	writeLayerSettings(stream, layer);
+	writeAggregate(stream, *layer.aggregate);
+}
+
+VoxelLayer* UndoJournal::readLayer(QDataStream &stream)
+{
+	VoxelLayer *layer = new VoxelLayer;
+	if (readLayerSettings(stream, *layer))
+		layer->aggregate = readAggregate(stream);
+	if (!layer->aggregate)
+	{
+		delete layer;
+		return nullptr;
+	}
+	return layer;
+}
+
+qint64 UndoJournal::writeRecord(RecordType type, const QByteArray &payload)
+{
+	if (!file.isOpen())
+		return -1;
+	std::vector<uint8_t> packed;
+	LZCodec::compress(payload.constData(), payload.size(), packed);
+	QByteArray header;
+	QDataStream headerStream(&header, QIODevice::WriteOnly);
+	headerStream << RECORD_MAGIC << (quint32)type << (quint32)packed.size() << (quint32)payload.size()
+				 << checksum(packed.data(), packed.size());
+	qint64 offset = file.pos();
+	if (file.write(header) != RECORD_HEADER_SIZE ||
+		file.write((const char*)packed.data(), packed.size()) != (qint64)packed.size())
+	{
+		std::cout << "(!) undo journal: write failed\n";
+		return -1;
+	}
+	// hand the record to the OS right away, so it survives a crash of the application
+	file.flush();
+	return offset;
+}
+
+bool UndoJournal::readRecord(qint64 &offset, RecordType &type, QByteArray &payload)
+{
+	if (offset + RECORD_HEADER_SIZE > file.size())
+		return false;
+	if (offset + RECORD_HEADER_SIZE > mappedSize && !mapFile())
+		return false;
+	QDataStream headerStream(QByteArray::fromRawData((const char*)mapped + offset, RECORD_HEADER_SIZE));
+	quint32 magic, recordType, packedSize, rawSize, sum;
+	headerStream >> magic >> recordType >> packedSize >> rawSize >> sum;
+	if (magic != RECORD_MAGIC || recordType < SNAPSHOT || recordType > SPILLED_MEMENTO)
+		return false;
+	qint64 end = offset + RECORD_HEADER_SIZE + packedSize;
+	if (end > file.size())
+		return false;
+	if (end > mappedSize && !mapFile())
+		return false;
+	const uchar *packed = mapped + offset + RECORD_HEADER_SIZE;
+	if (checksum(packed, packedSize) != sum)
+		return false;
+	payload.resize(rawSize);
+	if (!LZCodec::decompress(packed, packedSize, payload.data(), rawSize))
+		return false;
+	type = (RecordType)recordType;
+	offset = end;
+	return true;
+}
+
+bool UndoJournal::mapFile()
+{
+	// the file only grows, so remap all of it whenever a read goes past the mapped part
+	file.flush();
+	if (mapped)
+		file.unmap(mapped);
+	mappedSize = file.size();
+	mapped = file.map(0, mappedSize);
+	if (!mapped)
+	{
+		mappedSize = 0;
+		std::cout << "(!) undo journal: mapping failed\n";
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,115 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef VG_UNDOJOURNAL_H
+#define VG_UNDOJOURNAL_H
+
+#include "voxelgem.h"
+
+#include <QFile>
+#include <QLockFile>
+#include <QString>
+
+#include <functional>
+#include <vector>
+
+class QDataStream;
+class VoxelLayer;
+class VoxelAggregate;
+class AggregateMemento;
+
+/*! Append-only file of scene changes for a session. It serves two purposes:
+	Undo history entries can be spilled to it to keep memory usage flat, and get read back
+	through a memory map on undo. And every change of the scene gets recorded as it happens,
+	so after a crash the session can be replayed from the last snapshot, which is written
+	whenever the scene gets saved.
+	Every running instance writes its own journal and holds a lock file on it, so only journals
+	whose owner is gone get offered for recovery.
+	Each record is LZCodec compressed and checksummed, replay stops at the first damaged one. */
+class UndoJournal
+{
+	public:
+		enum RecordType
+		{
+			SNAPSHOT = 1,		//!< all layers, replay starts at the last one
+			EDIT_VOXELS,		//!< layer index and the new voxel values of an edit
+			ADD_LAYER,			//!< layer index and complete layer
+			DELETE_LAYER,		//!< layer index
+			MOVE_LAYER,			//!< source and target layer index
+			REPLACE_AGGREGATE,	//!< layer index and complete aggregate
+			LAYER_SETTINGS,		//!< layer index, name, visibility, blend mode and bound
+			SPILLED_MEMENTO		//!< undo data referenced by offset, ignored by replay
+		};
+		//! returns false if the record could not be read completely
+		typedef std::function<bool(RecordType, QDataStream&)> recordFunc_t;
+		explicit UndoJournal(const QString &path);
+		~UndoJournal();
+		//! a journal name no other instance uses, in the application data location
+		static QString newSessionPath();
+		/*! returns the first journal left behind by an instance that is not running anymore and
+			holds a snapshot, locked by the caller; nullptr if there is none. Abandoned journals
+			without snapshot get removed */
+		static UndoJournal* findRecoverable();
+		/*! true if the file holds a snapshot and no other instance owns it, i.e. the session it
+			belongs to did not end cleanly. Takes the lock on success */
+		bool canRecover();
+		const QString& getBaseFile() const { return baseFile; }
+		/*! starts a new journal, or continues the existing one after recovery;
+			a new journal needs a snapshot before anything else */
+		bool open(bool keepRecords);
+		bool isOpen() const { return file.isOpen(); }
+		//! closes and deletes the file, for a clean end of the session
+		void discard();
+		/*! calls func for all records from the last snapshot on, except spilled mementos, and stops
+			at the first one func fails to read. The base file is the one the snapshot was saved to.
+			Returns false without snapshot */
+		bool replay(const recordFunc_t &func);
+		//! @param savedFile: file the layers were saved to, empty for unsaved scenes
+		void writeSnapshot(const std::vector<VoxelLayer*> &layers, int activeLayer, const QString &savedFile);
+		//! the memento must be the one just applied or restored on aggregate
+		void writeEdit(int layerN, AggregateMemento &memento, const VoxelAggregate &aggregate);
+		void writeAddLayer(int layerN, const VoxelLayer &layer);
+		void writeDeleteLayer(int layerN);
+		void writeMoveLayer(int layerN, int targetN);
+		void writeReplaceAggregate(int layerN, const VoxelAggregate &aggregate);
+		void writeLayerSettings(int layerN, const VoxelLayer &layer);
+		//! writes the memento and returns its offset for loadMemento(), or -1 on failure
+		qint64 spillMemento(AggregateMemento &memento);
+		//! reads a spilled memento back through the memory map; nullptr on failure
+		AggregateMemento* loadMemento(qint64 offset);
+		//! bytes written, including snapshots and records replay skips
+		qint64 size() const { return file.size(); }
+
+		// payload serialization, also used by replay
+		static AggregateMemento* readMemento(QDataStream &stream);
+		static VoxelAggregate* readAggregate(QDataStream &stream);
+		//! leaves layer unchanged and returns false on a short read
+		static bool readLayerSettings(QDataStream &stream, VoxelLayer &layer);
+		static VoxelLayer* readLayer(QDataStream &stream);
+	protected:
+		/*! writes values from current instead of the memento when given;
+			that yields a memento which redoes the change on the state before it */
+		static void writeMemento(QDataStream &stream, AggregateMemento &memento, const VoxelAggregate *current);
+		static void writeAggregate(QDataStream &stream, const VoxelAggregate &aggregate);
+		static void writeLayerSettings(QDataStream &stream, const VoxelLayer &layer);
+		static void writeLayer(QDataStream &stream, const VoxelLayer &layer);
+		//! compresses and appends a record, returns its offset or -1
+		qint64 writeRecord(RecordType type, const QByteArray &payload);
+		/*! decodes the record at offset into payload and advances offset to the next record;
+			returns false for incomplete or damaged records */
+		bool readRecord(qint64 &offset, RecordType &type, QByteArray &payload);
+		bool mapFile();
+		QFile file;
+		//! held from open() or canRecover() until discard()
+		QLockFile lock;
+		QString baseFile;
+		uchar *mapped = nullptr;
+		qint64 mappedSize = 0;
+};
+
+#endif // VG_UNDOJOURNAL_H
@@ -0,0 +1,172 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef VG_LIB_BLOCKMAP_H
+#define VG_LIB_BLOCKMAP_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*! Open addressing hash map with linear probing for packed block IDs.
+	Keys must be below TOMBSTONE_KEY, which holds for all IDs from VoxelAggregate::blockID().
+	Slots live in one flat array, so lookups avoid the node chasing of std::unordered_map.
+	Erasing leaves tombstones and keeps iterators valid; inserting may rehash and invalidates them.
+	Mirrors the subset of the std::unordered_map interface the aggregates use. */
+template<class T>
+class BlockMap
+{
+	public:
+		typedef uint64_t key_type;
+		typedef T mapped_type;
+		typedef std::pair<uint64_t, T> value_type;
+		static const uint64_t EMPTY_KEY = ~uint64_t(0);
+		static const uint64_t TOMBSTONE_KEY = ~uint64_t(0) - 1;
+
+		template<class S> class slotIterator
+		{
+			friend class BlockMap;
+			public:
+				slotIterator(): slot(nullptr), end(nullptr) {}
+				// allow iterator to const_iterator conversion
+				template<class S2> slotIterator(const slotIterator<S2> &other): slot(other.slot), end(other.end) {}
+				S& operator*() const { return *slot; }
+				S* operator->() const { return slot; }
+				slotIterator& operator++() { ++slot; skipUnused(); return *this; }
+				bool operator==(const slotIterator &other) const { return slot == other.slot; }
+				bool operator!=(const slotIterator &other) const { return slot != other.slot; }
+			private:
+				template<class S2> friend class slotIterator;
+				slotIterator(S *s, S *e): slot(s), end(e) { skipUnused(); }
+				void skipUnused() { while (slot != end && slot->first >= TOMBSTONE_KEY) ++slot; }
+				S *slot, *end;
+		};
+		typedef slotIterator<value_type> iterator;
+		typedef slotIterator<const value_type> const_iterator;
+
+		iterator begin() { return iterator(table.data(), table.data() + table.size()); }
+		iterator end() { return iterator(table.data() + table.size(), table.data() + table.size()); }
+		const_iterator begin() const { return const_iterator(table.data(), table.data() + table.size()); }
+		const_iterator end() const { return const_iterator(table.data() + table.size(), table.data() + table.size()); }
+		size_t size() const { return numEntries; }
+		bool empty() const { return numEntries == 0; }
+
+		iterator find(uint64_t key)
+		{
+			value_type *slot = findSlot(key);
+			return slot ? iterator(slot, table.data() + table.size()) : end();
+		}
+		const_iterator find(uint64_t key) const
+		{
+			const value_type *slot = const_cast<BlockMap*>(this)->findSlot(key);
+			return slot ? const_iterator(slot, table.data() + table.size()) : end();
+		}
+		size_t count(uint64_t key) const { return const_cast<BlockMap*>(this)->findSlot(key) ? 1 : 0; }
+		/*! find() through a cache of the last accessed slot, for callers that hit the same block
+			many times in a row. The cache is per thread, so concurrent const lookups are safe */
+		value_type* findCached(uint64_t key) const
+		{
+			// shared by all maps of the thread; keys are unique, so a slot index from another map
+			// or from before an erase or rehash simply fails the key check
+			static thread_local size_t lastAccessed = ~size_t(0);
+			if (lastAccessed < table.size() && table[lastAccessed].first == key)
+				return const_cast<value_type*>(&table[lastAccessed]);
+			value_type *slot = const_cast<BlockMap*>(this)->findSlot(key);
+			if (slot)
+				lastAccessed = slot - table.data();
+			return slot;
+		}
+
+		std::pair<iterator, bool> emplace(uint64_t key, const T &value)
+		{
+			value_type *slot = findSlot(key);
+			if (slot)
+				return std::make_pair(iterator(slot, table.data() + table.size()), false);
+			// keep at least half the slots empty so probe sequences stay short
+			if ((used + 1) * 2 > table.size())
+				rehash(numEntries + 1);
+			size_t mask = table.size() - 1;
+			size_t pos = hash(key) & mask;
+			while (table[pos].first < TOMBSTONE_KEY)
+				pos = (pos + 1) & mask;
+			if (table[pos].first == EMPTY_KEY)
+				++used;
+			table[pos].first = key;
+			table[pos].second = value;
+			++numEntries;
+			return std::make_pair(iterator(&table[pos], table.data() + table.size()), true);
+		}
+		size_t erase(uint64_t key)
+		{
+			value_type *slot = findSlot(key);
+			if (!slot)
+				return 0;
+			slot->first = TOMBSTONE_KEY;
+			slot->second = T();
+			--numEntries;
+			return 1;
+		}
+		void clear()
+		{
+			std::vector<value_type>().swap(table);
+			used = numEntries = 0;
+		}
+		//! makes room for n entries without rehashing
+		void reserve(size_t n)
+		{
+			if ((n + (used - numEntries)) * 2 > table.size())
+				rehash(n);
+		}
+	protected:
+		static inline size_t hash(uint64_t key)
+		{
+			// the ID packs x, y, z into 21 bits each; mix them so neighbouring blocks spread out
+			key *= 0x9E3779B97F4A7C15ull;
+			return size_t(key ^ (key >> 32));
+		}
+		value_type* findSlot(uint64_t key)
+		{
+			if (table.empty())
+				return nullptr;
+			size_t mask = table.size() - 1;
+			for (size_t pos = hash(key) & mask; ; pos = (pos + 1) & mask)
+			{
+				if (table[pos].first == key)
+					return &table[pos];
+				if (table[pos].first == EMPTY_KEY)
+					return nullptr;
+			}
+		}
+		//! rebuilds the table without tombstones, sized for at least n entries
+		void rehash(size_t n)
+		{
+			size_t newSize = 16;
+			while (newSize < n * 2 + 2)
+				newSize *= 2;
+			std::vector<value_type> oldSlots(newSize, value_type(uint64_t(EMPTY_KEY), T()));
+			oldSlots.swap(table);
+			size_t mask = newSize - 1;
+			for (auto &slot: oldSlots)
+			{
+				if (slot.first >= TOMBSTONE_KEY)
+					continue;
+				size_t pos = hash(slot.first) & mask;
+				while (table[pos].first != EMPTY_KEY)
+					pos = (pos + 1) & mask;
+				table[pos].first = slot.first;
+				table[pos].second = std::move(slot.second);
+			}
+			used = numEntries;
+		}
+		std::vector<value_type> table;
+		//! occupied slots including tombstones
+		size_t used = 0;
+		size_t numEntries = 0;
+};
+
+#endif // VG_LIB_BLOCKMAP_H
@@ -0,0 +1,132 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "lzcodec.h"
+
+#include <cstring>
+
+static const int MIN_MATCH = 4;
+static const int HASH_BITS = 12;
+static const size_t MAX_OFFSET = 0xFFFF;
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t val;
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static inline uint32_t hash32(uint32_t val)
+{
+	return (val * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void LZCodec::writeLength(std::vector<uint8_t> &dst, size_t length)
+{
+	// lengths of 15 and more continue in bytes of 255 until a smaller one
+	for (; length >= 255; length -= 255)
+		dst.push_back(255);
+	dst.push_back(uint8_t(length));
+}
+
+size_t LZCodec::compress(const void *src, size_t size, std::vector<uint8_t> &dst)
+{
+	const uint8_t *in = static_cast<const uint8_t*>(src);
+	size_t startSize = dst.size();
+	// positions + 1 of the last occurrence of each hashed 4 byte sequence, 0 is none
+	std::vector<uint32_t> table(1 << HASH_BITS, 0);
+	size_t anchor = 0, pos = 0;
+	while (size >= MIN_MATCH && pos <= size - MIN_MATCH)
+	{
+		uint32_t seq = read32(in + pos);
+		uint32_t &entry = table[hash32(seq)];
+		size_t candidate = entry;
+		entry = uint32_t(pos + 1);
+		if (!candidate || pos - (candidate - 1) > MAX_OFFSET || read32(in + candidate - 1) != seq)
+		{
+			++pos;
+			continue;
+		}
+		size_t matchPos = candidate - 1;
+		size_t matchLen = MIN_MATCH;
+		while (pos + matchLen < size && in[matchPos + matchLen] == in[pos + matchLen])
+			++matchLen;
+		size_t litLen = pos - anchor;
+		size_t matchCode = matchLen - MIN_MATCH;
+		dst.push_back(uint8_t((litLen < 15 ? litLen : 15) << 4 | (matchCode < 15 ? matchCode : 15)));
+		if (litLen >= 15)
+			writeLength(dst, litLen - 15);
+		dst.insert(dst.end(), in + anchor, in + pos);
+		size_t offset = pos - matchPos;
+		dst.push_back(uint8_t(offset));
+		dst.push_back(uint8_t(offset >> 8));
+		if (matchCode >= 15)
+			writeLength(dst, matchCode - 15);
+		pos += matchLen;
+		anchor = pos;
+	}
+	// the last sequence only has literals
+	size_t litLen = size - anchor;
+	dst.push_back(uint8_t((litLen < 15 ? litLen : 15) << 4));
+	if (litLen >= 15)
+		writeLength(dst, litLen - 15);
+	dst.insert(dst.end(), in + anchor, in + size);
+	return dst.size() - startSize;
+}
+
+bool LZCodec::decompress(const uint8_t *src, size_t size, void *dst, size_t dstSize)
+{
+	uint8_t *out = static_cast<uint8_t*>(dst);
+	const uint8_t *end = src + size;
+	size_t outPos = 0;
+	while (src < end)
+	{
+		uint8_t token = *src++;
+		size_t litLen = token >> 4;
+		if (litLen == 15)
+		{
+			uint8_t add;
+			do
+			{
+				if (src == end)
+					return false;
+				add = *src++;
+				litLen += add;
+			} while (add == 255);
+		}
+		if (litLen > size_t(end - src) || litLen > dstSize - outPos)
+			return false;
+		memcpy(out + outPos, src, litLen);
+		src += litLen;
+		outPos += litLen;
+		if (src == end)
+			break;
+		if (end - src < 2)
+			return false;
+		size_t offset = src[0] | (src[1] << 8);
+		src += 2;
+		size_t matchLen = (token & 15) + MIN_MATCH;
+		if ((token & 15) == 15)
+		{
+			uint8_t add;
+			do
+			{
+				if (src == end)
+					return false;
+				add = *src++;
+				matchLen += add;
+			} while (add == 255);
+		}
+		if (offset == 0 || offset > outPos || matchLen > dstSize - outPos)
+			return false;
+		// matches may overlap their own output, so copy bytewise
+		for (size_t i = 0; i < matchLen; ++i, ++outPos)
+			out[outPos] = out[outPos - offset];
+	}
+	return outPos == dstSize;
+}
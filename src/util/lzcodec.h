@@ -0,0 +1,31 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef VG_LIB_LZCODEC_H
+#define VG_LIB_LZCODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*! Fast LZ77 block compression in the style of LZ4: sequences of a token byte (literal and
+	match length nibbles), extra length bytes, the literals and a 16 bit match offset.
+	Meant for in-memory data like undo history, so the format is not compatible with LZ4 frames. */
+class LZCodec
+{
+	public:
+		//! appends the compressed data to dst and returns the compressed size
+		static size_t compress(const void *src, size_t size, std::vector<uint8_t> &dst);
+		/*! decompresses exactly dstSize bytes to dst; returns false on malformed input,
+			which includes input that does not decode to dstSize bytes */
+		static bool decompress(const uint8_t *src, size_t size, void *dst, size_t dstSize);
+	protected:
+		static void writeLength(std::vector<uint8_t> &dst, size_t length);
+};
+
+#endif // VG_LIB_LZCODEC_H
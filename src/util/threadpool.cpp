@@ -0,0 +1,88 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "threadpool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int numThreads): nextItem(0)
+{
+	if (numThreads <= 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 1; i < numThreads; ++i)
+		workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wakeCond.notify_all();
+	for (auto &thread: workers)
+		thread.join();
+}
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::parallelFor(int count, const taskFunc_t &func)
+{
+	if (count <= 0)
+		return;
+	// not worth waking up anyone
+	if (count == 1 || workers.empty())
+	{
+		for (int i = 0; i < count; ++i)
+			func(i, 0);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		task = &func;
+		itemCount = count;
+		nextItem.store(0, std::memory_order_relaxed);
+		busyWorkers = int(workers.size());
+		++batch;
+	}
+	wakeCond.notify_all();
+	runItems(0);
+	// func must stay valid until every worker has left runItems()
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCond.wait(lock, [this] { return busyWorkers == 0; });
+	task = nullptr;
+}
+
+void ThreadPool::runItems(int worker)
+{
+	int item;
+	while ((item = nextItem.fetch_add(1, std::memory_order_relaxed)) < itemCount)
+		(*task)(item, worker);
+}
+
+void ThreadPool::workerLoop(int worker)
+{
+	unsigned int lastBatch = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		wakeCond.wait(lock, [&] { return quit || batch != lastBatch; });
+		if (quit)
+			return;
+		lastBatch = batch;
+		lock.unlock();
+		runItems(worker);
+		lock.lock();
+		if (--busyWorkers == 0)
+			doneCond.notify_one();
+	}
+}
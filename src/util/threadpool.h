@@ -0,0 +1,51 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef VG_LIB_THREADPOOL_H
+#define VG_LIB_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*! A fixed set of worker threads that process indexed work items.
+	The calling thread takes part in the work, so a pool of size 1 has no extra threads. */
+class ThreadPool
+{
+	public:
+		//! func(item, worker) gets called once for every item in [0, count)
+		typedef std::function<void(int, int)> taskFunc_t;
+		//! numThreads == 0 picks the hardware concurrency
+		explicit ThreadPool(int numThreads = 0);
+		~ThreadPool();
+		//! number of threads that run tasks, including the calling thread
+		int size() const { return int(workers.size()) + 1; }
+		/*! runs func for all items and returns when all are done. The worker index passed
+			to func is in [0, size()) and unique among concurrently running calls, so it can
+			be used to select per-thread scratch data. Not reentrant. */
+		void parallelFor(int count, const taskFunc_t &func);
+		static ThreadPool& global();
+	protected:
+		void workerLoop(int worker);
+		void runItems(int worker);
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable wakeCond;
+		std::condition_variable doneCond;
+		const taskFunc_t *task = nullptr;
+		std::atomic<int> nextItem;
+		int itemCount = 0;
+		int busyWorkers = 0;
+		unsigned int batch = 0;
+		bool quit = false;
+};
+
+#endif // VG_LIB_THREADPOOL_H
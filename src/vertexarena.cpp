@@ -0,0 +1,287 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "vertexarena.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+
+VertexArena::VertexArena(int elementSize, int verticesPerElement, setupFunc_t setupFunc, bool pageOrigins,
+						 GLenum textureFormat):
+	elementSize(elementSize), verticesPerElement(verticesPerElement), setupFunc(setupFunc),
+	textureFormat(textureFormat), pageOrigins(pageOrigins)
+{
+	pageVertexShift = 0;
+	while ((1u << pageVertexShift) < PAGE_ELEMENTS * verticesPerElement)
+		++pageVertexShift;
+}
+
+VertexArena::Range VertexArena::allocate(QOpenGLFunctions_3_3_Core &glf, uint32_t count)
+{
+	reclaim(glf);
+	count = (count + PAGE_ELEMENTS - 1) & ~(PAGE_ELEMENTS - 1);
+	const uint32_t limit = chunkLimit(glf);
+	if (count > limit)
+	{
+		std::cout << "(!) vertex arena: " << count << " elements exceed the chunk size of " << limit << std::endl;
+		return Range();
+	}
+	// best fit keeps the large ranges for large meshes
+	Range range;
+	Chunk *bestChunk = nullptr;
+	std::map<uint32_t, uint32_t>::iterator best;
+	for (size_t chunkN = 0; chunkN < chunks.size(); ++chunkN)
+	{
+		std::map<uint32_t, uint32_t> &freeRanges = chunks[chunkN].freeRanges;
+		for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it)
+		{
+			if (it->second >= count && (!bestChunk || it->second < best->second))
+			{
+				bestChunk = &chunks[chunkN];
+				best = it;
+				range.chunk = chunkN;
+			}
+		}
+	}
+	if (!bestChunk)
+	{
+		// chunks before the last one are full, only the last one may still grow
+		if (chunks.empty() || chunks.back().capacity + count > limit)
+			chunks.emplace_back();
+		range.chunk = chunks.size() - 1;
+		uint32_t capacity = chunks.back().capacity;
+		uint32_t newCapacity = std::max(std::max(2 * capacity, capacity + count), uint32_t(1 << 20) / elementSize);
+		grow(glf, range.chunk, std::min(newCapacity, limit));
+		bestChunk = &chunks.back();
+		// the new space got merged with a free range at the end, if there was one
+		best = std::prev(bestChunk->freeRanges.end());
+	}
+	range.offset = best->first;
+	range.count = count;
+	uint32_t remaining = best->second - count;
+	bestChunk->freeRanges.erase(best);
+	if (remaining)
+		bestChunk->freeRanges.emplace(range.offset + count, remaining);
+	used += count;
+	glf.glBindVertexArray(bestChunk->glVAO);
+	return range;
+}
+
+void VertexArena::free(const Range &range)
+{
+	if (range.count)
+		freedThisFrame.push_back(range);
+}
+
+void VertexArena::upload(QOpenGLFunctions_3_3_Core &glf, const Range &range, const void *data, size_t size)
+{
+	Chunk &chunk = chunks[range.chunk];
+	glf.glBindBuffer(GL_ARRAY_BUFFER, chunk.glVBO);
+	// nothing in flight reads the range, see reclaim(), but the copy of the last grow() may still write it
+	GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+	if (!copyPending(glf, chunk, range))
+		access |= GL_MAP_UNSYNCHRONIZED_BIT;
+	void *dest = glf.glMapBufferRange(GL_ARRAY_BUFFER, GLintptr(range.offset) * elementSize, size, access);
+	if (dest)
+	{
+		std::memcpy(dest, data, size);
+		glf.glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
+	else
+		glf.glBufferSubData(GL_ARRAY_BUFFER, GLintptr(range.offset) * elementSize, size, data);
+}
+
+void VertexArena::setOrigin(QOpenGLFunctions_3_3_Core &glf, const Range &range, float x, float y, float z)
+{
+	std::vector<float> origins(4 * (range.count / PAGE_ELEMENTS));
+	for (size_t i = 0; i < origins.size(); i += 4)
+	{
+		origins[i] = x;
+		origins[i + 1] = y;
+		origins[i + 2] = z;
+		origins[i + 3] = 0.f;
+	}
+	glf.glBindBuffer(GL_ARRAY_BUFFER, chunks[range.chunk].glOriginVBO);
+	glf.glBufferSubData(GL_ARRAY_BUFFER, GLintptr(range.offset / PAGE_ELEMENTS) * 4 * sizeof(float),
+						origins.size() * sizeof(float), origins.data());
+}
+
+void VertexArena::endFrame(QOpenGLFunctions_3_3_Core &glf)
+{
+	if (freedThisFrame.empty())
+		return;
+	PendingFree pending;
+	pending.fence = glf.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	pending.ranges.swap(freedThisFrame);
+	pendingFrees.push_back(std::move(pending));
+}
+
+void VertexArena::cleanupGL(QOpenGLFunctions_3_3_Core &glf)
+{
+	for (PendingFree &pending: pendingFrees)
+		glf.glDeleteSync(pending.fence);
+	pendingFrees.clear();
+	freedThisFrame.clear();
+	for (Chunk &chunk: chunks)
+	{
+		if (chunk.growFence)
+			glf.glDeleteSync(chunk.growFence);
+		glf.glDeleteTextures(1, &chunk.glTexture);
+		glf.glDeleteTextures(1, &chunk.glOriginTexture);
+		glf.glDeleteBuffers(1, &chunk.glVBO);
+		glf.glDeleteBuffers(1, &chunk.glOriginVBO);
+		glf.glDeleteVertexArrays(1, &chunk.glVAO);
+	}
+	chunks.clear();
+	used = 0;
+}
+
+size_t VertexArena::capacityBytes() const
+{
+	size_t capacity = 0;
+	for (const Chunk &chunk: chunks)
+		capacity += chunk.capacity;
+	return capacity * elementSize;
+}
+
+void VertexArena::reclaim(QOpenGLFunctions_3_3_Core &glf)
+{
+	while (!pendingFrees.empty())
+	{
+		PendingFree &pending = pendingFrees.front();
+		GLenum status = glf.glClientWaitSync(pending.fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+		glf.glDeleteSync(pending.fence);
+		for (const Range &range: pending.ranges)
+		{
+			insertFree(chunks[range.chunk], range.offset, range.count);
+			used -= range.count;
+		}
+		pendingFrees.pop_front();
+	}
+}
+
+bool VertexArena::copyPending(QOpenGLFunctions_3_3_Core &glf, Chunk &chunk, const Range &range)
+{
+	if (!chunk.growFence)
+		return false;
+	GLenum status = glf.glClientWaitSync(chunk.growFence, 0, 0);
+	if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+	{
+		glf.glDeleteSync(chunk.growFence);
+		chunk.growFence = nullptr;
+		return false;
+	}
+	return range.offset < chunk.copiedCapacity;
+}
+
+void VertexArena::insertFree(Chunk &chunk, uint32_t offset, uint32_t count)
+{
+	std::map<uint32_t, uint32_t> &freeRanges = chunk.freeRanges;
+	auto next = freeRanges.lower_bound(offset);
+	if (next != freeRanges.begin())
+	{
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset)
+		{
+			offset = prev->first;
+			count += prev->second;
+			freeRanges.erase(prev);
+		}
+	}
+	if (next != freeRanges.end() && offset + count == next->first)
+	{
+		count += next->second;
+		freeRanges.erase(next);
+	}
+	freeRanges.emplace(offset, count);
+}
+
+uint32_t VertexArena::chunkLimit(QOpenGLFunctions_3_3_Core &glf)
+{
+	if (maxChunkElements)
+		return maxChunkElements;
+	// single buffers stay below 2 GiB, GLintptr has 32 bits on 32 bit builds
+	uint64_t limit = (uint64_t(1) << 31) / elementSize;
+	if (textureFormat || pageOrigins)
+	{
+		GLint maxTexels = 0;
+		glf.glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+		// the least GL 3.3 guarantees
+		maxTexels = std::max(maxTexels, 65536);
+		if (textureFormat)
+			limit = std::min(limit, uint64_t(maxTexels));
+		if (pageOrigins)
+			limit = std::min(limit, uint64_t(maxTexels) * PAGE_ELEMENTS);
+	}
+	maxChunkElements = uint32_t(limit) & ~(PAGE_ELEMENTS - 1);
+	return maxChunkElements;
+}
+
+void VertexArena::grow(QOpenGLFunctions_3_3_Core &glf, uint32_t chunkN, uint32_t newCapacity)
+{
+	Chunk &chunk = chunks[chunkN];
+	newCapacity = (newCapacity + PAGE_ELEMENTS - 1) & ~(PAGE_ELEMENTS - 1);
+	if (!chunk.glVAO)
+		glf.glGenVertexArrays(1, &chunk.glVAO);
+	if (textureFormat && !chunk.glTexture)
+		glf.glGenTextures(1, &chunk.glTexture);
+	growBuffer(glf, chunk.glVBO, GLsizeiptr(chunk.capacity) * elementSize, GLsizeiptr(newCapacity) * elementSize,
+			   chunk.glTexture, textureFormat);
+	if (pageOrigins)
+	{
+		if (!chunk.glOriginTexture)
+			glf.glGenTextures(1, &chunk.glOriginTexture);
+		const GLsizeiptr pageSize = 4 * sizeof(float);
+		growBuffer(glf, chunk.glOriginVBO, chunk.capacity / PAGE_ELEMENTS * pageSize,
+				   newCapacity / PAGE_ELEMENTS * pageSize, chunk.glOriginTexture, GL_RGBA32F);
+	}
+	if (chunk.capacity)
+	{
+		// the copy replaces any older one still in flight
+		if (chunk.growFence)
+			glf.glDeleteSync(chunk.growFence);
+		chunk.growFence = glf.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		chunk.copiedCapacity = chunk.capacity;
+	}
+	std::cout << "vertex arena chunk " << chunkN << " grows to " << GLsizeiptr(newCapacity) * elementSize << " Bytes\n";
+	insertFree(chunk, chunk.capacity, newCapacity - chunk.capacity);
+	chunk.capacity = newCapacity;
+	// attribute pointers refer to the buffer object, not its binding
+	glf.glBindVertexArray(chunk.glVAO);
+	glf.glBindBuffer(GL_ARRAY_BUFFER, chunk.glVBO);
+	setupFunc(glf);
+}
+
+void VertexArena::growBuffer(QOpenGLFunctions_3_3_Core &glf, GLuint &buffer, GLsizeiptr oldSize, GLsizeiptr newSize,
+							 GLuint texture, GLenum textureFormat)
+{
+	GLuint newBuffer;
+	glf.glGenBuffers(1, &newBuffer);
+	glf.glBindBuffer(GL_ARRAY_BUFFER, newBuffer);
+	glf.glBufferData(GL_ARRAY_BUFFER, newSize, nullptr, GL_DYNAMIC_DRAW);
+	if (buffer)
+	{
+		// the old buffer stays alive until pending draws are done with it
+		glf.glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glf.glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0, 0, oldSize);
+		glf.glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glf.glDeleteBuffers(1, &buffer);
+	}
+	buffer = newBuffer;
+	// the buffer texture refers to the buffer object too
+	if (texture)
+	{
+		glf.glBindTexture(GL_TEXTURE_BUFFER, texture);
+		glf.glTexBuffer(GL_TEXTURE_BUFFER, textureFormat, buffer);
+		glf.glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+}
@@ -0,0 +1,119 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef VG_VERTEXARENA_H
+#define VG_VERTEXARENA_H
+
+#include <QOpenGLFunctions_3_3_Core>
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <vector>
+
+/*! GL buffers that the meshes of one vertex format suballocate from.
+	Freed ranges only return to the free list once a fence says the GPU finished the frame that
+	freed them, so newly allocated ranges are never read by draws in flight and get written
+	unsynchronized. A buffer grows by copying on the GPU when it runs out of space; until that
+	copy is done, ranges within the copied part get written synchronized instead.
+	Optionally every allocation page gets an origin in a second buffer texture, which lets the
+	vertex shader find the position of the mesh a vertex belongs to from gl_VertexID alone, so
+	meshes with relative positions can share one multi-draw call.
+	Buffer textures may not exceed GL_MAX_TEXTURE_BUFFER_SIZE texels, which GL 3.3 only
+	guarantees to be 65536, so the space is split into chunks that each have their own buffers,
+	VAO and textures. A chunk grows up to that limit, then a new one starts; meshes can only
+	share a draw call with meshes of the same chunk. */
+class VertexArena
+{
+	public:
+		//! elements are vertices or whatever else one mesh entry is
+		struct Range
+		{
+			uint32_t chunk = 0;
+			uint32_t offset = 0;
+			uint32_t count = 0;
+		};
+		//! sets up the vertex attributes for the buffer bound to GL_ARRAY_BUFFER, with the VAO bound
+		typedef void (*setupFunc_t)(QOpenGLFunctions_3_3_Core &glf);
+		/*! @param verticesPerElement: vertex IDs one element stands for, baseVertex() scales by it
+			@param pageOrigins: keep an RGBA32F buffer texture with one origin per page
+			@param textureFormat: if not 0, a buffer texture of this format gets kept on the buffer;
+			one texel must be one element */
+		VertexArena(int elementSize, int verticesPerElement, setupFunc_t setupFunc, bool pageOrigins,
+					GLenum textureFormat = 0);
+		//! allocation granularity in elements
+		static const uint32_t PAGE_ELEMENTS = 64;
+		/*! returns a range of at least count elements within one chunk, growing the last chunk or
+			starting a new one if needed. Leaves the VAO of the chunk bound. The range is empty if
+			count exceeds what a chunk may hold */
+		Range allocate(QOpenGLFunctions_3_3_Core &glf, uint32_t count);
+		//! the range may still be in use by the current frame, it gets reused after endFrame()
+		void free(const Range &range);
+		//! writes size bytes of data to the start of range
+		void upload(QOpenGLFunctions_3_3_Core &glf, const Range &range, const void *data, size_t size);
+		//! sets the origin of all pages of range, requires pageOrigins
+		void setOrigin(QOpenGLFunctions_3_3_Core &glf, const Range &range, float x, float y, float z);
+		void bind(QOpenGLFunctions_3_3_Core &glf, uint32_t chunk) { glf.glBindVertexArray(chunks[chunk].glVAO); }
+		GLuint texture(uint32_t chunk) const { return chunks[chunk].glTexture; }
+		GLuint originTexture(uint32_t chunk) const { return chunks[chunk].glOriginTexture; }
+		//! the page of a vertex ID is vertexID >> pageShift()
+		int pageShift() const { return pageVertexShift; }
+		int getElementSize() const { return elementSize; }
+		//! the basevertex argument for drawing range, relative to its chunk
+		GLint baseVertex(const Range &range) const { return range.offset * verticesPerElement; }
+		//! fences the ranges freed since the last call; call once per frame after drawing
+		void endFrame(QOpenGLFunctions_3_3_Core &glf);
+		//! deletes all GL objects, the arena is empty afterwards
+		void cleanupGL(QOpenGLFunctions_3_3_Core &glf);
+		size_t capacityBytes() const;
+		size_t usedBytes() const { return size_t(used) * elementSize; }
+	protected:
+		struct Chunk
+		{
+			GLuint glVBO = 0;
+			GLuint glVAO = 0;
+			GLuint glTexture = 0;
+			GLuint glOriginVBO = 0;
+			GLuint glOriginTexture = 0;
+			uint32_t capacity = 0;
+			//! offset -> count, adjacent ranges are always merged
+			std::map<uint32_t, uint32_t> freeRanges;
+			//! signals when the copy of the last grow() is done, which covered copiedCapacity elements
+			GLsync growFence = nullptr;
+			uint32_t copiedCapacity = 0;
+		};
+		struct PendingFree
+		{
+			GLsync fence;
+			std::vector<Range> ranges;
+		};
+		//! the most elements a chunk may hold, queried on first use
+		uint32_t chunkLimit(QOpenGLFunctions_3_3_Core &glf);
+		void grow(QOpenGLFunctions_3_3_Core &glf, uint32_t chunkN, uint32_t newCapacity);
+		//! replaces buffer by a larger one with the same content, keeps texture on it if not 0
+		static void growBuffer(QOpenGLFunctions_3_3_Core &glf, GLuint &buffer, GLsizeiptr oldSize, GLsizeiptr newSize,
+							   GLuint texture, GLenum textureFormat);
+		//! returns ranges of finished frames to the free lists
+		void reclaim(QOpenGLFunctions_3_3_Core &glf);
+		static void insertFree(Chunk &chunk, uint32_t offset, uint32_t count);
+		//! true if the copy of the last grow() of its chunk may not have written range yet
+		static bool copyPending(QOpenGLFunctions_3_3_Core &glf, Chunk &chunk, const Range &range);
+		int elementSize;
+		int verticesPerElement;
+		setupFunc_t setupFunc;
+		GLenum textureFormat;
+		bool pageOrigins;
+		int pageVertexShift;
+		uint32_t maxChunkElements = 0;
+		uint32_t used = 0;
+		std::vector<Chunk> chunks;
+		std::vector<Range> freedThisFrame;
+		std::deque<PendingFree> pendingFrees;
+};
+
+#endif // VG_VERTEXARENA_H
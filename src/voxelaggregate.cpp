@@ -7,144 +7,243 @@
  */
 
 #include "voxelaggregate.h"
+#include "util/threadpool.h"
 
+#include <atomic>
 #include <iostream>
+#include <memory>
 
 uint64_t VoxelAggregate::setVoxel(const IVector3D &pos, const VoxelEntry &voxel)
 {
 	uint64_t id = blockID(pos.x, pos.y, pos.z);
-	blockMap_t::iterator grid = blockMap.find(id);
-	if (grid == blockMap.end())
+	blockMap_t::value_type *grid = blockMap.findCached(id);
+	if (!grid)
 	{
 		IVector3D gridPos(
 			pos.x & ~(int)(GRID_LEN - 1),
 			pos.y & ~(int)(GRID_LEN - 1),
 			pos.z & ~(int)(GRID_LEN - 1) );
-		std::cout << "creating grid at (" << gridPos[0] << ", " << gridPos[1] << ", " << gridPos[2] << ")\n";
-		voxelGridPtr_t posGrid(new VoxelGrid(gridPos));
-		grid = blockMap.emplace(id, posGrid).first;
+		grid = &*insertBlock(id, GridHandle(new VoxelGrid(gridPos), generation));
 	}
-	// TODO: this should only ever happen when render and editing layer share data, which would be okay.
-	// we should find a way to ensure this and throw an error otherwise.
-	else if (grid->second.use_count() > 1)
+	// this should only ever happen when render and editing layer share data, which is okay.
+	else if (!grid->second.isOwnedBy(generation))
 	{
 		std::cout << "grid is currently shared, creating copy.\n";
-		grid->second = voxelGridPtr_t(new VoxelGrid(*grid->second));
 	}
 //	std::cout << "setting voxel (" << (x & (int)(GRID_LEN - 1)) << ", " << (y & (int)(GRID_LEN - 1)) << ", " << (z & (int)(GRID_LEN - 1)) << ")\n";
-	grid->second->setVoxel(pos.x & (int)(GRID_LEN - 1), pos.y & (int)(GRID_LEN - 1), pos.z & (int)(GRID_LEN - 1), voxel);
+	grid->second.writable(generation)->setVoxel(pos.x & (int)(GRID_LEN - 1), pos.y & (int)(GRID_LEN - 1), pos.z & (int)(GRID_LEN - 1), voxel);
 	return id;
 }
 
 const VoxelEntry* VoxelAggregate::getVoxel(const IVector3D &pos) const
 {
 	uint64_t id = blockID(pos[0], pos[1], pos[2]);
-	blockMap_t::const_iterator grid = blockMap.find(id);
-	if (grid == blockMap.end())
+	const blockMap_t::value_type *grid = blockMap.findCached(id);
+	if (!grid)
 		return 0;
 	IVector3D gridPos(pos.x & (int)(GRID_LEN - 1), pos.y & (int)(GRID_LEN - 1), pos.z & (int)(GRID_LEN - 1));
 	return grid->second->getVoxel(gridPos);
 }
 
-bool VoxelAggregate::rayIntersect(const ray_t &ray, SceneRayHit &hit) const
+IBBox VoxelAggregate::traversalBound(IVector3D &superMin, IVector3D &superMax) const
 {
-	// TODO: this is a brute force place holder implementation
-	bool didHit = false;
-	for (auto &grid: blockMap)
+	const int superLen = SUPERBLOCK_LEN * GRID_LEN;
+	for (int i = 0; i < 3; ++i)
+	{
+		superMin[i] = blockMin[i] >> LOG_SUPERBLOCK_LEN;
+		superMax[i] = blockMax[i] >> LOG_SUPERBLOCK_LEN;
+	}
+	return IBBox(IVector3D(superMin.x * superLen, superMin.y * superLen, superMin.z * superLen),
+				 IVector3D((superMax.x + 1) * superLen, (superMax.y + 1) * superLen, (superMax.z + 1) * superLen));
+}
+
+bool VoxelAggregate::traverse(const ray_t &ray, float tStart, const IVector3D &superMin, const IVector3D &superMax,
+							  SceneRayHit &hit) const
+{
+	const int superLen = SUPERBLOCK_LEN * GRID_LEN;
+	// coarse traversal over superblocks, only descend into occupied ones
+	GridTraversal coarse(ray, tStart, superLen, superMin, superMax);
+	do
 	{
-		SceneRayHit isect;
-		if (grid.second->rayIntersect(ray, isect))
+		const IVector3D &sc = coarse.cell;
+		if (!superBlocks.count(blockID(sc.x * superLen, sc.y * superLen, sc.z * superLen)))
+			continue;
+		IVector3D lo(sc.x * SUPERBLOCK_LEN, sc.y * SUPERBLOCK_LEN, sc.z * SUPERBLOCK_LEN);
+		IVector3D hi = lo + IVector3D(SUPERBLOCK_LEN - 1, SUPERBLOCK_LEN - 1, SUPERBLOCK_LEN - 1);
+		GridTraversal fine(ray, coarse.tEnter, GRID_LEN, lo, hi);
+		do
 		{
-			if (!didHit || isect.rayT < hit.rayT)
+			const IVector3D &c = fine.cell;
+			blockMap_t::const_iterator grid = blockMap.find(blockID(c.x * GRID_LEN, c.y * GRID_LEN, c.z * GRID_LEN));
+			// blocks are visited in ray order, so the first hit is the closest
+			SceneRayHit isect;
+			if (grid != blockMap.end() && grid->second->rayIntersect(ray, isect))
 			{
 				hit = isect;
+				return true;
 			}
-			didHit = true;
-		}
-	}
-	return didHit;
+		} while (fine.next(ray.t_max));
+	} while (coarse.next(ray.t_max));
+	return false;
+}
+
+bool VoxelAggregate::rayIntersect(const ray_t &ray, SceneRayHit &hit) const
+{
+	if (blockMap.empty())
+		return false;
+	IVector3D superMin, superMax;
+	IBBox bound = traversalBound(superMin, superMax);
+	float tStart;
+	int entryAxis;
+	if (!bound.rayIntersect(ray, tStart, entryAxis))
+		return false;
+	return traverse(ray, std::max(ray.t_min, tStart), superMin, superMax, hit);
+}
+
+int VoxelAggregate::rayIntersectBatch(const RayPacket &rays, SceneRayHit *hits) const
+{
+	const int count = rays.size();
+	for (int i = 0; i < count; ++i)
+		hits[i].flags = 0;
+	if (blockMap.empty() || count == 0)
+		return 0;
+	IVector3D superMin, superMax;
+	IBBox bound = traversalBound(superMin, superMax);
+	// cull the whole packet against the bound first
+	std::vector<float> tStart(count);
+	std::vector<int> entryAxis(count);
+	std::vector<char> inBound(count);
+	if (bound.rayIntersect(rays, tStart.data(), entryAxis.data(), inBound.data()) == 0)
+		return 0;
+
+	const int chunkSize = 64;
+	std::atomic<int> nHits(0);
+	ThreadPool::global().parallelFor((count + chunkSize - 1) / chunkSize, [&](int chunk, int)
+		{
+			int chunkHits = 0;
+			int end = std::min(count, (chunk + 1) * chunkSize);
+			for (int i = chunk * chunkSize; i < end; ++i)
+			{
+				if (!inBound[i])
+					continue;
+				ray_t ray = rays.getRay(i);
+				if (traverse(ray, std::max(ray.t_min, tStart[i]), superMin, superMax, hits[i]))
+				{
+					hits[i].flags |= SceneRayHit::HIT_VOXEL;
+					++chunkHits;
+				}
+			}
+			nHits += chunkHits;
+		});
+	return nHits;
 }
 
 void VoxelAggregate::clear()
 {
 	//TODO! cache some grids for later use
 	blockMap.clear();
+	superBlocks.clear();
 }
 
 void VoxelAggregate::clearBlocks(const std::unordered_set<uint64_t> &blocks)
 {
 	for (auto &id: blocks)
 	{
-		blockMap.erase(id);
-	}
-}
-
-void VoxelAggregate::clearBlocks(const std::unordered_map<uint64_t, DirtyVolume> &blocks)
-{
-	for (auto &id: blocks)
-	{
-		blockMap.erase(id.first);
+		eraseBlock(id);
 	}
 }
 
 void VoxelAggregate::clone(const VoxelAggregate &source)
 {
 	clear();
+	blockMap.reserve(source.blockMap.size());
 	for (auto &block: source.blockMap)
-		blockMap.emplace(block.first, block.second);
+		insertBlock(block.first, block.second.share());
+	source.revokeOwnership();
 }
 
 VoxelAggregate* VoxelAggregate::duplicate() const
 {
 	VoxelAggregate* dupe = new VoxelAggregate();
+	dupe->blockMap.reserve(blockMap.size());
 	for (auto &block: blockMap)
-		dupe->blockMap.emplace(block.first, new VoxelGrid(*block.second));
+		dupe->insertBlock(block.first, GridHandle(new VoxelGrid(*block.second), dupe->generation));
 	return dupe;
 }
 
 void VoxelAggregate::merge(const VoxelAggregate &topLayer)
 {
+	bool shared = false;
 	for (auto &topGrid: topLayer.blockMap)
 	{
 		blockMap_t::iterator grid = blockMap.find(topGrid.first);
 		if (grid == blockMap.end())
 		{
 			// no need to merge grid
-			blockMap.emplace(topGrid.first, topGrid.second);
+			insertBlock(topGrid.first, topGrid.second.share());
+			shared = true;
 		}
-		else if (grid->second != topGrid.second) // only merge if we actually reference different grids
+		else if (!grid->second.sameGrid(topGrid.second)) // only merge if we actually reference different grids
 		{
-			if (grid->second.use_count() > 1) // need to copy or we modify multiple aggregates
-			{
-				grid->second = voxelGridPtr_t(new VoxelGrid(*grid->second));
-			}
-			grid->second->merge(*topGrid.second);
+			grid->second.writable(generation)->merge(*topGrid.second);
 		}
 	}
+	if (shared)
+		topLayer.revokeOwnership();
 }
 
-void VoxelAggregate::merge(const VoxelAggregate &topLayer, const std::unordered_map<uint64_t, DirtyVolume> &blocks)
+bool VoxelAggregate::composite(const VoxelAggregate &base, const VoxelAggregate &topLayer, uint64_t blockId,
+							   const DirtyVolume &vol)
 {
-	for (auto &block_id: blocks)
+	const VoxelEntry emptyEntry;
+	const VoxelGrid *baseGrid = base.getBlock(blockId);
+	const VoxelGrid *topGrid = topLayer.getBlock(blockId);
+	blockMap_t::iterator grid = blockMap.find(blockId);
+	const VoxelGrid *current = grid != blockMap.end() ? grid->second.get() : nullptr;
+	bool changed = false;
+	// cleared on the first change when there is no top layer, that only needs the change detected
+	bool scanning = true;
+	for (int z = vol.low.z & (GRID_LEN - 1); scanning && z <= (vol.high.z & (GRID_LEN - 1)); ++z)
+		for (int y = vol.low.y & (GRID_LEN - 1); scanning && y <= (vol.high.y & (GRID_LEN - 1)); ++y)
+			for (int x = vol.low.x & (GRID_LEN - 1); scanning && x <= (vol.high.x & (GRID_LEN - 1)); ++x)
 	{
-		blockMap_t::iterator grid = blockMap.find(block_id.first);
-		blockMap_t::const_iterator topGrid = topLayer.blockMap.find(block_id.first);
-		if (topGrid == topLayer.blockMap.end())
+		IVector3D pos(x, y, z);
+		const VoxelEntry *entry = baseGrid ? baseGrid->getVoxel(pos) : &emptyEntry;
+		if (topGrid)
+		{
+			const VoxelEntry *topEntry = topGrid->getVoxel(pos);
+			if (topEntry->flags & Voxel::VF_ERASED)
+				entry = &emptyEntry;
+			else if (topEntry->flags & Voxel::VF_NON_EMPTY)
+				entry = topEntry;
+		}
+		if (*entry == (current ? *current->getVoxel(pos) : emptyEntry))
 			continue;
-		if (grid == blockMap.end())
+		changed = true;
+		// without top layer the block simply becomes the base block, see below
+		if (!topGrid)
 		{
-			// no need to merge grid
-			blockMap.emplace(topGrid->first, topGrid->second);
+			scanning = false;
+			continue;
 		}
-		else if (grid->second != topGrid->second) // only merge if we actually reference different grids
+		if (grid == blockMap.end())
 		{
-			if (grid->second.use_count() > 1) // need to copy or we modify multiple aggregates
-			{
-				grid->second = voxelGridPtr_t(new VoxelGrid(*grid->second));
-			}
-			grid->second->merge(*topGrid->second);
+			IVector3D gridPos;
+			blockPos(blockId, gridPos);
+			grid = insertBlock(blockId, GridHandle(baseGrid ? new VoxelGrid(*baseGrid) : new VoxelGrid(gridPos), generation));
 		}
+		VoxelGrid *target = grid->second.writable(generation);
+		current = target;
+		target->setVoxel(x, y, z, *entry);
+	}
+	if (changed && !topGrid)
+	{
+		if (baseGrid)
+			shareBlock(blockId, base);
+		else
+			eraseBlock(blockId);
 	}
+	return changed;
 }
 
 void VoxelAggregate::applyChanges(const VoxelAggregate &toolLayer, AggregateMemento *memento)
@@ -155,28 +254,32 @@ void VoxelAggregate::applyChanges(const VoxelAggregate &toolLayer, AggregateMeme
 		GridMemento *gridMem = new GridMemento;
 		if (grid == blockMap.end())
 		{
-			voxelGridPtr_t posGrid(new VoxelGrid(toolGrid.second->getGridPos()));
-			if (posGrid->applyChanges(*toolGrid.second, nullptr) == 0)
+			GridHandle posGrid(new VoxelGrid(toolGrid.second->getGridPos()), generation);
+			if (posGrid.writable(generation)->applyChanges(*toolGrid.second, gridMem) == 0)
 			{
 				std::cout << "grid still empty, deleting grid and memento\n";
 				// posGrid will be deleted automatically due to refcounting
 				delete gridMem;
 				continue;
 			}
-			grid = blockMap.emplace(toolGrid.first, posGrid).first;
+			// undo erases the block again
+			gridMem->blockExists = false;
+			grid = insertBlock(toolGrid.first, posGrid);
 		}
 		else
 		{
-			// TODO: this creates an unnecessary copy when erasing grind with use_count > 1
+			// TODO: this creates an unnecessary copy when erasing a shared grid
 			// but we don't know yet if it will be empty
-			if (grid->second.use_count() > 1) // need to copy or we modify multiple aggregates
+			if (grid->second.writable(generation)->applyChanges(*toolGrid.second, gridMem) == 0)
 			{
-				grid->second = voxelGridPtr_t(new VoxelGrid(*grid->second));
+				//std::cout << "grid now empty, erasing from aggregate\n";
+				eraseBlock(toolGrid.first);
 			}
-			if (grid->second->applyChanges(*toolGrid.second, gridMem) == 0)
+			else if (gridMem->isEmpty())
 			{
-				//std::cout << "grid now empty, erasing from aggregate\n";
-				blockMap.erase(toolGrid.first);
+				// tool changes that left the grid as it was need no undo
+				delete gridMem;
+				continue;
 			}
 		}
 		memento->blockMap.emplace(toolGrid.first, gridMementoPtr_t(gridMem));
@@ -185,46 +288,49 @@ void VoxelAggregate::applyChanges(const VoxelAggregate &toolLayer, AggregateMeme
 
 void VoxelAggregate::restoreState(AggregateMemento *memento, std::unordered_set<uint64_t> &changed)
 {
+	// callers check AggregateMemento::decompress() first, which leaves nothing to unpack here
+	memento->compressed = false;
 	for (auto &memGrid: memento->blockMap)
 	{
-		if (!memGrid.second.get()->isEmpty())
+		GridMemento *gridMem = memGrid.second.get();
+		blockMap_t::iterator grid = blockMap.find(memGrid.first);
+		bool existed = grid != blockMap.end();
+		if (!gridMem->blockExists)
 		{
-			blockMap_t::iterator grid = blockMap.find(memGrid.first);
-			if (grid == blockMap.end())
+			if (existed)
 			{
-				// restore deleted grid; memento will be empty after construction
-				IVector3D pos;
-				blockPos(memGrid.first, pos);
-				voxelGridPtr_t posGrid(new VoxelGrid(pos, memGrid.second.get()));
-				grid = blockMap.emplace(memGrid.first, posGrid).first;
-				//std::cout << "restored emptied grid; mememto.isEmpty(): " << memGrid.second.get()->isEmpty() << std::endl;
+				// restoring would empty the grid, so only save the voxels the memento covers
+				grid->second->saveState(gridMem);
+				eraseBlock(memGrid.first);
 			}
 			else
-			{
-				// this modifies the GridMemento to reflect its previous state!
-				grid->second->restoreState(memGrid.second.get());
-			}
+				std::cout << "(!) unexpected erasing of already empty grid!\n";
 		}
-		// delete grid
 		else
 		{
-			blockMap_t::iterator grid = blockMap.find(memGrid.first);
-			if (grid == blockMap.end())
+			if (!existed)
 			{
-				std::cout << "(!) unexpected erasing of already empty grid!\n";
-			}
-			else
-			{
-				// note: we could probably move the state rather than copy,
-				// but grid access would be invalid until scene is updated.
-				grid->second->saveState(memGrid.second.get());
+				// restore deleted grid, it was all empty
+				IVector3D pos;
+				blockPos(memGrid.first, pos);
+				grid = insertBlock(memGrid.first, GridHandle(new VoxelGrid(pos), generation));
 			}
-			blockMap.erase(memGrid.first);
+			// this modifies the GridMemento to reflect its previous state!
+			grid->second.writable(generation)->restoreState(gridMem);
 		}
+		gridMem->blockExists = existed;
 		changed.insert(memGrid.first);
 	}
 }
 
+size_t VoxelAggregate::memoryUsage() const
+{
+	size_t bytes = 0;
+	for (auto &block: blockMap)
+		bytes += block.second->memoryUsage();
+	return bytes;
+}
+
 void VoxelAggregate::getNeighbours(const IVector3D &gridPos, const VoxelGrid* neighbours[27])
 {
 	for (int z = -1, i = 0; z < 2; ++z)
@@ -287,54 +393,254 @@ const VoxelGrid* VoxelAggregate::getBlock(uint64_t blockId) const
 	return 0;
 }
 
+VoxelGrid* VoxelAggregate::writableBlock(uint64_t blockId)
+{
+	blockMap_t::iterator grid = blockMap.find(blockId);
+	if (grid == blockMap.end())
+	{
+		IVector3D gridPos;
+		blockPos(blockId, gridPos);
+		grid = insertBlock(blockId, GridHandle(new VoxelGrid(gridPos), generation));
+	}
+	return grid->second.writable(generation);
+}
+
+void VoxelAggregate::setBlock(uint64_t blockId, VoxelGrid *grid)
+{
+	GridHandle handle(grid, generation);
+	blockMap_t::iterator existing = blockMap.find(blockId);
+	if (existing == blockMap.end())
+		insertBlock(blockId, handle);
+	else
+		existing->second = handle;
+}
+
+void VoxelAggregate::shareBlock(uint64_t blockId, const VoxelAggregate &source)
+{
+	GridHandle shared = source.blockMap.find(blockId)->second.share();
+	source.revokeOwnership();
+	blockMap_t::iterator grid = blockMap.find(blockId);
+	if (grid == blockMap.end())
+		insertBlock(blockId, shared);
+	else
+		grid->second = shared;
+}
+
+void VoxelAggregate::diffVoxels(const VoxelGrid &grid1, const VoxelGrid &grid2, const IBBox &bound, DirtyVolume &changed)
+{
+	const IVector3D &gridPos = grid1.getGridPos();
+	for (int z = bound.pMin.z; z < bound.pMax.z; ++z)
+		for (int y = bound.pMin.y; y < bound.pMax.y; ++y)
+			for (int x = bound.pMin.x; x < bound.pMax.x; ++x)
+	{
+		IVector3D pos(x - gridPos.x, y - gridPos.y, z - gridPos.z);
+		if (*grid1.getVoxel(pos) != *grid2.getVoxel(pos))
+			changed.addPosition(IVector3D(x, y, z));
+	}
+}
+
+blockMap_t::iterator VoxelAggregate::insertBlock(uint64_t id, const GridHandle &grid)
+{
+	std::pair<blockMap_t::iterator, bool> inserted = blockMap.emplace(id, grid);
+	if (!inserted.second)
+		return inserted.first;
+	++superBlocks[superBlockID(id)];
+	IVector3D pos;
+	blockPos(id, pos);
+	for (int i = 0; i < 3; ++i)
+		pos[i] >>= LOG_GRID_LEN;
+	if (blockMap.size() == 1)
+		blockMin = blockMax = pos;
+	for (int i = 0; i < 3; ++i)
+	{
+		blockMin[i] = std::min(blockMin[i], pos[i]);
+		blockMax[i] = std::max(blockMax[i], pos[i]);
+	}
+	return inserted.first;
+}
+
+void VoxelAggregate::eraseBlock(uint64_t id)
+{
+	if (!blockMap.erase(id))
+		return;
+	std::unordered_map<uint64_t, int>::iterator super = superBlocks.find(superBlockID(id));
+	if (--super->second == 0)
+		superBlocks.erase(super);
+}
+
+uint64_t VoxelAggregate::newGeneration()
+{
+	// 0 is reserved for handles without owner
+	static std::atomic<uint64_t> lastGeneration(0);
+	return ++lastGeneration;
+}
+
+uint64_t VoxelAggregate::superBlockID(uint64_t blockId)
+{
+	IVector3D pos;
+	blockPos(blockId, pos);
+	const int superMask = ~(SUPERBLOCK_LEN * GRID_LEN - 1);
+	return blockID(pos.x & superMask, pos.y & superMask, pos.z & superMask);
+}
+
 /*=================
   RenderAggregate
 =================*/
 
 void RenderAggregate::clear(QOpenGLFunctions_3_3_Core &glf)
 {
-	for (auto &rgrid: renderBlocks)
+	for (auto &rblock: renderBlocks)
+		releaseMeshes(glf, rblock.second);
+	renderBlocks.clear();
+	detachedBlocks.clear();
+	detachedBytes = 0;
+	drawListDirty = true;
+}
+
+void RenderAggregate::releaseMeshes(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block)
+{
+	retireMesh(glf, block);
+	for (auto &cached: block.cached)
 	{
-		rgrid.second->cleanupGL(glf);
-		delete rgrid.second;
+		cached.mesh->cleanupGL(glf);
+		delete cached.mesh;
 	}
-	renderBlocks.clear();
+	block.cached.clear();
 }
 
-void RenderAggregate::updateBlock(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid)
+void RenderAggregate::detachBlock(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block, uint64_t blockId)
 {
-	renderBlockMap_t::iterator rgrid = renderBlocks.find(blockId);
-	const VoxelGrid* neighbours[27];
-	if (rgrid == renderBlocks.end())
+	if (block.detached)
+		return;
+	retireMesh(glf, block);
+	block.detached = true;
+	block.detachedBytes = 0;
+	for (auto &cached: block.cached)
+		block.detachedBytes += cached.mesh->arenaBytes();
+	detachedBlocks.push_front(blockId);
+	block.detachedPos = detachedBlocks.begin();
+	detachedBytes += block.detachedBytes;
+	while (detachedBytes > DETACHED_MESH_BUDGET)
 	{
-		std::cout << "    allocating new RenderGrid" << std::endl;
-		rgrid = renderBlocks.emplace(blockId, new RenderGrid).first;
+		renderBlockMap_t::iterator oldest = renderBlocks.find(detachedBlocks.back());
+		detachedBytes -= oldest->second.detachedBytes;
+		detachedBlocks.pop_back();
+		releaseMeshes(glf, oldest->second);
+		renderBlocks.erase(oldest);
 	}
-	aggregate->getNeighbours(grid->getGridPos(), neighbours);
-	rgrid->second->update(glf, neighbours, options);
 }
 
-void RenderAggregate::updateBlockSliced(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid)
+void RenderAggregate::reattachBlock(RenderBlock &block)
+{
+	if (!block.detached)
+		return;
+	detachedBlocks.erase(block.detachedPos);
+	detachedBytes -= block.detachedBytes;
+	block.detached = false;
+	block.detachedBytes = 0;
+}
+
+void RenderAggregate::updateBlock(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid, jobList_t &jobs)
+{
+	TesselationJob job;
+	aggregate->getNeighbours(grid->getGridPos(), job.neighbours);
+	RenderBlock &block = renderBlocks[blockId];
+	reattachBlock(block);
+	block.bound = grid->getBound();
+	job.renderGrid = selectMesh(glf, block, neighbourKey(job.neighbours));
+	if (job.renderGrid)
+		jobs.push_back(job);
+}
+
+void RenderAggregate::updateBlockSliced(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid, jobList_t &jobs)
 {
-	renderBlockMap_t::iterator rgrid = renderBlocks.find(blockId);
 	// TODO: check if sliced
 	const IBBox &bound = grid->getBound();
 	if (bound.pMin[options.axis] > options.level || bound.pMax[options.axis] <= options.level)
 	{
-		if (rgrid != renderBlocks.end())
-			rgrid->second->clear(glf);
+		renderBlockMap_t::iterator rblock = renderBlocks.find(blockId);
+		if (rblock != renderBlocks.end())
+		{
+			reattachBlock(rblock->second);
+			retireMesh(glf, rblock->second);
+		}
 		return;
 	}
+	updateBlock(glf, blockId, grid, jobs);
+	// TODO: sliced update function
+}
 
-	const VoxelGrid* neighbours[27];
-	if (rgrid == renderBlocks.end())
+RenderGrid* RenderAggregate::selectMesh(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block, uint64_t key)
+{
+	if (block.current && block.key == key)
+		return nullptr;
+	retireMesh(glf, block);
+	for (auto cached = block.cached.begin(); cached != block.cached.end(); ++cached)
 	{
-		std::cout << "    allocating new RenderGrid" << std::endl;
-		rgrid = renderBlocks.emplace(blockId, new RenderGrid).first;
+		if (cached->key == key)
+		{
+			block.current = cached->mesh;
+			block.key = key;
+			block.cached.erase(cached);
+			return nullptr;
+		}
 	}
-	aggregate->getNeighbours(grid->getGridPos(), neighbours);
-	// TODO: sliced update function
-	rgrid->second->update(glf, neighbours, options);
+	// miss; recycle the least recently used mesh once the cache is full
+	if ((int)block.cached.size() > MESH_CACHE_SIZE)
+	{
+		block.current = block.cached.back().mesh;
+		block.cached.pop_back();
+	}
+	else
+		block.current = new RenderGrid;
+	block.key = key;
+	return block.current;
+}
+
+void RenderAggregate::retireMesh(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block)
+{
+	if (!block.current)
+		return;
+	block.cached.insert(block.cached.begin(), CachedMesh{ block.key, block.current });
+	block.current = nullptr;
+	// keep one more than MESH_CACHE_SIZE, selectMesh() recycles it on a miss
+	if ((int)block.cached.size() > MESH_CACHE_SIZE + 1)
+	{
+		block.cached.back().mesh->cleanupGL(glf);
+		delete block.cached.back().mesh;
+		block.cached.pop_back();
+	}
+}
+
+uint64_t RenderAggregate::neighbourKey(const VoxelGrid* neighbours[27])
+{
+	// the mesh depends on the center grid and on neighbours for face culling and occlusion
+	uint64_t key = 0;
+	for (int i = 0; i < 27; ++i)
+	{
+		key = (key ^ (neighbours[i] ? neighbours[i]->contentId() : 0)) * 0x9E3779B97F4A7C15ull;
+		key ^= key >> 29;
+	}
+	return key;
+}
+
+void RenderAggregate::runJobs(QOpenGLFunctions_3_3_Core &glf, jobList_t &jobs)
+{
+	ThreadPool &pool = ThreadPool::global();
+	// one scratch buffer per worker, allocated by the worker on first use
+	static std::vector<std::unique_ptr<GlVoxelVertex_t[]>> scratch(pool.size());
+	const RenderOptions &opt = options;
+	pool.parallelFor(jobs.size(), [&jobs, &opt](int item, int worker)
+		{
+			if (!scratch[worker])
+				scratch[worker].reset(new GlVoxelVertex_t[RenderGrid::maxVertices()]);
+			TesselationJob &job = jobs[item];
+			job.renderGrid->tesselate(job.neighbours, opt, scratch[worker].get());
+		});
+	for (auto &job: jobs)
+		job.renderGrid->upload(glf);
+	// selectMesh() and retireMesh() change which meshes are current
+	drawListDirty = true;
 }
 
 void RenderAggregate::update(QOpenGLFunctions_3_3_Core &glf, const blockSet_t &dirtyBlocks)
@@ -343,25 +649,23 @@ void RenderAggregate::update(QOpenGLFunctions_3_3_Core &glf, const blockSet_t &d
 	if (options.mode == RenderOptions::MODE_SLICE)
 		updateFunc = &RenderAggregate::updateBlockSliced;
 
+	jobList_t jobs;
 	for (auto &blockId: dirtyBlocks)
 	{
 		const VoxelGrid* blockGrid = aggregate->getBlock(blockId);
 		if (blockGrid)
 		{
-			(this->*updateFunc)(glf, blockId, blockGrid);
+			(this->*updateFunc)(glf, blockId, blockGrid, jobs);
 		}
 		else
 		{
-			// does not exist (anymore)
-			renderBlockMap_t::iterator rgrid = renderBlocks.find(blockId);
-			if (rgrid != renderBlocks.end())
-			{
-				rgrid->second->cleanupGL(glf);
-				delete rgrid->second;
-				renderBlocks.erase(rgrid);
-			}
+			// does not exist (anymore), keep its meshes in case it comes back, e.g. with a shown layer
+			renderBlockMap_t::iterator rblock = renderBlocks.find(blockId);
+			if (rblock != renderBlocks.end())
+				detachBlock(glf, rblock->second, blockId);
 		}
 	}
+	runJobs(glf, jobs);
 }
 
 void RenderAggregate::rebuild(QOpenGLFunctions_3_3_Core &glf, const RenderOptions *opt)
@@ -374,24 +678,73 @@ void RenderAggregate::rebuild(QOpenGLFunctions_3_3_Core &glf, const RenderOption
 
 	clear(glf); // TODO: only delete RenderGrids for non-existing VoxelGrids
 	const blockMap_t &blocks = aggregate->getBlockMap();
-	for (auto block: blocks)
+	jobList_t jobs;
+	jobs.reserve(blocks.size());
+	for (auto &block: blocks)
 	{
-		(this->*updateFunc)(glf, block.first, block.second.get());
+		(this->*updateFunc)(glf, block.first, block.second.get(), jobs);
 	}
+	runJobs(glf, jobs);
+	int triangles, faceTriangles;
+	getTriangleCounts(triangles, faceTriangles);
+	std::cout << "tesselated " << triangles << " triangles (" << faceTriangles << " without face merging)\n";
 }
 
-void RenderAggregate::render(QOpenGLFunctions_3_3_Core &glf)
+void RenderAggregate::getTriangleCounts(int &triangles, int &faceTriangles) const
 {
+	triangles = faceTriangles = 0;
 	for (auto &block: renderBlocks)
 	{
-		block.second->render(glf);
+		if (!block.second.current)
+			continue;
+		triangles += block.second.current->triangleCount();
+		faceTriangles += block.second.current->faceTriangleCount();
 	}
 }
 
-void RenderAggregate::renderTransparent(QOpenGLFunctions_3_3_Core &glf)
+void RenderAggregate::updateDrawList()
 {
+	drawList.clear();
+	drawBounds.clear();
 	for (auto &block: renderBlocks)
 	{
-		block.second->renderTransparent(glf);
+		if (!block.second.current || block.second.current->triangleCount() == 0)
+			continue;
+		drawList.push_back(block.second.current);
+		drawBounds.add(block.second.bound);
+	}
+	drawVisible.resize(drawList.size());
+	drawListDirty = false;
+}
+
+void RenderAggregate::render(QOpenGLFunctions_3_3_Core &glf, const QMatrix4x4 &viewProj)
+{
+	if (drawListDirty)
+		updateDrawList();
+	for (auto &formatBatches: batches)
+	{
+		formatBatches[0].clear();
+		formatBatches[1].clear();
+	}
+	Frustum frustum(viewProj);
+	drawnBlocks = frustum.cullBoxes(drawBounds, drawVisible.data());
+	for (size_t i = 0; i < drawList.size(); ++i)
+	{
+		if (drawVisible[i])
+			drawList[i]->addToBatches(batches[drawList[i]->getFormat()]);
+	}
+	drawCalls = 0;
+	for (int format = RenderOptions::VERTEX_FULL; format <= RenderOptions::VERTEX_PULLED; ++format)
+		drawCalls += RenderGrid::drawBatch(glf, RenderOptions::VertexFormats(format), batches[format][0]);
+}
+
+void RenderAggregate::renderTransparent(QOpenGLFunctions_3_3_Core &glf)
+{
+	for (int format = RenderOptions::VERTEX_FULL; format <= RenderOptions::VERTEX_PULLED; ++format)
+		drawCalls += RenderGrid::drawBatch(glf, RenderOptions::VertexFormats(format), batches[format][1]);
+	if (drawCalls != reportedDrawCalls)
+	{
+		std::cout << "drawing " << drawnBlocks << " blocks with " << drawCalls << " draw calls per frame\n";
+		reportedDrawCalls = drawCalls;
 	}
 }
@@ -10,28 +10,105 @@
 #define VG_VOXELAGGREGATE_H
 
 #include "voxelgrid.h"
+#include "util/blockmap.h"
+#include <list>
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
 
-typedef std::shared_ptr<VoxelGrid> voxelGridPtr_t;
-typedef std::unordered_map<uint64_t, std::shared_ptr<VoxelGrid>> blockMap_t;
-typedef std::unordered_map<uint64_t, RenderGrid*> renderBlockMap_t;
+/*! Copy-on-write reference to a grid.
+	Grids get shared between aggregates by shallow copies. Only the aggregate whose generation
+	the handle carries may modify the grid in place, every other writer copies it first.
+	Ownership is decided by the generation alone instead of reference counts, so a shared grid
+	stays immutable while other threads read it (e.g. for tesselation or saving). */
+class GridHandle
+{
+	public:
+		GridHandle(): owner(0) {}
+		//! takes ownership of grid for the given generation
+		GridHandle(VoxelGrid *grid, uint64_t generation): grid(grid), owner(generation) {}
+		const VoxelGrid* get() const { return grid.get(); }
+		const VoxelGrid* operator->() const { return grid.get(); }
+		const VoxelGrid& operator*() const { return *grid; }
+		bool sameGrid(const GridHandle &other) const { return grid == other.grid; }
+		bool isOwnedBy(uint64_t generation) const { return owner == generation; }
+		//! the grid for modification, copied first unless it is owned by generation
+		VoxelGrid* writable(uint64_t generation)
+		{
+			if (owner != generation)
+			{
+				grid = std::make_shared<VoxelGrid>(*grid);
+				owner = generation;
+			}
+			return grid.get();
+		}
+		//! handle to the same grid without ownership
+		GridHandle share() const
+		{
+			GridHandle shared;
+			shared.grid = grid;
+			return shared;
+		}
+	protected:
+		std::shared_ptr<VoxelGrid> grid;
+		uint64_t owner;
+};
+
+typedef BlockMap<GridHandle> blockMap_t;
 
 typedef std::unique_ptr<GridMemento> gridMementoPtr_t;
 typedef std::unordered_map<uint64_t, gridMementoPtr_t> mementoMap_t;
 
 typedef std::unordered_set<uint64_t> blockSet_t;
 
+#define SUPERBLOCK_LEN 4 // in blocks, must be power of two
+#define LOG_SUPERBLOCK_LEN 2
+
 class AggregateMemento
 {
 	friend class VoxelAggregate;
-	mementoMap_t blockMap;
+	friend class UndoJournal;
+	public:
+		//! heap memory of the grid mementos in bytes
+		size_t memoryUsage() const
+		{
+			size_t bytes = 0;
+			for (auto &grid: blockMap)
+				bytes += grid.second->memoryUsage();
+			return bytes;
+		}
+		//! packs all grid mementos, see GridMemento::compress()
+		void compress()
+		{
+			for (auto &grid: blockMap)
+				grid.second->compress();
+			compressed = true;
+		}
+		/*! unpacks all grid mementos, so restoring cannot fail half way. Returns false if any
+			of them is corrupt, the memento must not be restored then */
+		bool decompress()
+		{
+			bool valid = true;
+			for (auto &grid: blockMap)
+				valid &= grid.second->decompress();
+			if (valid)
+				compressed = false;
+			return valid;
+		}
+		//! true after compress() until the next restore, even if some grids were incompressible
+		bool isCompressed() const { return compressed; }
+	protected:
+		mementoMap_t blockMap;
+		bool compressed = false;
 };
 
 class VoxelAggregate
 {
 	public:
+		VoxelAggregate(): generation(newGeneration()) {}
+		// copies would share the generation and modify each other's grids; use clone() or duplicate()
+		VoxelAggregate(const VoxelAggregate &other) = delete;
+		VoxelAggregate& operator=(const VoxelAggregate &other) = delete;
 		#define POS_MASK (0x1FFFFF * GRID_LEN)
 		#define POS_MIN   (0xFFFFF * GRID_LEN)
 		static inline uint64_t blockID(int64_t x, int64_t y, int64_t z)
@@ -47,30 +124,126 @@ class VoxelAggregate
 			pos[2] = int64_t((id >> (42 - LOG_GRID_LEN)) & POS_MASK) - POS_MIN;
 		}
 		#undef POS_MASK
+		//! setVoxel() and getVoxel() cache the last accessed block, they must not be called concurrently
 		uint64_t setVoxel(const IVector3D &pos, const VoxelEntry &voxel);
 		const VoxelEntry* getVoxel(const IVector3D &pos) const;
 		bool rayIntersect(const ray_t &ray, SceneRayHit &hit) const;
+		/*! intersects all rays of the packet, spread over the thread pool for large packets.
+			Unlike rayIntersect(), hits are marked with SceneRayHit::HIT_VOXEL, misses have no flags.
+			Returns the number of hits */
+		int rayIntersectBatch(const RayPacket &rays, SceneRayHit *hits) const;
 		void clear();
 		void clearBlocks(const std::unordered_set<uint64_t> &blocks);
-		void clearBlocks(const std::unordered_map<uint64_t, DirtyVolume> &blocks);
-		//! shallow copy
+		//! shallow copy; source loses ownership of its grids, so both sides copy grids before modifying them
 		void clone(const VoxelAggregate &source);
 		//! deep copy
 		VoxelAggregate* duplicate()  const;
 		void merge(const VoxelAggregate &topLayer);
-		void merge(const VoxelAggregate &topLayer, const std::unordered_map<uint64_t, DirtyVolume> &blocks);
+		/*! recalculates the voxels of vol from base with topLayer merged on top, like merge() does.
+			vol must not span blocks. Returns false if no voxel changed. */
+		bool composite(const VoxelAggregate &base, const VoxelAggregate &topLayer, uint64_t blockId,
+					   const DirtyVolume &vol);
 		void applyChanges(const VoxelAggregate &toolLayer, AggregateMemento *memento);
 
 		// the memento shall be altered to allow reversing the restore (i.e. "redo" operation)
 		void restoreState(AggregateMemento *memento, std::unordered_set<uint64_t> &changed);
 		int blockCount() { return blockMap.size(); }
+		//! memory of all grids in bytes, grids shared with other aggregates are counted in full
+		size_t memoryUsage() const;
 		const VoxelGrid* getBlock(uint64_t blockId) const;
+		//! the block for modification, created empty if it doesn't exist
+		VoxelGrid* writableBlock(uint64_t blockId);
+		//! makes grid the block blockId, taking ownership; the grid must be positioned at the block
+		void setBlock(uint64_t blockId, VoxelGrid *grid);
+		//! makes the block a shallow copy of the block in source, which must exist
+		void shareBlock(uint64_t blockId, const VoxelAggregate &source);
+		//! adds all positions within bound (world coordinates, pMax exclusive) where the grids differ to changed
+		static void diffVoxels(const VoxelGrid &grid1, const VoxelGrid &grid2, const IBBox &bound, DirtyVolume &changed);
 		const blockMap_t& getBlockMap() const { return blockMap; }
 		static void markDirtyBlocks(const DirtyVolume &vol, std::unordered_set<uint64_t> &blocks);
 		void getNeighbours(const IVector3D &gridPos, const VoxelGrid* neighbours[27]);
 		bool getBound(IBBox &bound) const;
+		/*! calls func(grid, clipBound) for every block overlapping bound (pMax exclusive), in z, y, x
+			block order with one lookup per block. grid is null for missing blocks, clipBound is the
+			part of bound within the block in world coordinates. */
+		template<class F> void forEachBlock(const IBBox &bound, F func) const;
 	protected:
+		//! all blockMap insertions and removals go through these to keep the ray traversal data valid
+		blockMap_t::iterator insertBlock(uint64_t id, const GridHandle &grid);
+		void eraseBlock(uint64_t id);
+		static uint64_t superBlockID(uint64_t blockId);
+		static uint64_t newGeneration();
+		//! makes all grids shared, called when handing out shallow copies
+		void revokeOwnership() const { generation = newGeneration(); }
+		//! bound of all superblocks, which the ray traversal works on
+		IBBox traversalBound(IVector3D &superMin, IVector3D &superMax) const;
+		bool traverse(const ray_t &ray, float tStart, const IVector3D &superMin, const IVector3D &superMax,
+					  SceneRayHit &hit) const;
 		blockMap_t blockMap;
+		//! grids whose handles carry this generation are exclusive to this aggregate
+		mutable uint64_t generation;
+		//! number of blocks within each SUPERBLOCK_LEN^3 region, the coarse level for ray traversal
+		std::unordered_map<uint64_t, int> superBlocks;
+		//! conservative bound of all blocks in block coordinates, only reset when emptied
+		IVector3D blockMin, blockMax;
+};
+
+template<class F>
+void VoxelAggregate::forEachBlock(const IBBox &bound, F func) const
+{
+	const int gridMask = ~(GRID_LEN - 1);
+	for (int z = bound.pMin.z & gridMask; z < bound.pMax.z; z += GRID_LEN)
+		for (int y = bound.pMin.y & gridMask; y < bound.pMax.y; y += GRID_LEN)
+			for (int x = bound.pMin.x & gridMask; x < bound.pMax.x; x += GRID_LEN)
+	{
+		IBBox clipBound(IVector3D(std::max(x, bound.pMin.x), std::max(y, bound.pMin.y), std::max(z, bound.pMin.z)),
+						IVector3D(std::min(x + GRID_LEN, bound.pMax.x), std::min(y + GRID_LEN, bound.pMax.y),
+								  std::min(z + GRID_LEN, bound.pMax.z)));
+		func(getBlock(blockID(x, y, z)), clipBound);
+	}
+}
+
+/*! Cached read access for walks through neighbouring positions, like searches and scans.
+	Remembers the block of the last access and resolves the 26 blocks around it lazily,
+	so only moving further than one block away needs new lookups.
+	The aggregate must not gain or lose blocks while the accessor is in use. */
+class AggregateAccessor
+{
+	public:
+		AggregateAccessor(const VoxelAggregate *ag): aggregate(ag), center(0, 0, 0), resolved(0) {}
+		const VoxelEntry* getVoxel(const IVector3D &pos)
+		{
+			const VoxelGrid *grid = getBlock(pos);
+			if (!grid)
+				return 0;
+			return grid->getVoxel(IVector3D(pos.x & (GRID_LEN - 1), pos.y & (GRID_LEN - 1), pos.z & (GRID_LEN - 1)));
+		}
+		//! the block containing pos, null if it doesn't exist
+		const VoxelGrid* getBlock(const IVector3D &pos)
+		{
+			IVector3D bPos(pos.x >> LOG_GRID_LEN, pos.y >> LOG_GRID_LEN, pos.z >> LOG_GRID_LEN);
+			int dx = bPos.x - center.x, dy = bPos.y - center.y, dz = bPos.z - center.z;
+			if (unsigned(dx + 1) > 2 || unsigned(dy + 1) > 2 || unsigned(dz + 1) > 2 || !resolved)
+			{
+				center = bPos;
+				resolved = 0;
+				dx = dy = dz = 0;
+			}
+			int index = (dx + 1) + (dy + 1) * 3 + (dz + 1) * 9;
+			if (!(resolved & (1u << index)))
+			{
+				blocks[index] = aggregate->getBlock(VoxelAggregate::blockID(pos.x, pos.y, pos.z));
+				resolved |= 1u << index;
+			}
+			return blocks[index];
+		}
+	protected:
+		const VoxelAggregate *aggregate;
+		//! block coordinates of the block in the middle of the neighbourhood
+		IVector3D center;
+		//! bit i is set if blocks[i] has been looked up
+		uint32_t resolved;
+		const VoxelGrid* blocks[27];
 };
 
 class RenderAggregate
@@ -80,15 +253,87 @@ class RenderAggregate
 		void clear(QOpenGLFunctions_3_3_Core &glf);
 		void update(QOpenGLFunctions_3_3_Core &glf, const blockSet_t &dirtyBlocks);
 		void rebuild(QOpenGLFunctions_3_3_Core &glf, const RenderOptions *opt);
-		void render(QOpenGLFunctions_3_3_Core &glf);
+		/*! draws the opaque geometry of all blocks inside the view frustum of viewProj, with one
+			draw call per vertex format and arena chunk */
+		void render(QOpenGLFunctions_3_3_Core &glf, const QMatrix4x4 &viewProj);
+		//! draws the transparent geometry of the blocks collected by the last render()
 		void renderTransparent(QOpenGLFunctions_3_3_Core &glf);
+		//! draw calls and drawn blocks of the last frame, culled blocks are not counted
+		int getDrawCalls() const { return drawCalls; }
+		int getDrawnBlocks() const { return drawnBlocks; }
 		void setAggregate(VoxelAggregate *va) { aggregate = va; }
+		//! sums up the triangle counts of all blocks, with and without face merging
+		void getTriangleCounts(int &triangles, int &faceTriangles) const;
+		//! number of meshes kept for previous states of each block
+		static const int MESH_CACHE_SIZE = 3;
+		//! arena bytes the meshes of blocks that left the aggregate may keep, see detachBlock()
+		static const size_t DETACHED_MESH_BUDGET = 64 << 20;
 	protected:
-		void updateBlock(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid);
-		void updateBlockSliced(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid);
+		struct TesselationJob
+		{
+			RenderGrid *renderGrid;
+			const VoxelGrid* neighbours[27];
+		};
+		typedef std::vector<TesselationJob> jobList_t;
+		struct CachedMesh
+		{
+			//! neighbourKey() of the grids the mesh was tesselated from
+			uint64_t key;
+			RenderGrid *mesh;
+		};
+		/*! The mesh currently drawn for a block, plus meshes of recent block states. Toggling layers
+			mostly flips blocks between states seen before, which then only need a different mesh drawn.
+			Blocks that leave the aggregate keep their cache while detached, see detachBlock() */
+		struct RenderBlock
+		{
+			RenderGrid *current = nullptr;
+			uint64_t key = 0;
+			//! VoxelGrid::getBound() of the block, for frustum culling
+			IBBox bound = IBBox(IVector3D(0, 0, 0), IVector3D(0, 0, 0));
+			//! most recently used first
+			std::vector<CachedMesh> cached;
+			bool detached = false;
+			//! arena bytes of the cached meshes and position in detachedBlocks, while detached
+			size_t detachedBytes = 0;
+			std::list<uint64_t>::iterator detachedPos;
+		};
+		typedef std::unordered_map<uint64_t, RenderBlock> renderBlockMap_t;
+		void updateBlock(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid, jobList_t &jobs);
+		void updateBlockSliced(QOpenGLFunctions_3_3_Core &glf, uint64_t blockId, const VoxelGrid* grid, jobList_t &jobs);
+		/*! makes the mesh for key current, from the cache if possible. Returns the mesh to tesselate
+			on a cache miss, otherwise nullptr */
+		RenderGrid* selectMesh(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block, uint64_t key);
+		//! moves the current mesh of block into its cache, so it no longer gets drawn
+		void retireMesh(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block);
+		//! deletes the current and cached meshes of block
+		void releaseMeshes(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block);
+		/*! keeps the meshes of a block that left the aggregate cached, so showing a hidden layer
+			again finds them. The least recently detached blocks get released once all detached
+			meshes take more than DETACHED_MESH_BUDGET */
+		void detachBlock(QOpenGLFunctions_3_3_Core &glf, RenderBlock &block, uint64_t blockId);
+		//! makes a block that returned to the aggregate count as live again
+		void reattachBlock(RenderBlock &block);
+		static uint64_t neighbourKey(const VoxelGrid* neighbours[27]);
+		//! tesselates on the thread pool, then uploads the meshes on the calling (render) thread
+		void runJobs(QOpenGLFunctions_3_3_Core &glf, jobList_t &jobs);
 		renderBlockMap_t renderBlocks;
+		//! IDs of detached blocks, most recently detached first
+		std::list<uint64_t> detachedBlocks;
+		size_t detachedBytes = 0;
 		VoxelAggregate *aggregate;
 		RenderOptions options;
+		//! collects the blocks with a mesh to draw and their bounds, when blocks changed
+		void updateDrawList();
+		//! meshes of all blocks that have triangles, drawBounds holds their bounds
+		std::vector<RenderGrid*> drawList;
+		BoundsPacket drawBounds;
+		std::vector<char> drawVisible;
+		bool drawListDirty = true;
+		//! opaque and transparent draw ranges for each RenderOptions::VertexFormats
+		RenderBatch batches[3][2];
+		int drawCalls = 0;
+		int drawnBlocks = 0;
+		int reportedDrawCalls = -1;
 };
 
 #endif // VG_VOXELAGGREGATE_H
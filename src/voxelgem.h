@@ -12,7 +12,12 @@
 #include <QVector3D>
 #include <cstdint>
 #include <cfloat>
+#include <cmath>
 #include <algorithm>
+#include <vector>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
 namespace Voxel
 {
@@ -139,6 +144,14 @@ class DirtyVolume
 				valid = true;
 			}
 		}
+		void join(const DirtyVolume &other)
+		{
+			if (other.valid)
+			{
+				addPosition(other.low);
+				addPosition(other.high);
+			}
+		}
 		IVector3D low;
 		IVector3D high;
 		bool valid = false;
@@ -152,6 +165,45 @@ struct ray_t
 	float t_max;
 };
 
+//! rays in SoA layout for batched intersection tests
+struct RayPacket
+{
+	void add(const ray_t &ray)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			dir[i].push_back(ray.dir[i]);
+			from[i].push_back(ray.from[i]);
+		}
+		t_min.push_back(ray.t_min);
+		t_max.push_back(ray.t_max);
+	}
+	ray_t getRay(int i) const
+	{
+		ray_t ray;
+		ray.dir = QVector3D(dir[0][i], dir[1][i], dir[2][i]);
+		ray.from = QVector3D(from[0][i], from[1][i], from[2][i]);
+		ray.t_min = t_min[i];
+		ray.t_max = t_max[i];
+		return ray;
+	}
+	int size() const { return t_min.size(); }
+	void clear()
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			dir[i].clear();
+			from[i].clear();
+		}
+		t_min.clear();
+		t_max.clear();
+	}
+	std::vector<float> dir[3];
+	std::vector<float> from[3];
+	std::vector<float> t_min;
+	std::vector<float> t_max;
+};
+
 
 class SceneRayHit
 {
@@ -214,6 +266,13 @@ class IBBox
 			float tMin = -FLT_MAX, tMax = FLT_MAX;
 			for (int i = 0; i < 3; ++i)
 			{
+				// parallel to the slab, 0 * inf would give NaN below
+				if (ray.dir[i] == 0.f)
+				{
+					if (ray.from[i] < pMin[i] || ray.from[i] > pMax[i])
+						return false;
+					continue;
+				}
 				int axisDirFlag = 0;
 				float invDir = 1.f / ray.dir[i];
 				float tNear = invDir * ((float)pMin[i] - ray.from[i]);
@@ -235,9 +294,154 @@ class IBBox
 			tHit = tMin;
 			return ray.t_max >= tMin && tMax >= ray.t_min;
 		}
+		/*! same test for all rays of the packet, four at a time with SSE2.
+			didHit[i] gets set to 1 or 0, tHit and entryAxis are only valid for hits.
+			Returns the number of hits */
+		int rayIntersect(const RayPacket &rays, float *tHit, int *entryAxis, char *didHit) const
+		{
+			const int count = rays.size();
+			int nHits = 0;
+			int i = 0;
+#ifdef __SSE2__
+			const __m128i negative = _mm_set1_epi32(SceneRayHit::AXIS_NEGATIVE);
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128 tMin = _mm_set1_ps(-FLT_MAX), tMax = _mm_set1_ps(FLT_MAX);
+				__m128 inSlabs = _mm_castsi128_ps(_mm_set1_epi32(-1));
+				__m128i axisFlags = _mm_setzero_si128();
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					__m128 from = _mm_loadu_ps(&rays.from[axis][i]);
+					__m128 dir = _mm_loadu_ps(&rays.dir[axis][i]);
+					__m128 slabMin = _mm_set1_ps((float)pMin[axis]), slabMax = _mm_set1_ps((float)pMax[axis]);
+					__m128 invDir = _mm_div_ps(_mm_set1_ps(1.f), dir);
+					__m128 t0 = _mm_mul_ps(invDir, _mm_sub_ps(slabMin, from));
+					__m128 t1 = _mm_mul_ps(invDir, _mm_sub_ps(slabMax, from));
+					/* like the scalar test, lanes parallel to the slab only need to start inside it;
+					   their interval becomes unbounded instead of the NaN that 0 * inf gives */
+					__m128 parallel = _mm_cmpeq_ps(dir, _mm_setzero_ps());
+					__m128 outside = _mm_or_ps(_mm_cmplt_ps(from, slabMin), _mm_cmpgt_ps(from, slabMax));
+					inSlabs = _mm_andnot_ps(_mm_and_ps(parallel, outside), inSlabs);
+					t0 = _mm_or_ps(_mm_and_ps(parallel, _mm_set1_ps(-FLT_MAX)), _mm_andnot_ps(parallel, t0));
+					t1 = _mm_or_ps(_mm_and_ps(parallel, _mm_set1_ps(FLT_MAX)), _mm_andnot_ps(parallel, t1));
+					__m128 swapped = _mm_cmpgt_ps(t0, t1);
+					__m128 tNear = _mm_min_ps(t0, t1);
+					__m128 tFar = _mm_max_ps(t0, t1);
+					__m128 closer = _mm_cmpgt_ps(tNear, tMin);
+					tMin = _mm_max_ps(tNear, tMin);
+					tMax = _mm_min_ps(tFar, tMax);
+					__m128i flags = _mm_or_si128(_mm_set1_epi32(axis), _mm_and_si128(_mm_castps_si128(swapped), negative));
+					axisFlags = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), flags),
+											 _mm_andnot_si128(_mm_castps_si128(closer), axisFlags));
+				}
+				__m128 valid = _mm_and_ps(_mm_and_ps(inSlabs, _mm_cmple_ps(tMin, tMax)),
+								_mm_and_ps(_mm_cmpge_ps(_mm_loadu_ps(&rays.t_max[i]), tMin),
+										   _mm_cmpge_ps(tMax, _mm_loadu_ps(&rays.t_min[i]))));
+				_mm_storeu_ps(tHit + i, tMin);
+				_mm_storeu_si128((__m128i*)(entryAxis + i), axisFlags);
+				int validBits = _mm_movemask_ps(valid);
+				for (int j = 0; j < 4; ++j)
+				{
+					didHit[i + j] = (validBits >> j) & 1;
+					nHits += didHit[i + j];
+				}
+			}
+#endif
+			for (; i < count; ++i)
+			{
+				didHit[i] = rayIntersect(rays.getRay(i), tHit[i], entryAxis[i]);
+				nHits += didHit[i];
+			}
+			return nHits;
+		}
 		IVector3D pMin, pMax;
 };
 
+//! boxes in structure-of-arrays layout, for testing four at a time like RayPacket
+struct BoundsPacket
+{
+	void add(const IBBox &box)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			pMin[i].push_back(box.pMin[i]);
+			pMax[i].push_back(box.pMax[i]);
+		}
+	}
+	int size() const { return pMin[0].size(); }
+	void clear()
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			pMin[i].clear();
+			pMax[i].clear();
+		}
+	}
+	std::vector<float> pMin[3];
+	std::vector<float> pMax[3];
+};
+
+/* Walks the cells of a uniform grid in ray order (3D-DDA), restricted to the cells [lo, hi].
+   Cell c spans [c * cellSize, (c + 1) * cellSize) in voxel coordinates. */
+class GridTraversal
+{
+	public:
+		GridTraversal(const ray_t &ray, float t, int cellSize, const IVector3D &lo, const IVector3D &hi, int flags = 0):
+			tEnter(t), entryFlags(flags)
+		{
+			QVector3D p = ray.from + t * ray.dir;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				// clamping takes care of float imprecision at cell borders
+				int c = (int)std::floor(p[axis] / cellSize);
+				cell[axis] = std::max(lo[axis], std::min(hi[axis], c));
+				if (ray.dir[axis] > 0)
+				{
+					step[axis] = 1;
+					out[axis] = hi[axis] + 1;
+					tNext[axis] = ((float)((cell[axis] + 1) * cellSize) - ray.from[axis]) / ray.dir[axis];
+					tDelta[axis] = cellSize / ray.dir[axis];
+				}
+				else if (ray.dir[axis] < 0)
+				{
+					step[axis] = -1;
+					out[axis] = lo[axis] - 1;
+					tNext[axis] = ((float)(cell[axis] * cellSize) - ray.from[axis]) / ray.dir[axis];
+					tDelta[axis] = -cellSize / ray.dir[axis];
+				}
+				else
+				{
+					step[axis] = 0;
+					out[axis] = lo[axis] - 1;
+					tNext[axis] = FLT_MAX;
+					tDelta[axis] = FLT_MAX;
+				}
+			}
+		}
+		//! advances to the next cell; returns false when leaving the cell range or passing tMax
+		bool next(float tMax)
+		{
+			int axis = tNext[0] < tNext[1] ?
+					 ( tNext[0] < tNext[2] ? 0 : 2) :
+					 ( tNext[1] < tNext[2] ? 1 : 2);
+			tEnter = tNext[axis];
+			cell[axis] += step[axis];
+			entryFlags = axis | (step[axis] < 0 ? SceneRayHit::AXIS_NEGATIVE : 0);
+			if (cell[axis] == out[axis] || tEnter > tMax)
+				return false;
+			tNext[axis] += tDelta[axis];
+			return true;
+		}
+		IVector3D cell;
+		//! ray parameter where the current cell was entered
+		float tEnter;
+		//! axis and direction (SceneRayHit::AXIS_MASK | AXIS_NEGATIVE) of the face the current cell was entered through
+		int entryFlags;
+	protected:
+		int step[3], out[3];
+		float tNext[3], tDelta[3];
+};
+
 
 class RenderOptions
 {
@@ -247,10 +451,20 @@ class RenderOptions
 			MODE_FULL,
 			MODE_SLICE
 		};
+		//! how voxel meshes get to the GPU, matches vertex_format of the voxel vertex shader
+		enum VertexFormats
+		{
+			VERTEX_FULL,	//!< GlVoxelVertex_t
+			VERTEX_PACKED,	//!< GlPackedVoxelVertex_t
+			VERTEX_PULLED	//!< GlVoxelFace_t, except greedy meshes which use VERTEX_PACKED
+		};
 
 		Modes mode = MODE_FULL;
 		int axis = 1;
 		int level = 0;
+		//! merge coplanar faces with identical attributes into larger quads
+		bool greedyMeshing = false;
+		VertexFormats vertexFormat = VERTEX_PACKED;
 };
 
 #endif // VG_VOXELGEM_H
@@ -9,8 +9,15 @@
 /* Implements a 16x16x16 voxel grid */
 
 #include "voxelgrid.h"
+#include "voxelkernels.h"
 #include "voxel_def.h"
+#include "util/lzcodec.h"
+#include <atomic>
 #include <cstring>
+#include <iostream>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
 #include <QOpenGLShaderProgram>
 
@@ -31,77 +38,101 @@ const int neighbor_offset[] = {
 
 VoxelGrid::VoxelGrid(const IVector3D &pos):
 	bound(pos, pos + IVector3D(GRID_LEN, GRID_LEN, GRID_LEN)),
-	voxels(GRID_LEN * GRID_LEN * GRID_LEN)
+	voxels(VoxelEntry())
 {
-	memset(voxels.data(), 0, voxels.capacity()); // TODO: should be redundant with current VoxelEntry() constructor...
+	memset(occupied, 0, sizeof(occupied));
+	memset(opaque, 0, sizeof(opaque));
+	memset(collidable, 0, sizeof(collidable));
+	brickMask = 0;
 }
 
 VoxelGrid::VoxelGrid(const VoxelGrid &other):
 	bound(other.bound), voxels(other.voxels)
 {
+	memcpy(occupied, other.occupied, sizeof(occupied));
+	memcpy(opaque, other.opaque, sizeof(opaque));
+	memcpy(collidable, other.collidable, sizeof(collidable));
+	brickMask = other.brickMask;
+	content = other.content;
 }
 
-VoxelGrid::VoxelGrid(const IVector3D &pos, GridMemento *memento):
-	bound(pos, pos + IVector3D(GRID_LEN, GRID_LEN, GRID_LEN))
+VoxelGrid::VoxelGrid(const VoxelGrid &other, const IVector3D &pos):
+	VoxelGrid(other)
 {
-	voxels.swap(memento->voxels);
+	bound = IBBox(pos, pos + IVector3D(GRID_LEN, GRID_LEN, GRID_LEN));
 }
 
 VoxelGrid::~VoxelGrid()
 {
 }
 
+void VoxelGrid::setVoxels(const VoxelEntry *dense)
+{
+	voxels.encode(dense);
+	updateRowMasks(dense);
+}
+
 bool VoxelGrid::rayIntersect(const ray_t &ray, SceneRayHit &hit) const
 {
+	if (!brickMask)
+		return false;
 	float rayT;
-	if (!bound.rayIntersect(ray, rayT, hit.flags))
+	int entryFlags;
+	if (!bound.rayIntersect(ray, rayT, entryFlags))
 		return false;
 	// for interior ray origin, bound intersection returns negative tMin
 	rayT = std::max(ray.t_min, rayT);
-	hit.rayT = rayT;
-	QVector3D gridIntersect = ray.from + rayT * ray.dir;
-	float nextVoxelT[3], deltaT[3];
 
-	int vPos[3], vOut[3], stepDir[3];
-	// TODO: handle ray cast from inside voxel, currently causes paint tool to replace that voxel
+	// fast reject: no collidable voxels within the bounding box of the ray segment inside the grid
+	float tExit = ray.t_max;
 	for (int axis = 0; axis < 3; ++axis)
 	{
-		vPos[axis] = posToVoxel(gridIntersect[axis], axis);
-		if(ray.dir[axis] >= 0)
-		{
-			nextVoxelT[axis] = rayT + (voxelEdge(vPos[axis] + 1, axis) - gridIntersect[axis]) / ray.dir[axis];
-			deltaT[axis] = 1.f / ray.dir[axis];
-			stepDir[axis] = 1;
-			vOut[axis] = GRID_LEN;
-		}
-		else
-		{
-			nextVoxelT[axis] = rayT + (voxelEdge(vPos[axis], axis) - gridIntersect[axis]) / ray.dir[axis];
-			deltaT[axis] = -1.f / ray.dir[axis];
-			stepDir[axis] = -1;
-			vOut[axis] = -1;
-		}
+		if (ray.dir[axis] == 0)
+			continue;
+		float t0 = (bound.pMin[axis] - ray.from[axis]) / ray.dir[axis];
+		float t1 = (bound.pMax[axis] - ray.from[axis]) / ray.dir[axis];
+		tExit = std::min(tExit, std::max(t0, t1));
+	}
+	QVector3D pEnter = ray.from + rayT * ray.dir, pExit = ray.from + tExit * ray.dir;
+	int brickLo[3], brickHi[3];
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		brickLo[axis] = posToVoxel(std::min(pEnter[axis], pExit[axis]), axis) >> LOG_BRICK_LEN;
+		brickHi[axis] = posToVoxel(std::max(pEnter[axis], pExit[axis]), axis) >> LOG_BRICK_LEN;
 	}
+	uint64_t rowBits = ((2u << brickHi[0]) - (1u << brickLo[0]));
+	uint64_t segmentMask = 0;
+	for (int bz = brickLo[2]; bz <= brickHi[2]; ++bz)
+		for (int by = brickLo[1]; by <= brickHi[1]; ++by)
+			segmentMask |= rowBits << (by * 4 + bz * 16);
+	if (!(brickMask & segmentMask))
+		return false;
 
-	while (true)
+	// traverse sub-bricks, and voxels only within bricks that have collidable voxels
+	const IVector3D &pMin = bound.pMin;
+	IVector3D bricksLo(pMin.x >> LOG_BRICK_LEN, pMin.y >> LOG_BRICK_LEN, pMin.z >> LOG_BRICK_LEN);
+	IVector3D bricksHi = bricksLo + IVector3D(GRID_LEN / BRICK_LEN - 1, GRID_LEN / BRICK_LEN - 1, GRID_LEN / BRICK_LEN - 1);
+	GridTraversal bricks(ray, rayT, BRICK_LEN, bricksLo, bricksHi, entryFlags);
+	do
 	{
-		const VoxelEntry &voxel = voxels[voxelIndex(vPos[0], vPos[1], vPos[2])];
-		if ((voxel.flags & (Voxel::VF_NON_EMPTY | Voxel::VF_NO_COLLISION)) == Voxel::VF_NON_EMPTY)
+		IVector3D brick(bricks.cell.x - bricksLo.x, bricks.cell.y - bricksLo.y, bricks.cell.z - bricksLo.z);
+		if (!(brickMask & (1ull << (brick.x + brick.y * 4 + brick.z * 16))))
+			continue;
+		IVector3D lo(bricks.cell.x * BRICK_LEN, bricks.cell.y * BRICK_LEN, bricks.cell.z * BRICK_LEN);
+		IVector3D hi = lo + IVector3D(BRICK_LEN - 1, BRICK_LEN - 1, BRICK_LEN - 1);
+		GridTraversal cells(ray, bricks.tEnter, 1, lo, hi, bricks.entryFlags);
+		do
 		{
-			hit.voxelPos = IVector3D(vPos) + bound.pMin;
-			return true;
-		}
-		// Step to net voxel, find axis:
-		int axis = nextVoxelT[0] < nextVoxelT[1] ?
-				 ( nextVoxelT[0] < nextVoxelT[2] ? 0 : 2) :
-				 ( nextVoxelT[1] < nextVoxelT[2] ? 1 : 2);
-		vPos[axis] += stepDir[axis];
-		hit.flags = axis | (stepDir[axis] < 0 ? SceneRayHit::AXIS_NEGATIVE : 0);
-		hit.rayT = nextVoxelT[axis];
-		if (vPos[axis] == vOut[axis] || hit.rayT > ray.t_max)
-			break;
-		nextVoxelT[axis] += deltaT[axis];
-	}
+			IVector3D vPos(cells.cell.x - pMin.x, cells.cell.y - pMin.y, cells.cell.z - pMin.z);
+			if (collidable[vPos.y + vPos.z * GRID_LEN] & (1 << vPos.x))
+			{
+				hit.voxelPos = cells.cell;
+				hit.rayT = cells.tEnter;
+				hit.flags = cells.entryFlags;
+				return true;
+			}
+		} while (cells.next(ray.t_max));
+	} while (bricks.next(ray.t_max));
 	return false;
 }
 
@@ -109,48 +140,235 @@ void VoxelGrid::merge(const VoxelGrid &topLayer, VoxelGrid *targetGrid)
 {
 	// TODO: combination modes/flags could be useful, maybe to use it in applyChanges()
 	VoxelGrid *target = targetGrid ? targetGrid : this;
-	for (int i = 0; i < GRID_LEN * GRID_LEN * GRID_LEN; ++i)
+	if (!topLayer.voxels.anyFlags(Voxel::VF_ERASED | Voxel::VF_NON_EMPTY))
+		return;
+	if (topLayer.voxels.isUniform())
 	{
-		const VoxelEntry &entry = topLayer.voxels[i];
-		if (entry.flags & Voxel::VF_ERASED)
-			target->voxels[i] = VoxelEntry();
-		else if(entry.flags & Voxel::VF_NON_EMPTY)
-		{
-			target->voxels[i] = entry;
-		}
+		const VoxelEntry &entry = topLayer.voxels[0];
+		target->voxels.fill(entry.flags & Voxel::VF_ERASED ? VoxelEntry() : entry);
+		target->updateRowMasks();
+		return;
 	}
+	DenseBlock dense, top;
+	target->voxels.decode(dense);
+	topLayer.voxels.decode(top);
+	VoxelKernels::merge(dense, top, dense);
+	target->voxels.encode(dense);
+	target->updateRowMasks(dense);
 }
 
 int VoxelGrid::applyChanges(const VoxelGrid &toolLayer, GridMemento *memento)
 {
-	int nVoxels = 0;
+	DenseBlock dense, tool, merged;
+	uint64_t changed[GRID_VOLUME / 64];
+	voxels.decode(dense);
+	toolLayer.voxels.decode(tool);
+	int nVoxels = VoxelKernels::merge(dense, tool, merged, changed);
 	if (memento)
-		memento->voxels = voxels;
-	for (int i = 0; i < GRID_LEN * GRID_LEN * GRID_LEN; ++i)
 	{
-		const VoxelEntry &entry = toolLayer.voxels[i];
-		if (entry.flags & Voxel::VF_ERASED)
-			voxels[i] = VoxelEntry();
-		else if(entry.flags & Voxel::VF_NON_EMPTY)
+		for (int word = 0; word < GRID_VOLUME / 64; ++word)
+			for (uint64_t bits = changed[word]; bits; bits &= bits - 1)
 		{
-			voxels[i] = entry;
-			// (doesn't work) clear VF_NO_COLLISION flag, currently only valid for tool and rendering layer
-			// voxels[i].flags &= ~Voxel::VF_NO_COLLISION;
+			int i = word * 64 + __builtin_ctzll(bits);
+			memento->addChange(i, dense[i]);
 		}
-		if (voxels[i].flags & Voxel::VF_NON_EMPTY)
-			++nVoxels;
+		memento->runs.shrink_to_fit();
+		memento->values.shrink_to_fit();
 	}
+	voxels.encode(merged);
+	updateRowMasks(merged);
 	return nVoxels;
 }
 
+void GridMemento::compress()
+{
+	if (isCompressed() || values.empty())
+		return;
+	// planar layout, so runs of equal colors or flags become long matches
+	std::vector<uint8_t> raw(runs.size() * sizeof(Run) + values.size() * sizeof(VoxelEntry));
+	uint8_t *pos = raw.data();
+	memcpy(pos, runs.data(), runs.size() * sizeof(Run));
+	pos += runs.size() * sizeof(Run);
+	for (auto &value: values)
+	{
+		memcpy(pos, &value.col.raw, sizeof(value.col.raw));
+		pos += sizeof(value.col.raw);
+	}
+	for (auto &value: values)
+	{
+		memcpy(pos, &value.flags, sizeof(value.flags));
+		pos += sizeof(value.flags);
+	}
+	LZCodec::compress(raw.data(), raw.size(), packed);
+	if (packed.size() >= raw.size())
+	{
+		// incompressible, not worth the unpacking
+		std::vector<uint8_t>().swap(packed);
+		return;
+	}
+	packed.shrink_to_fit();
+	nRuns = runs.size();
+	nValues = values.size();
+	std::vector<Run>().swap(runs);
+	std::vector<VoxelEntry>().swap(values);
+}
+
+bool GridMemento::decompress()
+{
+	if (!isCompressed())
+		return true;
+	std::vector<uint8_t> raw(nRuns * sizeof(Run) + nValues * sizeof(VoxelEntry));
+	if (!LZCodec::decompress(packed.data(), packed.size(), raw.data(), raw.size()))
+	{
+		std::cout << "(!) corrupt compressed memento!\n";
+		return false;
+	}
+	const uint8_t *pos = raw.data();
+	runs.resize(nRuns);
+	memcpy(runs.data(), pos, nRuns * sizeof(Run));
+	pos += nRuns * sizeof(Run);
+	values.resize(nValues);
+	for (auto &value: values)
+	{
+		memcpy(&value.col.raw, pos, sizeof(value.col.raw));
+		pos += sizeof(value.col.raw);
+	}
+	for (auto &value: values)
+	{
+		memcpy(&value.flags, pos, sizeof(value.flags));
+		pos += sizeof(value.flags);
+	}
+	std::vector<uint8_t>().swap(packed);
+	return true;
+}
+
 void VoxelGrid::saveState(GridMemento *memento) const
 {
-	memento->voxels = voxels;
+	memento->decompress();
+	auto value = memento->values.begin();
+	for (auto &run: memento->runs)
+		for (int i = run.start; i < run.start + run.length; ++i, ++value)
+			*value = voxels[i];
 }
 
 void VoxelGrid::restoreState(GridMemento *memento)
 {
-	voxels.swap(memento->voxels);
+	memento->decompress();
+	auto value = memento->values.begin();
+	// large changes are cheaper to swap on decoded voxels than through the palette one by one
+	if (memento->values.size() > GRID_VOLUME / 16)
+	{
+		DenseBlock dense;
+		voxels.decode(dense);
+		for (auto &run: memento->runs)
+			for (int i = run.start; i < run.start + run.length; ++i, ++value)
+		{
+			VoxelEntry current = dense[i];
+			dense.set(i, *value);
+			*value = current;
+		}
+		voxels.encode(dense);
+		updateRowMasks(dense);
+		return;
+	}
+	for (auto &run: memento->runs)
+		for (int i = run.start; i < run.start + run.length; ++i, ++value)
+	{
+		VoxelEntry current = voxels[i];
+		voxels.set(i, *value);
+		setRowBits(i >> LOG_GRID_LEN, 1 << (i & (GRID_LEN - 1)), *value);
+		*value = current;
+	}
+	content = 0;
+}
+
+uint64_t VoxelGrid::brickBit(int row, rowMask_t bit)
+{
+	int x = __builtin_ctz(bit), y = row & (GRID_LEN - 1), z = row >> LOG_GRID_LEN;
+	return 1ull << ((x >> LOG_BRICK_LEN) + (y >> LOG_BRICK_LEN) * 4 + (z >> LOG_BRICK_LEN) * 16);
+}
+
+void VoxelGrid::updateBrick(int row, rowMask_t bit)
+{
+	int y0 = row & (GRID_LEN - 1) & ~(BRICK_LEN - 1);
+	int z0 = (row >> LOG_GRID_LEN) & ~(BRICK_LEN - 1);
+	rowMask_t brickRow = ((1u << BRICK_LEN) - 1) << (__builtin_ctz(bit) & ~(BRICK_LEN - 1));
+	uint64_t brick = brickBit(row, bit);
+	for (int z = z0; z < z0 + BRICK_LEN; ++z)
+		for (int y = y0; y < y0 + BRICK_LEN; ++y)
+	{
+		if (collidable[y + z * GRID_LEN] & brickRow)
+		{
+			brickMask |= brick;
+			return;
+		}
+	}
+	brickMask &= ~brick;
+}
+
+uint64_t VoxelGrid::newContentId()
+{
+	// the top bit is left for derived IDs from setContentId()
+	static std::atomic<uint64_t> counter(0);
+	return ++counter;
+}
+
+template<class F>
+void VoxelGrid::rowMasksFromFlags(F flagsAt)
+{
+	// all bulk modifications of the voxels end up here
+	content = 0;
+	if (voxels.isUniform())
+	{
+		const VoxelEntry &entry = voxels[0];
+		bool nonEmpty = entry.flags & Voxel::VF_NON_EMPTY;
+		bool collide = nonEmpty && !(entry.flags & Voxel::VF_NO_COLLISION);
+		rowMask_t full = (1u << GRID_LEN) - 1;
+		std::fill(occupied, occupied + GRID_LEN * GRID_LEN, nonEmpty ? full : 0);
+		std::fill(opaque, opaque + GRID_LEN * GRID_LEN, nonEmpty && !entry.isTransparent() ? full : 0);
+		std::fill(collidable, collidable + GRID_LEN * GRID_LEN, collide ? full : 0);
+		brickMask = collide ? ~0ull : 0;
+		return;
+	}
+	brickMask = 0;
+	for (int row = 0, index = 0; row < GRID_LEN * GRID_LEN; ++row)
+	{
+		rowMask_t occ = 0, opq = 0, col = 0;
+		for (int x = 0; x < GRID_LEN; ++x, ++index)
+		{
+			unsigned int flags = flagsAt(index);
+			if (flags & Voxel::VF_NON_EMPTY)
+			{
+				occ |= 1 << x;
+				if (!VoxelEntry(0, flags).isTransparent())
+					opq |= 1 << x;
+				if (!(flags & Voxel::VF_NO_COLLISION))
+					col |= 1 << x;
+			}
+		}
+		occupied[row] = occ;
+		opaque[row] = opq;
+		collidable[row] = col;
+		// one bit per BRICK_LEN voxels of the row
+		for (int bx = 0; bx < GRID_LEN / BRICK_LEN; ++bx)
+		{
+			if (col & (((1u << BRICK_LEN) - 1) << (bx * BRICK_LEN)))
+				brickMask |= brickBit(row, 1 << (bx * BRICK_LEN));
+		}
+	}
+}
+
+void VoxelGrid::updateRowMasks(const VoxelEntry *dense)
+{
+	if (dense)
+		rowMasksFromFlags([dense](int index) { return dense[index].flags; });
+	else
+		rowMasksFromFlags([this](int index) { return voxels[index].flags; });
+}
+
+void VoxelGrid::updateRowMasks(const VoxelBlockSoA &dense)
+{
+	rowMasksFromFlags([&dense](int index) { return (unsigned int)dense.flags[index]; });
 }
 
 static void getOcclusionValues(int face, int mask, uint8_t occ[4])
@@ -187,7 +405,72 @@ static inline int getNormalMapIndex(int face, int mask)
 	return index;
 }
 
-inline int VoxelGrid::writeFaces(const VoxelEntry &entry, uint8_t matIndex, int mask, IVector3D pos, GlVoxelVertex_t *vertices) const
+// vertex writers for both vertex formats, pos is relative to the grid origin gridPos
+static inline void setVertex(GlVoxelVertex_t &vertex, const IVector3D &gridPos, const int pos[3], rgba_t col,
+							 int index, int matIndex, int texIndex, int occlusion)
+{
+	vertex.pos[0] = gridPos[0] + float(pos[0]);
+	vertex.pos[1] = gridPos[1] + float(pos[1]);
+	vertex.pos[2] = gridPos[2] + float(pos[2]);
+	vertex.col[0] = col.r;
+	vertex.col[1] = col.g;
+	vertex.col[2] = col.b;
+	vertex.col[3] = col.a;
+	vertex.index = index;
+	vertex.matIndex = matIndex;
+	vertex.texIndex = texIndex;
+	vertex.occlusion = occlusion;
+}
+
+static inline void setVertex(GlPackedVoxelVertex_t &vertex, const IVector3D &, const int pos[3], rgba_t col,
+							 int index, int matIndex, int texIndex, int occlusion)
+{
+	typedef GlPackedVoxelVertex_t PV;
+	vertex.col[0] = col.r;
+	vertex.col[1] = col.g;
+	vertex.col[2] = col.b;
+	vertex.col[3] = col.a;
+	vertex.attributes = uint32_t(pos[0]) | uint32_t(pos[1]) << PV::POS_BITS | uint32_t(pos[2]) << (2 * PV::POS_BITS) |
+						uint32_t(index) << PV::INDEX_SHIFT | uint32_t(matIndex) << PV::MAT_SHIFT |
+						uint32_t(texIndex) << PV::TEX_SHIFT | uint32_t(occlusion) << PV::OCCLUSION_SHIFT;
+}
+
+//! writes the four corners of the face of the voxel at pos
+template<class V>
+static inline void writeQuad(V *quad, const IVector3D &gridPos, const IVector3D &pos, int face, rgba_t col,
+							 int matIndex, int texIndex, const uint8_t occlusion[4])
+{
+	for (int i=0; i < 4; ++i)
+	{
+		const int *vpos = VERTEX_POSITIONS[FACE_VERTICES[face][i]];
+		const int vertexPos[3] = { pos[0] + vpos[0], pos[1] + vpos[1], pos[2] + vpos[2] };
+		setVertex(quad[i], gridPos, vertexPos, col, 4*face + i, matIndex, texIndex, occlusion[i]);
+	}
+}
+
+//! face records leave the corners to the vertex shader
+static inline void writeQuad(GlVoxelFace_t *quad, const IVector3D &, const IVector3D &pos, int face, rgba_t col,
+							 int matIndex, int texIndex, const uint8_t occlusion[4])
+{
+	typedef GlVoxelFace_t VF;
+	quad->col[0] = col.r;
+	quad->col[1] = col.g;
+	quad->col[2] = col.b;
+	quad->col[3] = col.a;
+	quad->attributes = uint32_t(pos[0]) | uint32_t(pos[1]) << VF::POS_BITS | uint32_t(pos[2]) << (2 * VF::POS_BITS) |
+					   uint32_t(face) << VF::FACE_SHIFT | uint32_t(matIndex) << VF::MAT_SHIFT |
+					   uint32_t(texIndex) << VF::TEX_SHIFT;
+	for (int i = 0; i < 4; ++i)
+		quad->attributes |= uint32_t(occlusion[i]) << (VF::OCCLUSION_SHIFT + 2 * i);
+}
+
+//! where the mesh continues after nTris triangles; vertex formats use 4 vertices per 2 triangles
+template<class V>
+static inline V* meshOffset(V *mesh, int nTris) { return mesh + 2 * nTris; }
+static inline GlVoxelFace_t* meshOffset(GlVoxelFace_t *mesh, int nTris) { return mesh + nTris / 2; }
+
+template<class V>
+inline int VoxelGrid::writeFaces(const VoxelEntry &entry, uint8_t matIndex, int mask, IVector3D pos, V *vertices) const
 {
 	int nTriangles = 0;
 	for (int face=0; face < 6; ++face)
@@ -197,33 +480,22 @@ inline int VoxelGrid::writeFaces(const VoxelEntry &entry, uint8_t matIndex, int
 
 		uint8_t occlusion[4] = {};
 		getOcclusionValues(face, mask, occlusion);
-		for (int i=0; i < 4; ++i)
-		{
-			int v = 2 * nTriangles + i;
-			GlVoxelVertex_t &vertex = vertices[v];
-			const int *vpos = VERTEX_POSITIONS[FACE_VERTICES[face][i]];
-			vertex.pos[0] = bound.pMin[0] + float(pos[0] + vpos[0]);
-			vertex.pos[1] = bound.pMin[1] + float(pos[1] + vpos[1]);
-			vertex.pos[2] = bound.pMin[2] + float(pos[2] + vpos[2]);
-			vertex.col[0] = entry.col.r;
-			vertex.col[1] = entry.col.g;
-			vertex.col[2] = entry.col.b;
-			vertex.col[3] = entry.col.a;
-			vertex.index = 4*face + i;
-			vertex.matIndex = matIndex;
-			vertex.texIndex = matIndex == 8 ? 0 : getNormalMapIndex(face, mask);
-			vertex.occlusion = occlusion[i];
-		}
+		int texIndex = matIndex == 8 ? 0 : getNormalMapIndex(face, mask);
+		writeQuad(meshOffset(vertices, nTriangles), bound.pMin, pos, face, entry.col, matIndex, texIndex, occlusion);
 		nTriangles += 2;
 	}
 	return nTriangles;
 }
 
-void VoxelGrid::tesselate(GlVoxelVertex_t *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27]) const
+template<class V>
+void VoxelGrid::tesselate(V *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27]) const
 {
 	nTris[0] = nTris[1] = 0;
+	if (voxels.isUniform() && !(voxels[0].flags & Voxel::VF_NON_EMPTY))
+		return;
 	bool haveTransparent = false;
-	std::vector<int> masks = getNeighbourMasks(neighbourGrids);
+	int masks[GRID_VOLUME];
+	getNeighbourMasks(neighbourGrids, masks);
 
 	for (int z = 0, index = 0; z < GRID_LEN; ++z)
 		for (int y = 0; y < GRID_LEN; ++y)
@@ -240,13 +512,13 @@ void VoxelGrid::tesselate(GlVoxelVertex_t *vertices, int nTris[2], const VoxelGr
 		uint8_t matIndex = entry.getMaterialIndex();
 
 		IVector3D pos(x, y, z);
-		nTris[0] += writeFaces(entry, matIndex, masks[index], pos, vertices + 2 * nTris[0]);
+		nTris[0] += writeFaces(entry, matIndex, masks[index], pos, meshOffset(vertices, nTris[0]));
 	}
 	// TODO: tesselating in two passes is probably not the fastest
 	if (!haveTransparent)
 		return;
 
-	vertices += 2 * nTris[0];
+	vertices = meshOffset(vertices, nTris[0]);
 	for (int z = 0, index = 0; z < GRID_LEN; ++z)
 		for (int y = 0; y < GRID_LEN; ++y)
 			for (int x = 0; x < GRID_LEN; ++x, ++index)
@@ -257,11 +529,123 @@ void VoxelGrid::tesselate(GlVoxelVertex_t *vertices, int nTris[2], const VoxelGr
 
 		uint8_t matIndex = entry.getMaterialIndex();
 		IVector3D pos(x, y, z);
-		nTris[1] += writeFaces(entry, matIndex, masks[index], pos, vertices + 2 * nTris[1]);
+		nTris[1] += writeFaces(entry, matIndex, masks[index], pos, meshOffset(vertices, nTris[1]));
 	}
 }
 
-void VoxelGrid::tesselateSlice(GlVoxelVertex_t *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27],
+// packed face attributes for greedy meshing; faces only merge when their keys are identical
+enum GreedyKeyBits
+{
+	GK_VALID = 1ull << 63,
+	GK_MERGEABLE = 1ull << 62
+};
+
+static inline uint64_t greedyFaceKey(const VoxelEntry &entry, uint8_t matIndex, uint8_t texIndex, const uint8_t occ[4])
+{
+	uint64_t key = GK_VALID | entry.col.raw | uint64_t(matIndex) << 32 | uint64_t(texIndex) << 36;
+	for (int i = 0; i < 4; ++i)
+		key |= uint64_t(occ[i]) << (40 + 2 * i);
+	// Stretching the normal map over merged faces is only correct when the merge direction has no
+	// bevelled edges, which equal edge masks guarantee, except for tiled glass which always bevels.
+	// Differing occlusion values would also be interpolated over the whole quad.
+	if (matIndex != 8 && occ[0] == occ[1] && occ[0] == occ[2] && occ[0] == occ[3])
+		key |= GK_MERGEABLE;
+	return key;
+}
+
+template<class V>
+int VoxelGrid::writeGreedyFaces(const int *masks, bool transparent, V *vertices, int &nFaceTris) const
+{
+	int nTriangles = 0;
+	uint64_t keys[GRID_LEN][GRID_LEN];
+	for (int face = 0; face < 6; ++face)
+	{
+		const int axis = face >> 1, uAxis = (axis + 1) % 3, vAxis = (axis + 2) % 3;
+		for (int layer = 0; layer < GRID_LEN; ++layer)
+		{
+			// collect visible faces of this layer
+			bool haveFaces = false;
+			IVector3D pos;
+			pos[axis] = layer;
+			for (int v = 0; v < GRID_LEN; ++v)
+				for (int u = 0; u < GRID_LEN; ++u)
+			{
+				pos[uAxis] = u;
+				pos[vAxis] = v;
+				int index = voxelIndex(pos.x, pos.y, pos.z);
+				const VoxelEntry &entry = voxels[index];
+				keys[v][u] = 0;
+				if (!(entry.flags & Voxel::VF_NON_EMPTY) || entry.isTransparent() != transparent)
+					continue;
+				int mask = masks[index];
+				if (mask & FACE_NEIGHBOUR_FLAGS[face])
+					continue;
+				uint8_t occlusion[4] = {};
+				getOcclusionValues(face, mask, occlusion);
+				uint8_t matIndex = entry.getMaterialIndex();
+				uint8_t texIndex = matIndex == 8 ? 0 : getNormalMapIndex(face, mask);
+				keys[v][u] = greedyFaceKey(entry, matIndex, texIndex, occlusion);
+				haveFaces = true;
+				nFaceTris += 2;
+			}
+			if (!haveFaces)
+				continue;
+			// merge faces into rectangles, first along u, then extend along v
+			for (int v = 0; v < GRID_LEN; ++v)
+				for (int u = 0; u < GRID_LEN; ++u)
+			{
+				uint64_t key = keys[v][u];
+				if (!key)
+					continue;
+				int width = 1, height = 1;
+				if (key & GK_MERGEABLE)
+				{
+					while (u + width < GRID_LEN && keys[v][u + width] == key)
+						++width;
+					for (; v + height < GRID_LEN; ++height)
+					{
+						int i = 0;
+						while (i < width && keys[v + height][u + i] == key)
+							++i;
+						if (i < width)
+							break;
+					}
+				}
+				for (int j = 0; j < height; ++j)
+					for (int i = 0; i < width; ++i)
+						keys[v + j][u + i] = 0;
+
+				rgba_t col(uint32_t(key & 0xFFFFFFFF));
+				for (int i = 0; i < 4; ++i)
+				{
+					const int *vpos = VERTEX_POSITIONS[FACE_VERTICES[face][i]];
+					int vertexPos[3];
+					vertexPos[axis] = layer + vpos[axis];
+					vertexPos[uAxis] = u + vpos[uAxis] * width;
+					vertexPos[vAxis] = v + vpos[vAxis] * height;
+					setVertex(vertices[2 * nTriangles + i], bound.pMin, vertexPos, col, 4*face + i, (key >> 32) & 0xF,
+							  (key >> 36) & 0xF, (key >> (40 + 2 * i)) & 0x3);
+				}
+				nTriangles += 2;
+			}
+		}
+	}
+	return nTriangles;
+}
+
+template<class V>
+int VoxelGrid::tesselateGreedy(V *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27]) const
+{
+	int nFaceTris = 0;
+	int masks[GRID_VOLUME];
+	getNeighbourMasks(neighbourGrids, masks);
+	nTris[0] = writeGreedyFaces(masks, false, vertices, nFaceTris);
+	nTris[1] = writeGreedyFaces(masks, true, vertices + 2 * nTris[0], nFaceTris);
+	return nFaceTris;
+}
+
+template<class V>
+void VoxelGrid::tesselateSlice(V *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27],
 								int axis, int level) const
 {
 	static const int slice_mask[3] =
@@ -284,7 +668,8 @@ void VoxelGrid::tesselateSlice(GlVoxelVertex_t *vertices, int nTris[2], const Vo
 	}
 	bool haveTransparent = false;
 	// TODO: we don't need to compute all neighbour masks
-	std::vector<int> masks = getNeighbourMasks(neighbourGrids);
+	int masks[GRID_VOLUME];
+	getNeighbourMasks(neighbourGrids, masks);
 
 	for (int sy = 0; sy < GRID_LEN; ++sy)
 		for (int sx = 0; sx < GRID_LEN; ++sx)
@@ -303,13 +688,13 @@ void VoxelGrid::tesselateSlice(GlVoxelVertex_t *vertices, int nTris[2], const Vo
 			continue;
 		}
 		uint8_t matIndex = entry.getMaterialIndex();
-		nTris[0] += writeFaces(entry, matIndex, masks[index]&slice_mask[axis], pos, vertices + 2 * nTris[0]);
+		nTris[0] += writeFaces(entry, matIndex, masks[index]&slice_mask[axis], pos, meshOffset(vertices, nTris[0]));
 	}
 	// TODO: tesselating in two passes is probably not the fastest
 	if (!haveTransparent)
 		return;
 
-	vertices += 2 * nTris[0];
+	vertices = meshOffset(vertices, nTris[0]);
 	for (int sy = 0; sy < GRID_LEN; ++sy)
 		for (int sx = 0; sx < GRID_LEN; ++sx)
 	{
@@ -322,68 +707,162 @@ void VoxelGrid::tesselateSlice(GlVoxelVertex_t *vertices, int nTris[2], const Vo
 		if (!(entry.flags & Voxel::VF_NON_EMPTY) || !entry.isTransparent())
 			continue;
 		uint8_t matIndex = entry.getMaterialIndex();
-		nTris[1] += writeFaces(entry, matIndex, masks[index]&slice_mask[axis], pos, vertices + 2 * nTris[1]);
+		nTris[1] += writeFaces(entry, matIndex, masks[index]&slice_mask[axis], pos, meshOffset(vertices, nTris[1]));
+	}
+}
+
+template void VoxelGrid::tesselate(GlVoxelVertex_t*, int[2], const VoxelGrid*[27]) const;
+template void VoxelGrid::tesselate(GlPackedVoxelVertex_t*, int[2], const VoxelGrid*[27]) const;
+template void VoxelGrid::tesselate(GlVoxelFace_t*, int[2], const VoxelGrid*[27]) const;
+template int VoxelGrid::tesselateGreedy(GlVoxelVertex_t*, int[2], const VoxelGrid*[27]) const;
+template int VoxelGrid::tesselateGreedy(GlPackedVoxelVertex_t*, int[2], const VoxelGrid*[27]) const;
+template void VoxelGrid::tesselateSlice(GlVoxelVertex_t*, int[2], const VoxelGrid*[27], int, int) const;
+template void VoxelGrid::tesselateSlice(GlPackedVoxelVertex_t*, int[2], const VoxelGrid*[27], int, int) const;
+template void VoxelGrid::tesselateSlice(GlVoxelFace_t*, int[2], const VoxelGrid*[27], int, int) const;
+
+/* Gathers bit x of all 27 planes into masks[x], i.e. a 27xGRID_LEN bit matrix transposition.
+   planes[i] has bit x set if the face of voxel x towards neighbour i is hidden. */
+static inline void transposeRow(const uint32_t planes[27], int *masks)
+{
+#if defined(__SSE2__) && GRID_LEN == 16
+	const __m128i sel0 = _mm_set_epi32(8, 4, 2, 1);
+	const __m128i sel1 = _mm_slli_epi32(sel0, 4);
+	const __m128i sel2 = _mm_slli_epi32(sel0, 8);
+	const __m128i sel3 = _mm_slli_epi32(sel0, 12);
+	__m128i acc0 = _mm_setzero_si128(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+	// shift in the bits starting with the highest; cmpeq yields -1 for set bits
+	for (int i = 26; i >= 0; --i)
+	{
+		__m128i p = _mm_set1_epi32(planes[i]);
+		acc0 = _mm_sub_epi32(_mm_slli_epi32(acc0, 1), _mm_cmpeq_epi32(_mm_and_si128(p, sel0), sel0));
+		acc1 = _mm_sub_epi32(_mm_slli_epi32(acc1, 1), _mm_cmpeq_epi32(_mm_and_si128(p, sel1), sel1));
+		acc2 = _mm_sub_epi32(_mm_slli_epi32(acc2, 1), _mm_cmpeq_epi32(_mm_and_si128(p, sel2), sel2));
+		acc3 = _mm_sub_epi32(_mm_slli_epi32(acc3, 1), _mm_cmpeq_epi32(_mm_and_si128(p, sel3), sel3));
 	}
+	_mm_storeu_si128((__m128i*)masks, acc0);
+	_mm_storeu_si128((__m128i*)(masks + 4), acc1);
+	_mm_storeu_si128((__m128i*)(masks + 8), acc2);
+	_mm_storeu_si128((__m128i*)(masks + 12), acc3);
+#else
+	for (int x = 0; x < GRID_LEN; ++x)
+	{
+		int mask = 0;
+		for (int i = 0; i < 27; ++i)
+			mask |= ((planes[i] >> x) & 1) << i;
+		masks[x] = mask;
+	}
+#endif
 }
 
-static inline bool isFaceHidden(const VoxelEntry &vox, const VoxelEntry &neighbour)
+//! joins rows of three grids along x into padded rows with x = -1 at bit 0
+static inline void padRows(const rowMask_t *left, const rowMask_t *center, const rowMask_t *right,
+						   uint32_t *padded, int count)
 {
-	return (neighbour.flags & Voxel::VF_NON_EMPTY) &&
-			(vox.isTransparent() || !neighbour.isTransparent());
+	int i = 0;
+#if defined(__SSE2__) && GRID_LEN == 16
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i l = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(left + i)), GRID_LEN - 1);
+		__m128i c = _mm_loadu_si128((const __m128i*)(center + i));
+		__m128i r = _mm_and_si128(_mm_loadu_si128((const __m128i*)(right + i)), one);
+		__m128i lo = _mm_or_si128(_mm_or_si128(_mm_unpacklo_epi16(l, zero), _mm_slli_epi32(_mm_unpacklo_epi16(c, zero), 1)),
+								  _mm_slli_epi32(_mm_unpacklo_epi16(r, zero), GRID_LEN + 1));
+		__m128i hi = _mm_or_si128(_mm_or_si128(_mm_unpackhi_epi16(l, zero), _mm_slli_epi32(_mm_unpackhi_epi16(c, zero), 1)),
+								  _mm_slli_epi32(_mm_unpackhi_epi16(r, zero), GRID_LEN + 1));
+		_mm_storeu_si128((__m128i*)(padded + i), lo);
+		_mm_storeu_si128((__m128i*)(padded + i + 4), hi);
+	}
+#endif
+	for (; i < count; ++i)
+		padded[i] = left[i] >> (GRID_LEN - 1) | uint32_t(center[i]) << 1 | uint32_t(right[i] & 1) << (GRID_LEN + 1);
 }
 
-std::vector<int> VoxelGrid::getNeighbourMasks(const VoxelGrid* neighbourGrids[27]) const
+//! true if gathering bits per voxel is cheaper than transposing the whole row
+static inline bool sparseRow(rowMask_t row)
 {
-	std::vector<int> masks(GRID_LEN * GRID_LEN * GRID_LEN);
+	return __builtin_popcount(row) < GRID_LEN / 2;
+}
+
+/* A face is hidden if the neighbour is non-empty and either the voxel itself is transparent
+   or the neighbour is opaque. Works on the row masks, padded by one voxel from the
+   neighbour grids on each side. */
+void VoxelGrid::getNeighbourMasks(const VoxelGrid* neighbourGrids[27], int *masks) const
+{
+	const int PAD_LEN = GRID_LEN + 2;
+	// bit 0 is x = -1, index 0 is y/z = -1
+	uint32_t padOccupied[PAD_LEN][PAD_LEN];
+	uint32_t padOpaque[PAD_LEN][PAD_LEN];
+	static const VoxelGrid *emptyGrid = new VoxelGrid(IVector3D(0, 0, 0));
+	for (int pz = 0; pz < PAD_LEN; ++pz)
+	{
+		int bz = (pz - 1 + GRID_LEN) >> LOG_GRID_LEN;
+		int rowZ = ((pz - 1) & (GRID_LEN - 1)) * GRID_LEN;
+		for (int by = 0; by < 3; ++by)
+		{
+			// missing grids are replaced by an empty one to keep the inner loop branch free
+			const VoxelGrid *grids[3];
+			for (int bx = 0; bx < 3; ++bx)
+			{
+				grids[bx] = neighbourGrids[bx + 3 * by + 9 * bz];
+				if (!grids[bx])
+					grids[bx] = emptyGrid;
+			}
+			// only the last row of the lower and first row of the upper grids
+			int yBegin = by == 0 ? GRID_LEN - 1 : 0;
+			int count = by == 1 ? GRID_LEN : 1;
+			int py = by == 0 ? 0 : (by == 1 ? 1 : GRID_LEN + 1);
+			int row = yBegin + rowZ;
+			padRows(grids[0]->occupied + row, grids[1]->occupied + row, grids[2]->occupied + row,
+					&padOccupied[pz][py], count);
+			padRows(grids[0]->opaque + row, grids[1]->opaque + row, grids[2]->opaque + row,
+					&padOpaque[pz][py], count);
+		}
+	}
+
 	for (int z = 0; z < GRID_LEN; ++z)
 		for (int y = 0; y < GRID_LEN; ++y)
-			for (int x = 0; x < GRID_LEN; ++x)
 	{
-		int index = voxelIndex(x, y, z);
-		const VoxelEntry &vox = voxels[index];
-		if (!(vox.flags & Voxel::VF_NON_EMPTY))
+		int row = y + z * GRID_LEN;
+		if (!occupied[row])
 			continue;
-
-		int mask = 0;
-		if (x == 0 || x ==  GRID_LEN - 1 || y == 0 || y == GRID_LEN - 1 || z == 0 || z == GRID_LEN - 1)
-		{	// touching neighbour grids
-			for (int nz = -1, i = 0; nz < 2; ++nz)
-				for (int ny = -1; ny < 2; ++ny)
-					for (int nx = -1; nx < 2; ++nx, ++i)
+		uint32_t transparent = occupied[row] & ~opaque[row];
+		if (sparseRow(occupied[row]))
+		{
+			// pack the three rows along y of each z plane into one word, 21 bits apart
+			uint64_t occWords[3], opqWords[3];
+			for (int nz = 0; nz < 3; ++nz)
 			{
-				int block_x = (x + nx + GRID_LEN) >> LOG_GRID_LEN;
-				int block_y = (y + ny + GRID_LEN) >> LOG_GRID_LEN; // could be moved to outer loop
-				int block_z = (z + nz + GRID_LEN) >> LOG_GRID_LEN; // could be moved to outer loop
-				int block_index = block_x + 3 * block_y + 9 * block_z;
-
-				const VoxelGrid *nGrid = neighbourGrids[block_index];
-				if (!nGrid)
-					continue;
-				int neighbourIndex = voxelIndex((x + nx) & (GRID_LEN - 1),
-												(y + ny) & (GRID_LEN - 1),
-												(z + nz) & (GRID_LEN - 1));
-				const VoxelEntry &neighbour = nGrid->voxels[neighbourIndex];
-
-				if (isFaceHidden(vox, neighbour))
-					mask |= 1 << i;
+				const uint32_t *occ = &padOccupied[z + nz][y], *opq = &padOpaque[z + nz][y];
+				occWords[nz] = occ[0] | uint64_t(occ[1]) << 21 | uint64_t(occ[2]) << 42;
+				opqWords[nz] = opq[0] | uint64_t(opq[1]) << 21 | uint64_t(opq[2]) << 42;
 			}
-		}
-		else // don't need neighbour grids
-		{
-			for (int nz = -1, i = 0; nz < 2; ++nz)
-				for (int ny = -1; ny < 2; ++ny)
-					for (int nx = -1; nx < 2; ++nx, ++i)
+			const uint64_t triples = 7 | 7ull << 21 | 7ull << 42;
+			for (uint32_t bits = occupied[row]; bits; bits &= bits - 1)
 			{
-				int neighbourIndex = index + voxelIndex(nx, ny, nz);
-				const VoxelEntry &neighbour = voxels[neighbourIndex];
-
-				if (isFaceHidden(vox, neighbour))
-					mask |= 1 << i;
+				int x = __builtin_ctz(bits);
+				const uint64_t *words = (transparent & (1 << x)) ? occWords : opqWords;
+				int mask = 0;
+				for (int nz = 0; nz < 3; ++nz)
+				{
+					// gather the 3x3 neighbours of one z plane into 9 consecutive bits
+					uint64_t t = (words[nz] >> x) & triples;
+					mask |= int((t | t >> 18 | t >> 36) & 0x1FF) << (9 * nz);
+				}
+				masks[row * GRID_LEN + x] = mask;
 			}
+			continue;
+		}
+		uint32_t planes[27];
+		for (int nz = 0, i = 0; nz < 3; ++nz)
+			for (int ny = 0; ny < 3; ++ny)
+				for (int nx = 0; nx < 3; ++nx, ++i)
+		{
+			planes[i] = (padOpaque[z + nz][y + ny] >> nx) | ((padOccupied[z + nz][y + ny] >> nx) & transparent);
 		}
-		masks[index] = mask;
+		transposeRow(planes, masks + row * GRID_LEN);
 	}
-	return masks;
 }
 
 /*=================================
@@ -403,8 +882,41 @@ void initIndexBuffer(QOpenGLFunctions_3_3_Core &glf)
 	delete[] index_array;
 }
 
-void RenderGrid::setup(QOpenGLFunctions_3_3_Core &glf)
+GLint RenderGrid::s_pageShiftUniform = -1;
+GLint RenderGrid::s_formatUniform = -1;
+
+void RenderGrid::initializeShader(QOpenGLShaderProgram *program)
 {
+	program->bind();
+	s_pageShiftUniform = program->uniformLocation("page_shift");
+	s_formatUniform = program->uniformLocation("vertex_format");
+	program->setUniformValue("face_buffer", FACE_BUFFER_UNIT);
+	program->setUniformValue("page_origins", PAGE_ORIGIN_UNIT);
+}
+
+// the element buffer binding is part of the VAO state too
+static void setupFaceBuffer(QOpenGLFunctions_3_3_Core &glf)
+{
+	// face records are read from the buffer texture, the shader only needs gl_VertexID
+	glf.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_indexBuffer);
+}
+
+static void setupPackedVertices(QOpenGLFunctions_3_3_Core &glf)
+{
+	glf.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_indexBuffer);
+	// Attribute 1: vertex color
+	glf.glEnableVertexAttribArray(1);
+	glf.glVertexAttribIPointer(1, 4, GL_UNSIGNED_BYTE, sizeof(GlPackedVoxelVertex_t),
+								(const GLvoid*)offsetof(GlPackedVoxelVertex_t, col));
+	// Attribute 6: position, vertex index, material, texture index and occlusion in one word
+	glf.glEnableVertexAttribArray(6);
+	glf.glVertexAttribIPointer(6, 1, GL_UNSIGNED_INT, sizeof(GlPackedVoxelVertex_t),
+								(const GLvoid*)offsetof(GlPackedVoxelVertex_t, attributes));
+}
+
+static void setupVoxelVertices(QOpenGLFunctions_3_3_Core &glf)
+{
+	glf.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_indexBuffer);
 	// Attribute 0: vertex position
 	glf.glEnableVertexAttribArray(0);
 	glf.glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(GlVoxelVertex_t),
@@ -431,52 +943,245 @@ void RenderGrid::setup(QOpenGLFunctions_3_3_Core &glf)
 								(const GLvoid*)offsetof(GlVoxelVertex_t, occlusion));
 }
 
+VertexArena* RenderGrid::s_arenas[3] = { nullptr, nullptr, nullptr };
+int RenderGrid::s_arenaGeneration = 0;
+
+void RenderGrid::initializeArenas()
+{
+	// indexed by RenderOptions::VertexFormats; a face record covers the 4 vertex IDs of its quad
+	s_arenas[RenderOptions::VERTEX_FULL] = new VertexArena(sizeof(GlVoxelVertex_t), 1, setupVoxelVertices, false);
+	s_arenas[RenderOptions::VERTEX_PACKED] = new VertexArena(sizeof(GlPackedVoxelVertex_t), 1, setupPackedVertices, true);
+	s_arenas[RenderOptions::VERTEX_PULLED] = new VertexArena(sizeof(GlVoxelFace_t), 4, setupFaceBuffer, true, GL_RG32UI);
+	++s_arenaGeneration;
+}
+
+void RenderGrid::cleanupArenas(QOpenGLFunctions_3_3_Core &glf)
+{
+	for (VertexArena *&arena: s_arenas)
+	{
+		if (!arena)
+			continue;
+		arena->cleanupGL(glf);
+		delete arena;
+		arena = nullptr;
+	}
+}
+
+VertexArena& RenderGrid::arena(RenderOptions::VertexFormats format)
+{
+	return *s_arenas[format];
+}
+
+void RenderGrid::endFrame(QOpenGLFunctions_3_3_Core &glf)
+{
+	for (VertexArena *arena: s_arenas)
+	{
+		if (arena)
+			arena->endFrame(glf);
+	}
+}
+
+void RenderGrid::releaseRange()
+{
+	// ranges of arenas of an earlier GL context went away with it
+	if (arenaRange.count && s_arenas[arenaFormat] && arenaGeneration == s_arenaGeneration)
+		s_arenas[arenaFormat]->free(arenaRange);
+	arenaRange = VertexArena::Range();
+}
+
+size_t RenderGrid::arenaBytes() const
+{
+	if (!arenaRange.count || !s_arenas[arenaFormat])
+		return 0;
+	return size_t(arenaRange.count) * s_arenas[arenaFormat]->getElementSize();
+}
+
+void RenderGrid::setup(QOpenGLFunctions_3_3_Core &glf)
+{
+	// nothing to do, the attributes are set up once per VertexArena
+}
+
 void RenderGrid::clear(QOpenGLFunctions_3_3_Core &glf)
 {
 	cleanupGL(glf);
 	nTessTris[0] = nTessTris[1] = 0;
+	nFaceTris = 0;
 }
 
 void RenderGrid::update(QOpenGLFunctions_3_3_Core &glf, const VoxelGrid* neighbourGrids[27], const RenderOptions &opt)
 {
 	// TODO: move to a better place...
 	if (!g_vertexBuffer)
-	{
-		initIndexBuffer(glf);
-		g_vertexBuffer = new GlVoxelVertex_t[GRID_LEN * GRID_LEN * GRID_LEN * 6 * 4];
-	}
+		g_vertexBuffer = new GlVoxelVertex_t[maxVertices()];
 
-	if (!glVAO.isCreated())
-		glVAO.create();
-	glVAO.bind();
+	tesselate(neighbourGrids, opt, g_vertexBuffer);
+	upload(glf);
+}
 
+void RenderGrid::tesselate(const VoxelGrid* neighbourGrids[27], const RenderOptions &opt, GlVoxelVertex_t *scratch)
+{
 	const VoxelGrid *tessGrid = neighbourGrids[13];
+	format = opt.vertexFormat;
+	origin = tessGrid->getGridPos();
+	// face records have no size, merged quads need vertices
+	if (format == RenderOptions::VERTEX_PULLED && opt.greedyMeshing && opt.mode != RenderOptions::MODE_SLICE)
+		format = RenderOptions::VERTEX_PACKED;
+	// all formats are smaller than GlVoxelVertex_t, so the scratch buffer fits either
+	size_t meshSize;
+	if (format == RenderOptions::VERTEX_PULLED)
+	{
+		GlVoxelFace_t *faces = reinterpret_cast<GlVoxelFace_t*>(scratch);
+		if (opt.mode == RenderOptions::MODE_SLICE)
+			tessGrid->tesselateSlice(faces, nTessTris, neighbourGrids, opt.axis, opt.level & (GRID_LEN - 1));
+		else
+			tessGrid->tesselate(faces, nTessTris, neighbourGrids);
+		nFaceTris = triangleCount();
+		meshSize = triangleCount() / 2 * sizeof(GlVoxelFace_t);
+	}
+	else if (format == RenderOptions::VERTEX_PACKED)
+	{
+		tesselateMesh(tessGrid, neighbourGrids, opt, reinterpret_cast<GlPackedVoxelVertex_t*>(scratch));
+		meshSize = vertexCount() * sizeof(GlPackedVoxelVertex_t);
+	}
+	else
+	{
+		tesselateMesh(tessGrid, neighbourGrids, opt, scratch);
+		meshSize = vertexCount() * sizeof(GlVoxelVertex_t);
+	}
+	const unsigned char *mesh = reinterpret_cast<const unsigned char*>(scratch);
+	pendingMesh.assign(mesh, mesh + meshSize);
+	dirty = true;
+}
+
+template<class V>
+void RenderGrid::tesselateMesh(const VoxelGrid *tessGrid, const VoxelGrid* neighbourGrids[27],
+							   const RenderOptions &opt, V *vertices)
+{
 	if (opt.mode == RenderOptions::MODE_SLICE)
-		tessGrid->tesselateSlice(g_vertexBuffer, nTessTris, neighbourGrids, opt.axis, opt.level & (GRID_LEN - 1));
+		tessGrid->tesselateSlice(vertices, nTessTris, neighbourGrids, opt.axis, opt.level & (GRID_LEN - 1));
+	else if (opt.greedyMeshing)
+		nFaceTris = tessGrid->tesselateGreedy(vertices, nTessTris, neighbourGrids);
 	else
-		tessGrid->tesselate(g_vertexBuffer, nTessTris, neighbourGrids);
-	int totalTris = nTessTris[0] + nTessTris[1];
-	if (totalTris > 0)
-		uploadBuffer(glf, g_vertexBuffer, 2 * totalTris * sizeof(GlVoxelVertex_t));
+		tessGrid->tesselate(vertices, nTessTris, neighbourGrids);
+	if (!opt.greedyMeshing || opt.mode == RenderOptions::MODE_SLICE)
+		nFaceTris = triangleCount();
+}
+
+void RenderGrid::upload(QOpenGLFunctions_3_3_Core &glf)
+{
+	// TODO: move to a better place...
+	if (!g_indexBuffer)
+		initIndexBuffer(glf);
+
+	// the old mesh may still be drawn by a frame in flight, so the new one always goes elsewhere
+	releaseRange();
+	arenaFormat = format;
+	arenaGeneration = s_arenaGeneration;
+	if (!pendingMesh.empty())
+	{
+		VertexArena &target = arena(format);
+		arenaRange = target.allocate(glf, pendingMesh.size() / target.getElementSize());
+		if (arenaRange.count)
+		{
+			target.upload(glf, arenaRange, pendingMesh.data(), pendingMesh.size());
+			if (format != RenderOptions::VERTEX_FULL)
+				target.setOrigin(glf, arenaRange, origin.x, origin.y, origin.z);
+		}
+		else
+			nTessTris[0] = nTessTris[1] = 0;
+		glf.glBindVertexArray(0);
+	}
+	// release the memory, the GPU has its own copy now
+	std::vector<unsigned char>().swap(pendingMesh);
 	dirty = false;
 }
 
+VertexArena& RenderGrid::bindFormat(QOpenGLFunctions_3_3_Core &glf, RenderOptions::VertexFormats format,
+									uint32_t chunk)
+{
+	VertexArena &source = arena(format);
+	source.bind(glf, chunk);
+	glf.glUniform1i(s_formatUniform, format);
+	if (format != RenderOptions::VERTEX_FULL)
+	{
+		glf.glUniform1i(s_pageShiftUniform, source.pageShift());
+		glf.glActiveTexture(GL_TEXTURE0 + PAGE_ORIGIN_UNIT);
+		glf.glBindTexture(GL_TEXTURE_BUFFER, source.originTexture(chunk));
+	}
+	if (format == RenderOptions::VERTEX_PULLED)
+	{
+		glf.glActiveTexture(GL_TEXTURE0 + FACE_BUFFER_UNIT);
+		glf.glBindTexture(GL_TEXTURE_BUFFER, source.texture(chunk));
+	}
+	glf.glActiveTexture(GL_TEXTURE0);
+	return source;
+}
+
+void RenderGrid::draw(QOpenGLFunctions_3_3_Core &glf, int firstTri, int nTris)
+{
+	VertexArena &source = bindFormat(glf, format, arenaRange.chunk);
+	glf.glDrawElementsBaseVertex(GL_TRIANGLES, nTris * 3, GL_UNSIGNED_SHORT,
+								 (void*)(firstTri * 3 * sizeof(uint16_t)), source.baseVertex(arenaRange));
+	glf.glBindVertexArray(0);
+}
+
+bool RenderGrid::checkArena()
+{
+	if (arenaRange.count && arenaGeneration != s_arenaGeneration)
+	{
+		arenaRange = VertexArena::Range();
+		dirty = true;
+	}
+	return !dirty;
+}
+
+void RenderGrid::addToBatches(RenderBatch batches[2])
+{
+	if (!checkArena())
+		return;
+	const GLint baseVertex = arena(format).baseVertex(arenaRange);
+	for (int i = 0, firstTri = 0; i < 2; firstTri += nTessTris[i], ++i)
+	{
+		if (nTessTris[i] == 0)
+			continue;
+		batches[i].add(arenaRange.chunk, nTessTris[i] * 3, (const void*)(firstTri * 3 * sizeof(uint16_t)), baseVertex);
+	}
+}
+
+int RenderGrid::drawBatch(QOpenGLFunctions_3_3_Core &glf, RenderOptions::VertexFormats format, const RenderBatch &batch)
+{
+	int drawCalls = 0;
+	for (uint32_t chunk = 0; chunk < batch.chunks.size(); ++chunk)
+	{
+		const RenderBatch::Draws &draws = batch.chunks[chunk];
+		if (draws.counts.empty())
+			continue;
+		bindFormat(glf, format, chunk);
+		glf.glMultiDrawElementsBaseVertex(GL_TRIANGLES, draws.counts.data(), GL_UNSIGNED_SHORT, draws.indices.data(),
+										  draws.counts.size(), draws.baseVertices.data());
+		++drawCalls;
+	}
+	if (drawCalls)
+		glf.glBindVertexArray(0);
+	return drawCalls;
+}
+
 void RenderGrid::render(QOpenGLFunctions_3_3_Core &glf)
 {
-	if (dirty || nTessTris[0] == 0)
+	if (!checkArena() || nTessTris[0] == 0)
 		return;
-	glVAO.bind();
-	glf.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_indexBuffer);
-	glf.glDrawElements(GL_TRIANGLES, nTessTris[0] * 3, GL_UNSIGNED_SHORT, 0);
-	glVAO.release();
+	draw(glf, 0, nTessTris[0]);
 }
 
 void RenderGrid::renderTransparent(QOpenGLFunctions_3_3_Core &glf)
 {
-	if (dirty || nTessTris[1] == 0)
+	if (!checkArena() || nTessTris[1] == 0)
 		return;
-	glVAO.bind();
-	glf.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_indexBuffer);
-	glf.glDrawElements(GL_TRIANGLES, nTessTris[1] * 3, GL_UNSIGNED_SHORT, (void*)(nTessTris[0] * 3 * sizeof(uint16_t)));
-	glVAO.release();
+	draw(glf, nTessTris[0], nTessTris[1]);
+}
+
+void RenderGrid::cleanupGL(QOpenGLFunctions_3_3_Core &glf)
+{
+	releaseRange();
+	GLRenderable::cleanupGL(glf);
 }
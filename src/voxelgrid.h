@@ -10,21 +10,65 @@
 #define VG_VOXELGRID_H
 
 #include "voxelgem.h"
+#include "voxelstorage.h"
 #include "renderobject.h"
+#include "vertexarena.h"
 
 #include <cfloat>
 #include <vector>
 
-#define GRID_LEN 16 // must be power of two
-#define LOG_GRID_LEN 4 // must be ld(GRID_LEN)
+class QOpenGLShaderProgram;
 
+//! one bit per voxel of a grid row along x
+typedef uint16_t rowMask_t;
+static_assert(GRID_LEN <= 16, "rowMask_t too small for GRID_LEN");
+static_assert(GRID_LEN < (1 << GlPackedVoxelVertex_t::POS_BITS), "GlPackedVoxelVertex_t too small for GRID_LEN");
+
+#define BRICK_LEN 4 // sub-bricks for ray traversal, (GRID_LEN / BRICK_LEN)^3 must fit 64 bits
+#define LOG_BRICK_LEN 2
+static_assert(GRID_LEN / BRICK_LEN == 4, "brickMask layout requires 4x4x4 sub-bricks");
+
+/*! Undo data of one grid, the voxels changed by an edit with their previous values.
+	Restoring swaps the values with those of the grid, so the memento then holds the redo state.
+	Changed indices are kept as runs, so large fills stay compact too. */
 class GridMemento
 {
 	friend class VoxelGrid;
+	friend class UndoJournal;
 	public:
-		bool isEmpty() const { return voxels.size() == 0; }
+		//! records the value of voxel index before a change; indices must be added in increasing order
+		void addChange(int index, const VoxelEntry &value)
+		{
+			if (!runs.empty() && runs.back().start + runs.back().length == index)
+				++runs.back().length;
+			else
+				runs.push_back(Run{ (uint16_t)index, 1 });
+			values.push_back(value);
+		}
+		bool isEmpty() const { return values.empty() && packed.empty(); }
+		size_t memoryUsage() const
+		{
+			return sizeof(GridMemento) + runs.capacity() * sizeof(Run) + values.capacity() * sizeof(VoxelEntry)
+					+ packed.capacity();
+		}
+		//! packs the changes with LZCodec, they get unpacked again on the next restore
+		void compress();
+		//! unpacks the changes; returns false on corrupt data, the memento then stays packed
+		bool decompress();
+		bool isCompressed() const { return !packed.empty(); }
+		//! whether the block exists in the state the memento restores; missing blocks are all empty
+		bool blockExists = true;
 	protected:
-		std::vector<VoxelEntry> voxels;
+		struct Run
+		{
+			uint16_t start;
+			uint16_t length;
+		};
+		std::vector<Run> runs;
+		std::vector<VoxelEntry> values;
+		std::vector<uint8_t> packed;
+		uint16_t nRuns = 0;
+		uint16_t nValues = 0;
 };
 
 class VoxelGrid
@@ -32,8 +76,8 @@ class VoxelGrid
 	public:
 		VoxelGrid(const IVector3D &pos);
 		VoxelGrid(const VoxelGrid &other);
-		//! note: this will empty the memento, basically a movement constructor!
-		VoxelGrid(const IVector3D &pos, GridMemento *memento);
+		//! copy placed at another grid position; voxels and content ID stay the same
+		VoxelGrid(const VoxelGrid &other, const IVector3D &pos);
 		virtual ~VoxelGrid();
 		inline int voxelIndex(int x, int y, int z) const
 		{
@@ -41,8 +85,12 @@ class VoxelGrid
 		}
 		void setVoxel(int x, int y, int z, const VoxelEntry &voxel)
 		{
-			voxels[voxelIndex(x, y, z)] = voxel;
+			int index = voxelIndex(x, y, z);
+			voxels.set(index, voxel);
+			setRowBits(index >> LOG_GRID_LEN, 1 << x, voxel);
+			content = 0;
 		}
+		//! the returned pointer is only valid until the grid gets modified
 		const VoxelEntry* getVoxel(const IVector3D &pos) const
 		{
 			return &voxels[voxelIndex(pos.x, pos.y, pos.z)];
@@ -52,28 +100,124 @@ class VoxelGrid
 			int val = pos - bound.pMin[axis];
 			return val < 0 ? 0 : (val > GRID_LEN - 1 ? GRID_LEN - 1 : val);
 		}
+		//! writes all GRID_VOLUME voxels to dense, in voxelIndex() order
+		void getVoxels(VoxelEntry *dense) const { voxels.decode(dense); }
+		//! replaces all voxels with the GRID_VOLUME voxels of dense
+		void setVoxels(const VoxelEntry *dense);
 		const IVector3D& getGridPos() const { return bound.pMin; }
 		const IBBox& getBound() const { return bound; }
+		size_t memoryUsage() const { return sizeof(VoxelGrid) + voxels.memoryUsage(); }
+		/*! identifies the voxel content, grids with equal IDs have equal voxels.
+			A copy keeps the ID until either grid gets modified. Not thread safe, IDs get assigned lazily */
+		uint64_t contentId() const
+		{
+			if (!content)
+				content = newContentId();
+			return content;
+		}
+		/*! for grids derived deterministically from other grids, so equal inputs yield equal IDs;
+			the caller must keep the IDs apart from those of newContentId() */
+		void setContentId(uint64_t id) { content = id; }
 		float voxelEdge(int pos, int axis) const { return bound.pMin[axis] + (float)pos; }
 		bool rayIntersect(const ray_t &ray, SceneRayHit &hit) const;
 		void merge(const VoxelGrid &topLayer, VoxelGrid *targetGrid = 0);
 		//! returns the number of non-empty voxels
 		int applyChanges(const VoxelGrid &toolLayer, GridMemento *memento);
-		// this only saves the state to memento; used when a grid will be deleted directly rather than modified.
+		/* this only saves the voxels the memento covers to it; used when a grid will be deleted directly
+		   rather than modified, after restoring the memento would have emptied it. */
 		void saveState(GridMemento *memento) const;
 		// the memento shall be altered to allow reversing the restore (i.e. "redo" operation)
 		void restoreState(GridMemento *memento);
-		void tesselate(GlVoxelVertex_t *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27]) const;
-		void tesselateSlice(GlVoxelVertex_t *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27],
-							int axis, int level) const;
+		/*! V is GlVoxelVertex_t with world positions, or GlPackedVoxelVertex_t with positions
+			relative to getGridPos() */
+		template<class V> void tesselate(V *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27]) const;
+		/*! like tesselate(), but merges coplanar faces with equal color, material, normal map
+			and occlusion into larger quads. Returns the number of triangles tesselate() would produce */
+		template<class V> int tesselateGreedy(V *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27]) const;
+		template<class V> void tesselateSlice(V *vertices, int nTris[2], const VoxelGrid* neighbourGrids[27],
+											  int axis, int level) const;
 	protected:
-		int writeFaces(const VoxelEntry &entry, uint8_t matIndex, int mask, IVector3D pos, GlVoxelVertex_t *vertices) const;
-		std::vector<int> getNeighbourMasks(const VoxelGrid* neighbourGrids[27]) const;
+		template<class V> int writeFaces(const VoxelEntry &entry, uint8_t matIndex, int mask, IVector3D pos, V *vertices) const;
+		template<class V> int writeGreedyFaces(const int *masks, bool transparent, V *vertices, int &nFaceTris) const;
+		//! writes the VOXEL_NEIGHBOR_FLAG masks to masks[GRID_VOLUME], only valid for non-empty voxels
+		void getNeighbourMasks(const VoxelGrid* neighbourGrids[27], int *masks) const;
+		void setRowBits(int row, rowMask_t bit, const VoxelEntry &voxel)
+		{
+			bool nonEmpty = voxel.flags & Voxel::VF_NON_EMPTY;
+			bool collide = (voxel.flags & (Voxel::VF_NON_EMPTY | Voxel::VF_NO_COLLISION)) == Voxel::VF_NON_EMPTY;
+			occupied[row] = nonEmpty ? occupied[row] | bit : occupied[row] & ~bit;
+			opaque[row] = nonEmpty && !voxel.isTransparent() ? opaque[row] | bit : opaque[row] & ~bit;
+			if (collide)
+			{
+				collidable[row] |= bit;
+				brickMask |= brickBit(row, bit);
+			}
+			else if (collidable[row] & bit)
+			{
+				collidable[row] &= ~bit;
+				updateBrick(row, bit);
+			}
+		}
+		//! bit of the BRICK_LEN^3 sub-brick containing the voxel (row, bit) in brickMask
+		static uint64_t brickBit(int row, rowMask_t bit);
+		void updateBrick(int row, rowMask_t bit);
+		/*! recalculates the row masks and brick mask from the voxels, and resets the content ID.
+			dense may hold the decoded voxels, which saves reading them through the palette */
+		void updateRowMasks(const VoxelEntry *dense = nullptr);
+		void updateRowMasks(const VoxelBlockAoS &dense) { updateRowMasks(dense.entries); }
+		void updateRowMasks(const VoxelBlockSoA &dense);
+		//! flagsAt(index) returns the flags of a voxel
+		template<class F> void rowMasksFromFlags(F flagsAt);
+		static uint64_t newContentId();
 		IBBox bound;
-		std::vector<VoxelEntry> voxels;
+		VoxelStorage voxels;
+		//! bit x of row (y + z * GRID_LEN) is set for non-empty voxels
+		rowMask_t occupied[GRID_LEN * GRID_LEN];
+		//! same for non-empty voxels that are not transparent
+		rowMask_t opaque[GRID_LEN * GRID_LEN];
+		//! same for voxels that can be hit by rays (non-empty, no VF_NO_COLLISION)
+		rowMask_t collidable[GRID_LEN * GRID_LEN];
+		//! one bit per sub-brick with collidable voxels, bit (bx + by * 4 + bz * 16)
+		uint64_t brickMask;
+		//! 0 until contentId() gets called after a modification
+		mutable uint64_t content = 0;
 };
 
 
+/*! draw ranges of the meshes of one vertex format, to submit with one glMultiDrawElementsBaseVertex
+	per VertexArena chunk */
+struct RenderBatch
+{
+	struct Draws
+	{
+		std::vector<GLsizei> counts;
+		std::vector<const void*> indices;
+		std::vector<GLint> baseVertices;
+	};
+	void clear()
+	{
+		for (Draws &draws: chunks)
+		{
+			draws.counts.clear();
+			draws.indices.clear();
+			draws.baseVertices.clear();
+		}
+	}
+	void add(uint32_t chunk, GLsizei count, const void *indices, GLint baseVertex)
+	{
+		if (chunk >= chunks.size())
+			chunks.resize(chunk + 1);
+		chunks[chunk].counts.push_back(count);
+		chunks[chunk].indices.push_back(indices);
+		chunks[chunk].baseVertices.push_back(baseVertex);
+	}
+	//! indexed by arena chunk
+	std::vector<Draws> chunks;
+};
+
+/*! Mesh of one voxel grid. The vertex data lives in the shared VertexArena of its vertex
+	format, so all grids of one format draw through the same VAO. The arenas live as long as the
+	GL context, see initializeArenas() */
 class RenderGrid: public GLRenderable
 {
 	public:
@@ -81,10 +225,70 @@ class RenderGrid: public GLRenderable
 		void clear(QOpenGLFunctions_3_3_Core &glf);
 		/*! @param neighbourGrids: neighbourGrids[13] is the center to generate the mesh from */
 		void update(QOpenGLFunctions_3_3_Core &glf, const VoxelGrid* neighbourGrids[27], const RenderOptions &opt);
+		/*! CPU part of update(), may run on any thread. The mesh gets written to scratch, which
+			must hold maxVertices() entries, and is then kept in a right-sized buffer until upload().
+			Scratch also holds the smaller formats of RenderOptions::vertexFormat */
+		void tesselate(const VoxelGrid* neighbourGrids[27], const RenderOptions &opt, GlVoxelVertex_t *scratch);
+		//! GL part of update(), sends the mesh from tesselate() to the GPU; render thread only
+		void upload(QOpenGLFunctions_3_3_Core &glf);
+		static int maxVertices() { return GRID_LEN * GRID_LEN * GRID_LEN * 6 * 4; }
 		void render(QOpenGLFunctions_3_3_Core &glf) override;
 		void renderTransparent(QOpenGLFunctions_3_3_Core &glf);
+		void cleanupGL(QOpenGLFunctions_3_3_Core &glf) override;
+		int triangleCount() const { return nTessTris[0] + nTessTris[1]; }
+		int vertexCount() const { return 2 * triangleCount(); }
+		//! triangles the plain per-face tesselation produces, to judge greedy meshing efficiency
+		int faceTriangleCount() const { return nFaceTris; }
+		RenderOptions::VertexFormats getFormat() const { return format; }
+		//! arena space taken by the uploaded mesh
+		size_t arenaBytes() const;
+		/*! adds the opaque triangles to batches[0] and the transparent ones to batches[1]. A mesh in
+			the arenas of an earlier GL context gets marked dirty and skipped */
+		void addToBatches(RenderBatch batches[2]);
+		//! draws the meshes of batch, which must all have format; returns the number of draw calls
+		static int drawBatch(QOpenGLFunctions_3_3_Core &glf, RenderOptions::VertexFormats format, const RenderBatch &batch);
+		/*! looks up the uniforms of the voxel shader that get set per format, i.e. the vertex format
+			and the page size of the origin table that packed vertices and face records are relative to */
+		static void initializeShader(QOpenGLShaderProgram *program);
+		//! texture unit of the face buffer for RenderOptions::VERTEX_PULLED
+		static const int FACE_BUFFER_UNIT = 1;
+		//! texture unit of the page origins of packed vertices and face records
+		static const int PAGE_ORIGIN_UNIT = 2;
+		//! creates the vertex arenas; the owner of the GL context calls it once the context exists
+		static void initializeArenas();
+		//! deletes the arenas and their GL objects; call with the context current before it goes away
+		static void cleanupArenas(QOpenGLFunctions_3_3_Core &glf);
+		//! lets the arenas reuse the space freed this frame once the GPU is done; call after drawing
+		static void endFrame(QOpenGLFunctions_3_3_Core &glf);
+		//! requires initializeArenas()
+		static VertexArena& arena(RenderOptions::VertexFormats format);
 	protected:
-		int nTessTris[2];
+		template<class V> void tesselateMesh(const VoxelGrid *tessGrid, const VoxelGrid* neighbourGrids[27],
+											 const RenderOptions &opt, V *vertices);
+		void draw(QOpenGLFunctions_3_3_Core &glf, int firstTri, int nTris);
+		//! binds the VAO and textures of a chunk of the arena of format and sets the uniforms
+		static VertexArena& bindFormat(QOpenGLFunctions_3_3_Core &glf, RenderOptions::VertexFormats format,
+									   uint32_t chunk);
+		//! returns arenaRange to its arena, if that still exists
+		void releaseRange();
+		//! false if there is no mesh to draw; forgets meshes of arenas from an earlier GL context
+		bool checkArena();
+		int nTessTris[2] = { 0, 0 };
+		int nFaceTris = 0;
+		//! vertex format of the mesh, decided by tesselate()
+		RenderOptions::VertexFormats format = RenderOptions::VERTEX_FULL;
+		IVector3D origin = IVector3D(0, 0, 0);
+		//! where the uploaded mesh is, tesselate() may already have changed format
+		VertexArena::Range arenaRange;
+		RenderOptions::VertexFormats arenaFormat = RenderOptions::VERTEX_FULL;
+		//! s_arenaGeneration at upload, ranges from older arenas must not be freed into new ones
+		int arenaGeneration = 0;
+		std::vector<unsigned char> pendingMesh;
+		static GLint s_pageShiftUniform;
+		static GLint s_formatUniform;
+		//! indexed by RenderOptions::VertexFormats, owned by the GL context owner
+		static VertexArena *s_arenas[3];
+		static int s_arenaGeneration;
 };
 
 #endif // VG_VOXELGRID_H
@@ -0,0 +1,327 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "voxelkernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define VG_KERNELS_X86 1
+	#include <immintrin.h>
+#endif
+
+static_assert(sizeof(VoxelEntry) == 8 && sizeof(rgba_t) == 4, "kernels expect 32 bit color and flags");
+
+/* All versions work on 64 voxels at a time, so the change mask and the non-empty count
+   come out of one 64 bit word each. The flags of a voxel decide between base, top and empty,
+   which is done with masks instead of branches. */
+
+static int mergeScalar(const VoxelEntry *base, const VoxelEntry *top, VoxelEntry *out, uint64_t *changed)
+{
+	int nonEmpty = 0;
+	for (int w = 0; w < GRID_VOLUME / 64; ++w)
+	{
+		uint64_t changedBits = 0, nonEmptyBits = 0;
+		for (int j = 0; j < 64; ++j)
+		{
+			int i = w * 64 + j;
+			uint32_t topFlags = top[i].flags;
+			uint32_t replace = 0u - (topFlags & Voxel::VF_NON_EMPTY);
+			uint32_t keep = (topFlags & Voxel::VF_ERASED) ? 0u : ~0u;
+			VoxelEntry result(((top[i].col.raw & replace) | (base[i].col.raw & ~replace)) & keep,
+							  ((topFlags & replace) | (base[i].flags & ~replace)) & keep);
+			changedBits |= uint64_t(result != base[i]) << j;
+			nonEmptyBits |= uint64_t(result.flags & Voxel::VF_NON_EMPTY) << j;
+			out[i] = result;
+		}
+		if (changed)
+			changed[w] = changedBits;
+		nonEmpty += __builtin_popcountll(nonEmptyBits);
+	}
+	return nonEmpty;
+}
+
+static int mergeSoAScalar(const VoxelBlockSoA &base, const VoxelBlockSoA &top, VoxelBlockSoA &out, uint64_t *changed)
+{
+	int nonEmpty = 0;
+	for (int w = 0; w < GRID_VOLUME / 64; ++w)
+	{
+		uint64_t changedBits = 0, nonEmptyBits = 0;
+		for (int j = 0; j < 64; ++j)
+		{
+			int i = w * 64 + j;
+			uint32_t topFlags = top.flags[i];
+			uint32_t replace = 0u - (topFlags & Voxel::VF_NON_EMPTY);
+			uint32_t keep = (topFlags & Voxel::VF_ERASED) ? 0u : ~0u;
+			uint32_t color = ((top.colors[i] & replace) | (base.colors[i] & ~replace)) & keep;
+			uint16_t flags = ((topFlags & replace) | (base.flags[i] & ~replace)) & keep;
+			changedBits |= uint64_t(color != base.colors[i] || flags != base.flags[i]) << j;
+			nonEmptyBits |= uint64_t(flags & Voxel::VF_NON_EMPTY) << j;
+			out.colors[i] = color;
+			out.flags[i] = flags;
+		}
+		if (changed)
+			changed[w] = changedBits;
+		nonEmpty += __builtin_popcountll(nonEmptyBits);
+	}
+	return nonEmpty;
+}
+
+#ifdef VG_KERNELS_X86
+
+__attribute__((target("sse2")))
+static int mergeSSE2(const VoxelEntry *base, const VoxelEntry *top, VoxelEntry *out, uint64_t *changed)
+{
+	const __m128i nonEmptyBit = _mm_set1_epi32(Voxel::VF_NON_EMPTY);
+	const __m128i erasedBit = _mm_set1_epi32(Voxel::VF_ERASED);
+	int nonEmpty = 0;
+	for (int w = 0; w < GRID_VOLUME / 64; ++w)
+	{
+		uint64_t changedBits = 0, nonEmptyBits = 0;
+		for (int j = 0; j < 64; j += 2)
+		{
+			int i = w * 64 + j;
+			__m128i b = _mm_loadu_si128((const __m128i*)(base + i));
+			__m128i t = _mm_loadu_si128((const __m128i*)(top + i));
+			// the flags of each voxel in both its lanes
+			__m128i flags = _mm_shuffle_epi32(t, _MM_SHUFFLE(3, 3, 1, 1));
+			__m128i replace = _mm_cmpeq_epi32(_mm_and_si128(flags, nonEmptyBit), nonEmptyBit);
+			__m128i erase = _mm_cmpeq_epi32(_mm_and_si128(flags, erasedBit), erasedBit);
+			__m128i result = _mm_andnot_si128(erase, _mm_or_si128(_mm_and_si128(replace, t), _mm_andnot_si128(replace, b)));
+			_mm_storeu_si128((__m128i*)(out + i), result);
+			// SSE2 has no 64 bit compare, so combine the color and flags halves
+			__m128i equal = _mm_cmpeq_epi32(result, b);
+			equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+			changedBits |= uint64_t(~_mm_movemask_pd(_mm_castsi128_pd(equal)) & 3) << j;
+			__m128i resultFlags = _mm_shuffle_epi32(result, _MM_SHUFFLE(3, 3, 1, 1));
+			__m128i filled = _mm_cmpeq_epi32(_mm_and_si128(resultFlags, nonEmptyBit), nonEmptyBit);
+			nonEmptyBits |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(filled))) << j;
+		}
+		if (changed)
+			changed[w] = changedBits;
+		nonEmpty += __builtin_popcountll(nonEmptyBits);
+	}
+	return nonEmpty;
+}
+
+__attribute__((target("avx2")))
+static int mergeAVX2(const VoxelEntry *base, const VoxelEntry *top, VoxelEntry *out, uint64_t *changed)
+{
+	const __m256i nonEmptyBit = _mm256_set1_epi32(Voxel::VF_NON_EMPTY);
+	const __m256i erasedBit = _mm256_set1_epi32(Voxel::VF_ERASED);
+	int nonEmpty = 0;
+	for (int w = 0; w < GRID_VOLUME / 64; ++w)
+	{
+		uint64_t changedBits = 0, nonEmptyBits = 0;
+		for (int j = 0; j < 64; j += 4)
+		{
+			int i = w * 64 + j;
+			__m256i b = _mm256_loadu_si256((const __m256i*)(base + i));
+			__m256i t = _mm256_loadu_si256((const __m256i*)(top + i));
+			__m256i flags = _mm256_shuffle_epi32(t, _MM_SHUFFLE(3, 3, 1, 1));
+			__m256i replace = _mm256_cmpeq_epi32(_mm256_and_si256(flags, nonEmptyBit), nonEmptyBit);
+			__m256i erase = _mm256_cmpeq_epi32(_mm256_and_si256(flags, erasedBit), erasedBit);
+			__m256i result = _mm256_andnot_si256(erase, _mm256_blendv_epi8(b, t, replace));
+			_mm256_storeu_si256((__m256i*)(out + i), result);
+			__m256i equal = _mm256_cmpeq_epi64(result, b);
+			changedBits |= uint64_t(~_mm256_movemask_pd(_mm256_castsi256_pd(equal)) & 0xF) << j;
+			__m256i resultFlags = _mm256_shuffle_epi32(result, _MM_SHUFFLE(3, 3, 1, 1));
+			__m256i filled = _mm256_cmpeq_epi32(_mm256_and_si256(resultFlags, nonEmptyBit), nonEmptyBit);
+			nonEmptyBits |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(filled))) << j;
+		}
+		if (changed)
+			changed[w] = changedBits;
+		nonEmpty += __builtin_popcountll(nonEmptyBits);
+	}
+	return nonEmpty;
+}
+
+/* The SoA versions select colors with the flag masks widened to 32 bits, and compare
+   colors and flags separately before combining them per voxel. */
+
+__attribute__((target("sse2")))
+static int mergeSoASSE2(const VoxelBlockSoA &base, const VoxelBlockSoA &top, VoxelBlockSoA &out, uint64_t *changed)
+{
+	const __m128i nonEmptyBit = _mm_set1_epi16(Voxel::VF_NON_EMPTY);
+	const __m128i erasedBit = _mm_set1_epi16(Voxel::VF_ERASED);
+	const __m128i zero = _mm_setzero_si128();
+	int nonEmpty = 0;
+	for (int w = 0; w < GRID_VOLUME / 64; ++w)
+	{
+		uint64_t changedBits = 0, nonEmptyBits = 0;
+		for (int j = 0; j < 64; j += 8)
+		{
+			int i = w * 64 + j;
+			__m128i baseFlags = _mm_loadu_si128((const __m128i*)(base.flags + i));
+			__m128i topFlags = _mm_loadu_si128((const __m128i*)(top.flags + i));
+			__m128i replace = _mm_cmpeq_epi16(_mm_and_si128(topFlags, nonEmptyBit), nonEmptyBit);
+			__m128i erase = _mm_cmpeq_epi16(_mm_and_si128(topFlags, erasedBit), erasedBit);
+			__m128i flags = _mm_andnot_si128(erase, _mm_or_si128(_mm_and_si128(replace, topFlags), _mm_andnot_si128(replace, baseFlags)));
+			_mm_storeu_si128((__m128i*)(out.flags + i), flags);
+			__m128i colorsEqual[2];
+			for (int h = 0; h < 2; ++h)
+			{
+				__m128i b = _mm_loadu_si128((const __m128i*)(base.colors + i + 4 * h));
+				__m128i t = _mm_loadu_si128((const __m128i*)(top.colors + i + 4 * h));
+				__m128i rep = h ? _mm_unpackhi_epi16(replace, replace) : _mm_unpacklo_epi16(replace, replace);
+				__m128i era = h ? _mm_unpackhi_epi16(erase, erase) : _mm_unpacklo_epi16(erase, erase);
+				__m128i color = _mm_andnot_si128(era, _mm_or_si128(_mm_and_si128(rep, t), _mm_andnot_si128(rep, b)));
+				_mm_storeu_si128((__m128i*)(out.colors + i + 4 * h), color);
+				colorsEqual[h] = _mm_cmpeq_epi32(color, b);
+			}
+			__m128i equal = _mm_and_si128(_mm_cmpeq_epi16(flags, baseFlags), _mm_packs_epi32(colorsEqual[0], colorsEqual[1]));
+			changedBits |= uint64_t(~_mm_movemask_epi8(_mm_packs_epi16(equal, zero)) & 0xFF) << j;
+			__m128i filled = _mm_cmpeq_epi16(_mm_and_si128(flags, nonEmptyBit), nonEmptyBit);
+			nonEmptyBits |= uint64_t(_mm_movemask_epi8(_mm_packs_epi16(filled, zero)) & 0xFF) << j;
+		}
+		if (changed)
+			changed[w] = changedBits;
+		nonEmpty += __builtin_popcountll(nonEmptyBits);
+	}
+	return nonEmpty;
+}
+
+//! one bit per 16 bit lane of mask, which must be all ones or zeros per lane
+__attribute__((target("avx2")))
+static inline uint32_t laneBits16(__m256i mask)
+{
+	// packing works within 128 bit halves, so the bits end up in bytes 0 and 2
+	uint32_t bytes = _mm256_movemask_epi8(_mm256_packs_epi16(mask, _mm256_setzero_si256()));
+	return (bytes & 0xFF) | ((bytes >> 8) & 0xFF00);
+}
+
+__attribute__((target("avx2")))
+static int mergeSoAAVX2(const VoxelBlockSoA &base, const VoxelBlockSoA &top, VoxelBlockSoA &out, uint64_t *changed)
+{
+	const __m256i nonEmptyBit = _mm256_set1_epi16(Voxel::VF_NON_EMPTY);
+	const __m256i erasedBit = _mm256_set1_epi16(Voxel::VF_ERASED);
+	int nonEmpty = 0;
+	for (int w = 0; w < GRID_VOLUME / 64; ++w)
+	{
+		uint64_t changedBits = 0, nonEmptyBits = 0;
+		for (int j = 0; j < 64; j += 16)
+		{
+			int i = w * 64 + j;
+			__m256i baseFlags = _mm256_loadu_si256((const __m256i*)(base.flags + i));
+			__m256i topFlags = _mm256_loadu_si256((const __m256i*)(top.flags + i));
+			__m256i replace = _mm256_cmpeq_epi16(_mm256_and_si256(topFlags, nonEmptyBit), nonEmptyBit);
+			__m256i erase = _mm256_cmpeq_epi16(_mm256_and_si256(topFlags, erasedBit), erasedBit);
+			__m256i flags = _mm256_andnot_si256(erase, _mm256_blendv_epi8(baseFlags, topFlags, replace));
+			_mm256_storeu_si256((__m256i*)(out.flags + i), flags);
+			__m256i colorsEqual[2];
+			for (int h = 0; h < 2; ++h)
+			{
+				__m256i b = _mm256_loadu_si256((const __m256i*)(base.colors + i + 8 * h));
+				__m256i t = _mm256_loadu_si256((const __m256i*)(top.colors + i + 8 * h));
+				__m256i rep = _mm256_cvtepi16_epi32(h ? _mm256_extracti128_si256(replace, 1) : _mm256_castsi256_si128(replace));
+				__m256i era = _mm256_cvtepi16_epi32(h ? _mm256_extracti128_si256(erase, 1) : _mm256_castsi256_si128(erase));
+				__m256i color = _mm256_andnot_si256(era, _mm256_blendv_epi8(b, t, rep));
+				_mm256_storeu_si256((__m256i*)(out.colors + i + 8 * h), color);
+				colorsEqual[h] = _mm256_cmpeq_epi32(color, b);
+			}
+			// packing interleaves the 128 bit halves, the permute restores voxel order
+			__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(colorsEqual[0], colorsEqual[1]), _MM_SHUFFLE(3, 1, 2, 0));
+			__m256i equal = _mm256_and_si256(_mm256_cmpeq_epi16(flags, baseFlags), packed);
+			changedBits |= uint64_t(~laneBits16(equal) & 0xFFFF) << j;
+			__m256i filled = _mm256_cmpeq_epi16(_mm256_and_si256(flags, nonEmptyBit), nonEmptyBit);
+			nonEmptyBits |= uint64_t(laneBits16(filled)) << j;
+		}
+		if (changed)
+			changed[w] = changedBits;
+		nonEmpty += __builtin_popcountll(nonEmptyBits);
+	}
+	return nonEmpty;
+}
+
+#endif // VG_KERNELS_X86
+
+bool VoxelKernels::supported(Isa isa)
+{
+	#ifdef VG_KERNELS_X86
+	if (isa == AVX2)
+		return __builtin_cpu_supports("avx2");
+	if (isa == SSE2)
+		return __builtin_cpu_supports("sse2");
+	#endif
+	return isa == SCALAR;
+}
+
+VoxelKernels::mergeFunc_t VoxelKernels::select(Isa isa)
+{
+	switch (isa)
+	{
+	#ifdef VG_KERNELS_X86
+		case AVX2:
+			return mergeAVX2;
+		case SSE2:
+			return mergeSSE2;
+	#endif
+		default:
+			return mergeScalar;
+	}
+}
+
+VoxelKernels::mergeSoAFunc_t VoxelKernels::selectSoA(Isa isa)
+{
+	switch (isa)
+	{
+	#ifdef VG_KERNELS_X86
+		case AVX2:
+			return mergeSoAAVX2;
+		case SSE2:
+			return mergeSoASSE2;
+	#endif
+		default:
+			return mergeSoAScalar;
+	}
+}
+
+static VoxelKernels::Isa bestIsa()
+{
+	// __builtin_cpu_supports needs this when called during static initialization
+	#ifdef VG_KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return VoxelKernels::AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return VoxelKernels::SSE2;
+	#endif
+	return VoxelKernels::SCALAR;
+}
+
+VoxelKernels::Isa VoxelKernels::isa = bestIsa();
+VoxelKernels::mergeFunc_t VoxelKernels::mergeFunc = VoxelKernels::select(VoxelKernels::isa);
+VoxelKernels::mergeSoAFunc_t VoxelKernels::mergeSoAFunc = VoxelKernels::selectSoA(VoxelKernels::isa);
+
+int VoxelKernels::merge(const VoxelEntry *base, const VoxelEntry *top, VoxelEntry *out, uint64_t changed[GRID_VOLUME / 64])
+{
+	return mergeFunc(base, top, out, changed);
+}
+
+int VoxelKernels::merge(const VoxelBlockSoA &base, const VoxelBlockSoA &top, VoxelBlockSoA &out, uint64_t changed[GRID_VOLUME / 64])
+{
+	return mergeSoAFunc(base, top, out, changed);
+}
+
+VoxelKernels::Isa VoxelKernels::activeIsa()
+{
+	return isa;
+}
+
+const char* VoxelKernels::isaName(Isa isa)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+	return names[isa];
+}
+
+void VoxelKernels::setIsa(Isa newIsa)
+{
+	if (!supported(newIsa))
+		return;
+	isa = newIsa;
+	mergeFunc = select(newIsa);
+	mergeSoAFunc = selectSoA(newIsa);
+}
@@ -0,0 +1,56 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef VG_VOXELKERNELS_H
+#define VG_VOXELKERNELS_H
+
+#include "voxelgem.h"
+#include "voxelstorage.h"
+
+/*! Branch-free kernels over the GRID_VOLUME voxels of decoded grids.
+	The implementation gets picked during static initialization: AVX2 or SSE2 where the CPU
+	supports it, scalar code otherwise. All of them give identical results. */
+class VoxelKernels
+{
+	public:
+		enum Isa
+		{
+			SCALAR,
+			SSE2,
+			AVX2
+		};
+		/*! writes base with top merged onto it to out: erased voxels of top clear the voxel,
+			non-empty voxels of top replace it. out may be base. If changed is given, bit (i & 63)
+			of changed[i / 64] gets set for every voxel i that differs from base.
+			Returns the number of non-empty voxels in out */
+		static int merge(const VoxelEntry *base, const VoxelEntry *top, VoxelEntry *out,
+						 uint64_t changed[GRID_VOLUME / 64] = nullptr);
+		static int merge(const VoxelBlockAoS &base, const VoxelBlockAoS &top, VoxelBlockAoS &out,
+						 uint64_t changed[GRID_VOLUME / 64] = nullptr)
+		{
+			return merge(base.entries, top.entries, out.entries, changed);
+		}
+		static int merge(const VoxelBlockSoA &base, const VoxelBlockSoA &top, VoxelBlockSoA &out,
+						 uint64_t changed[GRID_VOLUME / 64] = nullptr);
+		//! the instruction set merge() uses
+		static Isa activeIsa();
+		static const char* isaName(Isa isa);
+		//! overrides the runtime selection, e.g. to compare implementations; unsupported ones are ignored
+		static void setIsa(Isa isa);
+	protected:
+		typedef int (*mergeFunc_t)(const VoxelEntry*, const VoxelEntry*, VoxelEntry*, uint64_t*);
+		typedef int (*mergeSoAFunc_t)(const VoxelBlockSoA&, const VoxelBlockSoA&, VoxelBlockSoA&, uint64_t*);
+		static mergeFunc_t select(Isa isa);
+		static mergeSoAFunc_t selectSoA(Isa isa);
+		static bool supported(Isa isa);
+		static mergeFunc_t mergeFunc;
+		static mergeSoAFunc_t mergeSoAFunc;
+		static Isa isa;
+};
+
+#endif // VG_VOXELKERNELS_H
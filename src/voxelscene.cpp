@@ -17,8 +17,16 @@ VoxelLayer::~VoxelLayer()
 {
 	std::cout << "deleting layer...\n";
 	delete aggregate;
-	if (renderAg)
-		std::cout << "Warning: deleting VoxelLayer with RenderAggregate\n";
+}
+
+static DirtyVolume blockVolume(uint64_t blockId)
+{
+	DirtyVolume vol;
+	VoxelAggregate::blockPos(blockId, vol.low);
+	for (int i = 0; i < 3; ++i)
+		vol.high[i] = vol.low[i] + GRID_LEN - 1;
+	vol.valid = true;
+	return vol;
 }
 
 VoxelScene::VoxelScene(): viewport(0), voxelTemplate(128, 128, 255, 255), activeLayerN(0), dirty(true)
@@ -31,12 +39,12 @@ VoxelScene::VoxelScene(): viewport(0), voxelTemplate(128, 128, 255, 255), active
 	layers.push_back(editingLayer);
 	renderLayer = new VoxelLayer;
 	renderLayer->aggregate = new VoxelAggregate();
-	editingLayer->renderAg = new RenderAggregate(renderLayer->aggregate);
-	//renderLayer->renderAg = editingLayer->renderAg; // note: only for independent layer mode
 	//
 	//renderLayer = new VoxelAggregate();
 	//editingLayer = new VoxelAggregate();
 	toolLayer = new VoxelAggregate();
+	flatAggregate = new VoxelAggregate();
+	flatRenderAg = new RenderAggregate(flatAggregate);
 }
 
 VoxelScene::~VoxelScene()
@@ -44,17 +52,16 @@ VoxelScene::~VoxelScene()
 	delete renderLayer;
 	delete editingLayer;
 	delete toolLayer;
+	delete flatRenderAg;
+	delete flatAggregate;
 }
 
 void VoxelScene::setActiveLayer(int layerN)
 {
 	// TODO: make sure pending tool changes are handled properly
-	// TODO: handler layer compositing mode
-	// Reset current active editing layer to its own aggregate, and the new active to renderLayer
-	editingLayer->renderAg->setAggregate(editingLayer->aggregate);
 	editingLayer = layers[layerN];
-	editingLayer->renderAg->setAggregate(renderLayer->aggregate);
-	// render layer aggregate needs to be set to editing layer (shallow copy)
+	// render layer aggregate needs to be set to editing layer (shallow copy),
+	// the flattened result doesn't change because it has the same content
 	renderLayer->aggregate->clone(*editingLayer->aggregate);
 	activeLayerN = layerN;
 	viewport->activeLayerChanged(layerN);
@@ -106,10 +113,7 @@ void VoxelScene::insertLayer(VoxelLayer *layer, int layerN)
 		++activeLayerN;
 	if (!layer->aggregate)
 		std::cout << "Error: inserting layer without VoxelAggregate!\n";
-	if (layer->renderAg)
-		std::cout << "Error: inserting layer with renderAg\n";
-	layer->renderAg = new RenderAggregate(layer->aggregate);
-	layer->renderInitialized = false;
+	invalidateBlocks(layer->aggregate);
 	assert(editingLayer == layers[activeLayerN]);
 }
 
@@ -129,9 +133,7 @@ VoxelLayer* VoxelScene::removeLayer(int layerN)
 		else */
 			--activeLayerN;
 	}
-	removedRAg.push_back(layer->renderAg);
-	layer->renderAg = 0;
-	layer->renderInitialized = false;
+	invalidateBlocks(layer->aggregate);
 	assert(activeLayerN < (int)layers.size());
 	assert(editingLayer == layers[activeLayerN]);
 	return layer;
@@ -150,58 +152,172 @@ void VoxelScene::moveLayer(int layerN, int targetN)
 		--activeLayerN;
 	else if(layerN > activeLayerN && targetN <= activeLayerN)
 		++activeLayerN;
+	// only blocks the moved layer contributes to can change
+	invalidateLayer(layer);
 }
 
 void VoxelScene::update()
 {
-	renderLayer->aggregate->clearBlocks(editingLayer->dirtyVolumes/* changedBlocks */);
-	// TODO: for each visible scene layer instead of single editing layer
-	renderLayer->aggregate->merge(*editingLayer->aggregate, editingLayer->dirtyVolumes/* changedBlocks */);
-	renderLayer->aggregate->merge(*toolLayer, editingLayer->dirtyVolumes/* changedBlocks */);
+	// only the dirty volumes get composited, and blocks that end up unchanged need no flattening
+	for (auto &volume: editingLayer->dirtyVolumes)
+	{
+		if (renderLayer->aggregate->composite(*editingLayer->aggregate, *toolLayer, volume.first, volume.second))
+			flattenVolumes[volume.first].join(volume.second);
+	}
+	editingLayer->dirtyVolumes.clear();
+	for (auto &layer: layers)
+	{
+		for (auto &volume: layer->dirtyVolumes)
+			flattenVolumes[volume.first].join(volume.second);
+		layer->dirtyVolumes.clear();
+	}
+	flatten();
 	//std::cout << "VoxelScene::update() editing layer block count:" << editingLayer->aggregate->blockCount() << std::endl;
-	//changedBlocks.clear();
 }
 
-void VoxelScene::render(QOpenGLFunctions_3_3_Core &glf)
+void VoxelScene::invalidateBlocks(const VoxelAggregate *aggregate)
 {
-	// TODO: split updating from rendering
-	for (auto &renderAg: removedRAg)
+	for (auto &block: aggregate->getBlockMap())
+		flattenVolumes[block.first] = blockVolume(block.first);
+	dirty = true;
+}
+
+void VoxelScene::invalidateLayer(const VoxelLayer *layer)
+{
+	invalidateBlocks(layer == editingLayer ? renderLayer->aggregate : layer->aggregate);
+}
+
+void VoxelScene::flatten()
+{
+	for (auto &volume: flattenVolumes)
+	{
+		DirtyVolume changed;
+		if (flattenBlock(volume.first, volume.second, changed))
+			VoxelAggregate::markDirtyBlocks(changed, changedBlocks);
+	}
+	flattenVolumes.clear();
+}
+
+bool VoxelScene::flattenBlock(uint64_t blockId, const DirtyVolume &vol, DirtyVolume &changed)
+{
+	struct Contribution
 	{
-		renderAg->clear(glf);
-		delete renderAg;
+		const VoxelGrid *grid;
+		VoxelLayer::BlendMode mode;
+		const VoxelAggregate *aggregate;
+	};
+	Contribution sources[64];
+	std::vector<Contribution> moreSources;
+	Contribution *contrib = sources;
+	int nContrib = 0;
+	if (layers.size() > 64)
+	{
+		moreSources.resize(layers.size());
+		contrib = moreSources.data();
 	}
-	removedRAg.clear();
 	for (auto &layer: layers)
 	{
-		if (layer->visible)
+		if (!layer->visible)
+			continue;
+		// the editing layer contributes with pending tool changes
+		const VoxelAggregate *aggregate = layer == editingLayer ? renderLayer->aggregate : layer->aggregate;
+		const VoxelGrid *grid = aggregate->getBlock(blockId);
+		// masks and paint have no effect without voxels below
+		if (grid && (nContrib > 0 || layer->blendMode == VoxelLayer::BLEND_REPLACE))
+			contrib[nContrib++] = { grid, layer->blendMode, aggregate };
+	}
+	const VoxelGrid *oldGrid = flatAggregate->getBlock(blockId);
+	// the common case of a single opaque layer shares its grid instead of copying voxels
+	if (nContrib == 1)
+	{
+		if (oldGrid == contrib[0].grid)
+			return false;
+		IBBox bound(vol.low, vol.high + IVector3D(1, 1, 1));
+		// outside of vol, the old grid already has the flattened voxels
+		if (oldGrid && oldGrid->contentId() == contrib[0].grid->contentId())
+			changed = DirtyVolume();
+		else if (oldGrid)
+			VoxelAggregate::diffVoxels(*oldGrid, *contrib[0].grid, bound, changed);
+		else
+			changed = vol;
+		flatAggregate->shareBlock(blockId, *contrib[0].aggregate);
+		return changed.valid;
+	}
+	if (nContrib == 0)
+	{
+		if (!oldGrid)
+			return false;
+		flatAggregate->clearBlocks(blockSet_t{ blockId });
+		changed = vol;
+		return true;
+	}
+	// the flattened content only depends on the contributing grids and modes, so derive its content ID
+	// from theirs; showing a layer again then yields the ID of the mesh cached when it was hidden
+	uint64_t flatId = 0;
+	for (int i = 0; i < nContrib; ++i)
+	{
+		flatId = (flatId ^ contrib[i].grid->contentId()) * 0x9E3779B97F4A7C15ull + contrib[i].mode;
+		flatId ^= flatId >> 31;
+	}
+	flatId |= 1ull << 63;
+	if (oldGrid && oldGrid->contentId() == flatId)
+		return false;
+	const VoxelEntry emptyEntry;
+	VoxelGrid *target = nullptr;
+	for (int z = vol.low.z; z <= vol.high.z; ++z)
+		for (int y = vol.low.y; y <= vol.high.y; ++y)
+			for (int x = vol.low.x; x <= vol.high.x; ++x)
+	{
+		IVector3D pos(x & (GRID_LEN - 1), y & (GRID_LEN - 1), z & (GRID_LEN - 1));
+		VoxelEntry result;
+		for (int i = 0; i < nContrib; ++i)
 		{
-			if (!layer->renderInitialized)
-			{
-				layer->renderAg->rebuild(glf, &viewport->getRenderOptions());
-				layer->renderInitialized = true;
-			}
-
-			if (!layer->dirtyVolumes.empty())
-			{
-				blockSet_t dirtyBlocks;
-				// convert dirty volumes to dirty blocks
-				for (auto &volume: layer->dirtyVolumes)
-				{
-					VoxelAggregate::markDirtyBlocks(volume.second, dirtyBlocks);
-				}
-				layer->renderAg->update(glf, dirtyBlocks);
-				layer->dirtyVolumes.clear();
-			}
-			layer->renderAg->render(glf);
+			const VoxelEntry *entry = contrib[i].grid->getVoxel(pos);
+			if (!(entry->flags & Voxel::VF_NON_EMPTY))
+				continue;
+			if (contrib[i].mode == VoxelLayer::BLEND_REPLACE)
+				result = *entry;
+			else if (contrib[i].mode == VoxelLayer::BLEND_MASK)
+				result = emptyEntry;
+			else if (result.flags & Voxel::VF_NON_EMPTY)
+				result.col = entry->col;
 		}
+		const VoxelEntry *current = target ? target->getVoxel(pos) : (oldGrid ? oldGrid->getVoxel(pos) : &emptyEntry);
+		if (*current == result)
+			continue;
+		if (!target)
+			target = flatAggregate->writableBlock(blockId);
+		target->setVoxel(pos.x, pos.y, pos.z, result);
+		changed.addPosition(IVector3D(x, y, z));
 	}
+	// the old grid may be shared with a layer, re-tagging it needs a copy of its own
+	if (!target && oldGrid)
+		target = flatAggregate->writableBlock(blockId);
+	if (target)
+		target->setContentId(flatId);
+	return changed.valid;
+}
+
+void VoxelScene::render(QOpenGLFunctions_3_3_Core &glf, const QMatrix4x4 &viewProj)
+{
+	// TODO: split updating from rendering
+	if (!renderInitialized)
+	{
+		flatRenderAg->rebuild(glf, &viewport->getRenderOptions());
+		renderInitialized = true;
+		changedBlocks.clear();
+	}
+	else if (!changedBlocks.empty())
+	{
+		flatRenderAg->update(glf, changedBlocks);
+		changedBlocks.clear();
+	}
+	flatRenderAg->render(glf, viewProj);
 	dirty = false;
 	// TODO: probably should not be rendered here but after all opaque things
 	glf.glEnable(GL_BLEND);
     glf.glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	for (auto &layer: layers)
-		if (layer->visible)
-			layer->renderAg->renderTransparent(glf);
+	flatRenderAg->renderTransparent(glf);
 
 	glf.glDisable(GL_BLEND);
 	//dirtyBlocks.clear();
@@ -227,20 +343,38 @@ bool VoxelScene::rayIntersect(const ray_t &ray, SceneRayHit &hit, int flags) con
 	return didHit;
 }
 
+int VoxelScene::rayIntersectBatch(const RayPacket &rays, std::vector<SceneRayHit> &hits, int flags) const
+{
+	int nHits = 0;
+	hits.resize(rays.size());
+	if (flags & SceneRayHit::HIT_VOXEL)
+		nHits = editingLayer->aggregate->rayIntersectBatch(rays, hits.data());
+	else
+		for (auto &hit: hits)
+			hit.flags = 0;
+	if (flags & SceneRayHit::HIT_LINEGRID)
+	{
+		for (int i = 0; i < rays.size(); ++i)
+		{
+			if (hits[i].didHit())
+				continue;
+			if (viewport->getGrid()->rayIntersect(rays.getRay(i), hits[i]))
+			{
+				hits[i].flags |= SceneRayHit::HIT_LINEGRID;
+				++nHits;
+			}
+		}
+	}
+	return nHits;
+}
+
 void VoxelScene::restoreAggregate(VoxelLayer *layer, AggregateMemento *memento)
 {
 	blockSet_t changed;
 	layer->aggregate->restoreState(memento, changed);
 	// convert changed blocks to dirty volumes, can't recover one (yet?) unfortunately
 	for (auto &block: changed)
-	{
-		DirtyVolume vol;
-		VoxelAggregate::blockPos(block, vol.low);
-		for (int i = 0; i < 3; ++i)
-			vol.high[i] = vol.low[i] + GRID_LEN - 1;
-		vol.valid = true;
-		layer->dirtyVolumes[block] = vol;
-	}
+		layer->dirtyVolumes[block] = blockVolume(block);
 	dirty = true;
 }
 
@@ -249,16 +383,13 @@ VoxelAggregate* VoxelScene::replaceAggregate(int layerN, VoxelAggregate *aggrega
 	VoxelLayer *layer = layers[layerN];
 	VoxelAggregate *old = layer->aggregate;
 	layer->aggregate = aggregate;
-	layer->renderInitialized = false;
 	if (layerN == activeLayerN)
 	{
 		// render layer aggregate needs to be set to editing layer (shallow copy)
 		// TODO: assert that toolLayer is empty, else need to either clear or re-apply it
 		renderLayer->aggregate->clone(*aggregate);
 	}
-	else
-	{
-		layer->renderAg->setAggregate(aggregate);
-	}
+	invalidateBlocks(old);
+	invalidateBlocks(aggregate);
 	return old;
 }
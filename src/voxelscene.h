@@ -23,6 +23,7 @@ class RenderGrid;
 class SceneProxy;
 class GlViewportWidget;
 class QOpenGLFunctions_3_3_Core;
+class QMatrix4x4;
 
 typedef std::unordered_map<uint64_t, DirtyVolume> dirtyMap_t;
 
@@ -35,7 +36,15 @@ class VoxelLayer
 			BOUND_CHANGED 		= 1 << 1,
 			USE_BOUND_CHANGED 	= 1 << 2,
 			VISIBILITY_CHANGED 	= 1 << 3,
-			ALL_CHANGED 		= 15
+			BLEND_MODE_CHANGED	= 1 << 4,
+			ALL_CHANGED 		= 31
+		};
+		//! how the voxels of a layer combine with the visible layers below it
+		enum BlendMode
+		{
+			BLEND_REPLACE,	//!< non-empty voxels replace the voxels below
+			BLEND_PAINT,	//!< only recolors non-empty voxels below
+			BLEND_MASK		//!< non-empty voxels erase the voxels below
 		};
 		VoxelLayer(): aggregate(0), visible(true), useBound(false), bound(IVector3D(0,0,0), IVector3D(16,16,16)) {}
 		~VoxelLayer();
@@ -44,9 +53,8 @@ class VoxelLayer
 		bool useBound;
 		IBBox bound;
 		std::string name;
-		// rendering
-		RenderAggregate *renderAg = 0;
-		bool renderInitialized = false;
+		BlendMode blendMode = BLEND_REPLACE;
+		// voxels changed since the last VoxelScene::update()
 		dirtyMap_t dirtyVolumes;
 };
 
@@ -79,8 +87,10 @@ class VoxelScene
 		void setTemplateMaterial(Voxel::Material mat) { voxelTemplate.setMaterial(mat); }
 		void setTemplateSpecular(Voxel::Specular spec) { voxelTemplate.setSpecular(spec); }
 		void update();
-		void render(QOpenGLFunctions_3_3_Core &glf);
+		void render(QOpenGLFunctions_3_3_Core &glf, const QMatrix4x4 &viewProj);
 		bool rayIntersect(const ray_t &ray, SceneRayHit &hit, int flags = SceneRayHit::HIT_MASK) const;
+		//! rayIntersect() for many rays at once, returns the number of hits
+		int rayIntersectBatch(const RayPacket &rays, std::vector<SceneRayHit> &hits, int flags = SceneRayHit::HIT_MASK) const;
 	protected:
 		void applyToolChanges(AggregateMemento *memento);
 		void insertLayer(VoxelLayer *layer, int layerN);
@@ -89,12 +99,27 @@ class VoxelScene
 		void restoreAggregate(VoxelLayer *layer, AggregateMemento *memento);
 		VoxelAggregate* replaceAggregate(int layerN, VoxelAggregate *aggregate);
 		void setActiveLayer(int layerN);
+		//! marks all blocks of aggregate for flattening, for changes of layer settings, order or existence
+		void invalidateBlocks(const VoxelAggregate *aggregate);
+		//! like invalidateBlocks(), but also covers the tool layer blocks of the editing layer
+		void invalidateLayer(const VoxelLayer *layer);
+		//! combines the visible layers into flatAggregate for the pending flattenVolumes
+		void flatten();
+		bool flattenBlock(uint64_t blockId, const DirtyVolume &vol, DirtyVolume &changed);
 		GlViewportWidget *viewport;
+		//! the editing layer with the tool layer merged on top
 		VoxelLayer *renderLayer;
 		VoxelLayer *editingLayer;
 		VoxelAggregate *toolLayer;
 		std::vector<VoxelLayer*> layers;
-		std::vector<RenderAggregate*> removedRAg;
+		//! all visible layers flattened into one aggregate, which is the only one that gets rendered
+		VoxelAggregate *flatAggregate;
+		RenderAggregate *flatRenderAg;
+		bool renderInitialized = false;
+		//! parts of flatAggregate that need to be recalculated
+		dirtyMap_t flattenVolumes;
+		//! blocks of flatAggregate to retesselate
+		std::unordered_set<uint64_t> changedBlocks;
 		VoxelEntry voxelTemplate;
 		int activeLayerN;
 		bool dirty;
@@ -0,0 +1,332 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Implements the palette compressed voxel storage of a 16x16x16 grid */
+
+#include "voxelstorage.h"
+
+#include <cstring>
+
+// palettes up to this size get searched linearly
+#define LINEAR_SEARCH_MAX 16
+// must be a power of two and larger than 1 << MAX_PALETTE_BITS
+#define LOOKUP_SIZE 512
+
+static inline unsigned int hashEntry(const VoxelEntry &value)
+{
+	uint32_t h = value.col.raw * 0x9E3779B1u ^ value.flags * 0x85EBCA77u;
+	h ^= h >> 15;
+	return h & (LOOKUP_SIZE - 1);
+}
+
+static inline int bitsForSize(int paletteSize)
+{
+	int bits = 0;
+	while ((1 << bits) < paletteSize)
+		bits = bits ? bits * 2 : 1;
+	return bits;
+}
+
+void VoxelStorage::set(int index, const VoxelEntry &value)
+{
+	if (bits == DENSE_BITS)
+	{
+		palette[index] = value;
+		return;
+	}
+	if (palette.empty())
+		fill(VoxelEntry());
+	int entry = findEntry(value);
+	if (entry < 0)
+	{
+		entry = addEntry(value);
+		if (bits == DENSE_BITS)
+		{
+			palette[index] = value;
+			return;
+		}
+	}
+	if (bits != 0)
+		setPaletteIndex(index, entry);
+}
+
+void VoxelStorage::fill(const VoxelEntry &value)
+{
+	palette.assign(1, value);
+	std::vector<uint64_t>().swap(indices);
+	std::vector<uint16_t>().swap(lookup);
+	bits = 0;
+	lastEntry = 0;
+}
+
+void VoxelStorage::clear()
+{
+	std::vector<VoxelEntry>().swap(palette);
+	std::vector<uint64_t>().swap(indices);
+	std::vector<uint16_t>().swap(lookup);
+	bits = 0;
+	lastEntry = 0;
+}
+
+void VoxelStorage::swap(VoxelStorage &other)
+{
+	palette.swap(other.palette);
+	indices.swap(other.indices);
+	lookup.swap(other.lookup);
+	std::swap(bits, other.bits);
+	std::swap(lastEntry, other.lastEntry);
+}
+
+void VoxelStorage::decode(VoxelEntry *dense) const
+{
+	if (bits == DENSE_BITS)
+		memcpy(dense, palette.data(), GRID_VOLUME * sizeof(VoxelEntry));
+	else if (bits == 0)
+		std::fill(dense, dense + GRID_VOLUME, palette[0]);
+	else
+	{
+		const int perWord = 64 / bits;
+		const uint64_t mask = (1u << bits) - 1;
+		for (int w = 0, i = 0; i < GRID_VOLUME; ++w)
+		{
+			uint64_t word = indices[w];
+			for (int j = 0; j < perWord; ++j, ++i, word >>= bits)
+				dense[i] = palette[word & mask];
+		}
+	}
+}
+
+void VoxelStorage::decode(VoxelBlockSoA &dense) const
+{
+	if (bits == DENSE_BITS)
+	{
+		for (int i = 0; i < GRID_VOLUME; ++i)
+			dense.set(i, palette[i]);
+	}
+	else if (bits == 0)
+	{
+		std::fill(dense.colors, dense.colors + GRID_VOLUME, palette[0].col.raw);
+		std::fill(dense.flags, dense.flags + GRID_VOLUME, palette[0].flags);
+	}
+	else
+	{
+		// split the palette once instead of every voxel
+		uint32_t colors[1 << MAX_PALETTE_BITS];
+		uint16_t flags[1 << MAX_PALETTE_BITS];
+		for (size_t p = 0; p < palette.size(); ++p)
+		{
+			colors[p] = palette[p].col.raw;
+			flags[p] = palette[p].flags;
+		}
+		const int perWord = 64 / bits;
+		const uint64_t mask = (1u << bits) - 1;
+		for (int w = 0, i = 0; i < GRID_VOLUME; ++w)
+		{
+			uint64_t word = indices[w];
+			for (int j = 0; j < perWord; ++j, ++i, word >>= bits)
+			{
+				dense.colors[i] = colors[word & mask];
+				dense.flags[i] = flags[word & mask];
+			}
+		}
+	}
+}
+
+template<class D>
+void VoxelStorage::encodeBlock(const D &dense)
+{
+	uint16_t table[LOOKUP_SIZE] = {};
+	std::vector<uint8_t> pIndex(GRID_VOLUME);
+	palette.clear();
+	int last = -1;
+	for (int i = 0; i < GRID_VOLUME; ++i)
+	{
+		const VoxelEntry value = dense[i];
+		// runs of equal voxels are very common
+		if (last >= 0 && palette[last] == value)
+		{
+			pIndex[i] = last;
+			continue;
+		}
+		unsigned int slot = hashEntry(value);
+		while (table[slot] && palette[table[slot] - 1] != value)
+			slot = (slot + 1) & (LOOKUP_SIZE - 1);
+		if (!table[slot])
+		{
+			if (palette.size() == (1u << MAX_PALETTE_BITS))
+			{
+				// too many unique values
+				palette.resize(GRID_VOLUME);
+				for (int j = 0; j < GRID_VOLUME; ++j)
+					palette[j] = dense[j];
+				std::vector<uint64_t>().swap(indices);
+				std::vector<uint16_t>().swap(lookup);
+				bits = DENSE_BITS;
+				lastEntry = 0;
+				return;
+			}
+			palette.push_back(value);
+			table[slot] = palette.size();
+		}
+		last = table[slot] - 1;
+		pIndex[i] = last;
+	}
+	palette.shrink_to_fit();
+	bits = bitsForSize(palette.size());
+	std::vector<uint64_t>(GRID_VOLUME * bits / 64).swap(indices);
+	for (int i = 0; i < GRID_VOLUME && bits; ++i)
+		setPaletteIndex(i, pIndex[i]);
+	std::vector<uint16_t>().swap(lookup);
+	if (palette.size() > LINEAR_SEARCH_MAX)
+		buildLookup();
+	lastEntry = 0;
+}
+
+void VoxelStorage::encode(const VoxelEntry *dense)
+{
+	encodeBlock(dense);
+}
+
+void VoxelStorage::encode(const VoxelBlockSoA &dense)
+{
+	encodeBlock(dense);
+}
+
+bool VoxelStorage::anyFlags(unsigned int flags) const
+{
+	for (auto &entry: palette)
+		if (entry.flags & flags)
+			return true;
+	return false;
+}
+
+size_t VoxelStorage::memoryUsage() const
+{
+	return palette.capacity() * sizeof(VoxelEntry) + indices.capacity() * sizeof(uint64_t) +
+			lookup.capacity() * sizeof(uint16_t);
+}
+
+int VoxelStorage::findEntry(const VoxelEntry &value)
+{
+	if (lastEntry < (int)palette.size() && palette[lastEntry] == value)
+		return lastEntry;
+	if (!lookup.empty())
+	{
+		for (unsigned int slot = hashEntry(value); lookup[slot]; slot = (slot + 1) & (LOOKUP_SIZE - 1))
+		{
+			if (palette[lookup[slot] - 1] == value)
+				return lastEntry = lookup[slot] - 1;
+		}
+		return -1;
+	}
+	for (int i = 0; i < (int)palette.size(); ++i)
+	{
+		if (palette[i] == value)
+			return lastEntry = i;
+	}
+	return -1;
+}
+
+int VoxelStorage::addEntry(const VoxelEntry &value)
+{
+	if (palette.size() >= (1u << bits))
+	{
+		// try to make room before growing the indices
+		if (bits > 0)
+			compact();
+		if (palette.size() >= (1u << bits))
+		{
+			int newBits = bits ? bits * 2 : 1;
+			if (newBits > MAX_PALETTE_BITS)
+			{
+				makeDense();
+				return -1;
+			}
+			repack(newBits, std::vector<int>());
+		}
+	}
+	palette.push_back(value);
+	lastEntry = palette.size() - 1;
+	if (!lookup.empty())
+	{
+		unsigned int slot = hashEntry(value);
+		while (lookup[slot])
+			slot = (slot + 1) & (LOOKUP_SIZE - 1);
+		lookup[slot] = palette.size();
+	}
+	else if (palette.size() > LINEAR_SEARCH_MAX)
+		buildLookup();
+	return lastEntry;
+}
+
+void VoxelStorage::compact()
+{
+	bool used[1 << MAX_PALETTE_BITS] = {};
+	for (int i = 0; i < GRID_VOLUME; ++i)
+		used[paletteIndex(i)] = true;
+	std::vector<int> remap(palette.size(), 0);
+	std::vector<VoxelEntry> compacted;
+	for (int i = 0; i < (int)palette.size(); ++i)
+	{
+		if (used[i])
+		{
+			remap[i] = compacted.size();
+			compacted.push_back(palette[i]);
+		}
+	}
+	if (compacted.size() == palette.size())
+		return;
+	repack(bitsForSize(compacted.size()), remap);
+	palette.swap(compacted);
+	std::vector<uint16_t>().swap(lookup);
+	if (palette.size() > LINEAR_SEARCH_MAX)
+		buildLookup();
+	lastEntry = 0;
+}
+
+void VoxelStorage::repack(int newBits, const std::vector<int> &remap)
+{
+	std::vector<uint64_t> newIndices(GRID_VOLUME * newBits / 64);
+	if (newBits > 0 && bits > 0)
+	{
+		for (int i = 0; i < GRID_VOLUME; ++i)
+		{
+			unsigned int pIndex = paletteIndex(i);
+			if (!remap.empty())
+				pIndex = remap[pIndex];
+			unsigned int bitPos = i * newBits;
+			newIndices[bitPos >> 6] |= uint64_t(pIndex) << (bitPos & 63);
+		}
+	}
+	// growing from uniform leaves all indices at 0, which is correct
+	indices.swap(newIndices);
+	bits = newBits;
+}
+
+void VoxelStorage::buildLookup()
+{
+	lookup.assign(LOOKUP_SIZE, 0);
+	for (int i = 0; i < (int)palette.size(); ++i)
+	{
+		unsigned int slot = hashEntry(palette[i]);
+		while (lookup[slot])
+			slot = (slot + 1) & (LOOKUP_SIZE - 1);
+		lookup[slot] = i + 1;
+	}
+}
+
+void VoxelStorage::makeDense()
+{
+	std::vector<VoxelEntry> dense(GRID_VOLUME);
+	decode(dense.data());
+	palette.swap(dense);
+	std::vector<uint64_t>().swap(indices);
+	std::vector<uint16_t>().swap(lookup);
+	bits = DENSE_BITS;
+	lastEntry = 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * VoxelGem
+ *
+ *  Copyright 2018 by Lynx3d
+ *
+ *  SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef VG_VOXELSTORAGE_H
+#define VG_VOXELSTORAGE_H
+
+#include "voxelgem.h"
+
+#include <vector>
+
+#define GRID_LEN 16 // must be power of two
+#define LOG_GRID_LEN 4 // must be ld(GRID_LEN)
+#define GRID_VOLUME (GRID_LEN * GRID_LEN * GRID_LEN)
+
+static inline bool operator==(const VoxelEntry &v1, const VoxelEntry &v2)
+{
+	return v1.col.raw == v2.col.raw && v1.flags == v2.flags;
+}
+static inline bool operator!=(const VoxelEntry &v1, const VoxelEntry &v2) { return !(v1 == v2); }
+
+/*! Decoded voxels of a block in VoxelEntry order, i.e. colors and flags interleaved. */
+struct VoxelBlockAoS
+{
+	VoxelEntry entries[GRID_VOLUME];
+	const VoxelEntry& operator[](int index) const { return entries[index]; }
+	void set(int index, const VoxelEntry &value) { entries[index] = value; }
+};
+
+/*! Decoded voxels of a block with colors and flags in separate arrays. Flags only use the
+	low 16 bits, so this needs 6 instead of 8 bytes per voxel, flag tests read a third of the
+	memory, and SIMD code can load flags of many voxels without shuffling. */
+struct VoxelBlockSoA
+{
+	uint32_t colors[GRID_VOLUME];
+	uint16_t flags[GRID_VOLUME];
+	VoxelEntry operator[](int index) const { return VoxelEntry(colors[index], flags[index]); }
+	void set(int index, const VoxelEntry &value)
+	{
+		colors[index] = value.col.raw;
+		flags[index] = value.flags;
+	}
+};
+
+/* layout of the decoded blocks bulk grid operations work on; define VG_VOXEL_SOA
+   (waf configure --soa_voxels) for the structure-of-arrays layout */
+#ifdef VG_VOXEL_SOA
+typedef VoxelBlockSoA DenseBlock;
+#else
+typedef VoxelBlockAoS DenseBlock;
+#endif
+
+/*! Palette compressed voxel storage of one block.
+	Unique VoxelEntry values are kept in a palette, each voxel only stores a bit-packed palette
+	index of 1, 2, 4 or 8 bits. A block with one value only stores the palette (uniform), a block
+	with more than 256 values stores all voxels directly (dense).
+	A default constructed storage holds no data at all (null), which mementos use to mark
+	non-existing grids. */
+class VoxelStorage
+{
+	public:
+		enum
+		{
+			MAX_PALETTE_BITS = 8,
+			DENSE_BITS = 32
+		};
+		VoxelStorage(): bits(0) {}
+		//! all voxels get initialized to value
+		explicit VoxelStorage(const VoxelEntry &value) { fill(value); }
+		bool isNull() const { return palette.empty(); }
+		bool isUniform() const { return bits == 0 && !palette.empty(); }
+		bool isDense() const { return bits == DENSE_BITS; }
+		const VoxelEntry& operator[](int index) const
+		{
+			if (bits == 0)
+				return palette[0];
+			if (bits == DENSE_BITS)
+				return palette[index];
+			return palette[paletteIndex(index)];
+		}
+		//! the palette may contain unused entries until the next compaction
+		const std::vector<VoxelEntry>& getPalette() const { return palette; }
+		void set(int index, const VoxelEntry &value);
+		void fill(const VoxelEntry &value);
+		//! releases all data, storage becomes null
+		void clear();
+		void swap(VoxelStorage &other);
+		//! writes all GRID_VOLUME voxels to dense
+		void decode(VoxelEntry *dense) const;
+		void decode(VoxelBlockAoS &dense) const { decode(dense.entries); }
+		void decode(VoxelBlockSoA &dense) const;
+		//! replaces the content with the GRID_VOLUME voxels of dense, picking the smallest representation
+		void encode(const VoxelEntry *dense);
+		void encode(const VoxelBlockAoS &dense) { encode(dense.entries); }
+		void encode(const VoxelBlockSoA &dense);
+		//! true if any palette entry has one of the flags set; conservative due to unused entries
+		bool anyFlags(unsigned int flags) const;
+		//! heap memory used by this storage in bytes
+		size_t memoryUsage() const;
+	protected:
+		inline unsigned int paletteIndex(int index) const
+		{
+			unsigned int bitPos = index * bits;
+			return (indices[bitPos >> 6] >> (bitPos & 63)) & ((1u << bits) - 1);
+		}
+		inline void setPaletteIndex(int index, unsigned int pIndex)
+		{
+			unsigned int bitPos = index * bits;
+			uint64_t mask = uint64_t((1u << bits) - 1) << (bitPos & 63);
+			uint64_t &word = indices[bitPos >> 6];
+			word = (word & ~mask) | (uint64_t(pIndex) << (bitPos & 63));
+		}
+		int findEntry(const VoxelEntry &value);
+		int addEntry(const VoxelEntry &value);
+		//! drops unused palette entries and picks the smallest index width
+		void compact();
+		void repack(int newBits, const std::vector<int> &remap);
+		void buildLookup();
+		void makeDense();
+		//! encode() for any layout that returns VoxelEntry values from operator[]
+		template<class D> void encodeBlock(const D &dense);
+		std::vector<VoxelEntry> palette;
+		std::vector<uint64_t> indices;
+		//! open addressing hash for palette lookups, only used for larger palettes
+		std::vector<uint16_t> lookup;
+		int bits;
+		int lastEntry = 0;
+};
+
+#endif // VG_VOXELSTORAGE_H